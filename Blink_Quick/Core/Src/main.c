@@ -22,6 +22,8 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include <stdio.h>
+#include <string.h>
+#include "etx_boot_ctrl.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -33,6 +35,7 @@
 /* USER CODE BEGIN PD */
 #define MAJOR	0	/* Major version number	*/
 #define MINOR	4	/* Minor version number	*/
+#define PATCH	0	/* Patch version number	*/
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -45,7 +48,21 @@
 UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN PV */
-const uint8_t App_Version [2] = { MAJOR, MINOR };
+/* Image header, the post-link tool (etx_image) fills the size and the CRC */
+const ETX_IMAGE_HDR_ App_Header __attribute__((section(".image_header"))) =
+{
+  .magic         = ETX_IMAGE_MAGIC,
+  .hdr_version   = ETX_IMAGE_HDR_VERSION,
+  .hdr_size      = sizeof(ETX_IMAGE_HDR_),
+  .image_size    = ETX_IMAGE_UNSET,
+  .load_addr     = ETX_APP_LINK_ADDR,
+  .version_major = MAJOR,
+  .version_minor = MINOR,
+  .version_patch = PATCH,
+  .crc32         = ETX_IMAGE_UNSET,
+  .flags         = ETX_IMAGE_FLAG_PIC,
+  .reserved      = ETX_IMAGE_UNSET,
+};
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -66,6 +83,19 @@ void printdln(char *pMsg)
 	HAL_UART_Transmit(&huart2, pMsg, strlen(pMsg), 0xFFFF);
 }
 
+/* Append a decimal number. sprintf() can't be used: newlib is not position
+   independent and reads its own tables at link-time addresses. */
+static char *append_dec(char *pMsg, uint8_t value)
+{
+	pMsg += strlen(pMsg);
+	if (value >= 100) *pMsg++ = '0' + value / 100;
+	if (value >= 10)  *pMsg++ = '0' + (value / 10) % 10;
+	*pMsg++ = '0' + value % 10;
+	*pMsg = '\0';
+
+	return pMsg;
+}
+
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -103,8 +133,15 @@ int main(void)
   MX_GPIO_Init();
   MX_USART2_UART_Init();
   /* USER CODE BEGIN 2 */
-  sprintf(txt, "\bStarting Application (v%d.%d)\n", App_Version[0], App_Version[1]);
+  strcpy(txt, "\bStarting Application (v");
+  append_dec(txt, App_Header.version_major);
+  strcat(txt, ".");
+  append_dec(txt, App_Header.version_minor);
+  strcat(txt, ")\n");
   printd(txt);
+
+  /* We are up: tell the bootloader to keep this image */
+  etx_boot_ctrl_confirm();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -94,20 +94,11 @@
 #define USER_VECT_TAB_ADDRESS
 
 #if defined(USER_VECT_TAB_ADDRESS)
-/*!< Uncomment the following line if you need to relocate your vector Table
-     in Sram else user remap will be done in Flash. */
-/* #define VECT_TAB_SRAM */
-#if defined(VECT_TAB_SRAM)
-#define VECT_TAB_BASE_ADDRESS   SRAM_BASE       /*!< Vector Table base address field.
-                                                     This value must be a multiple of 0x200. */
-#define VECT_TAB_OFFSET         0x00000000U     /*!< Vector Table base offset field.
-                                                     This value must be a multiple of 0x200. */
-#else
-#define VECT_TAB_BASE_ADDRESS   FLASH_BASE      /*!< Vector Table base address field.
-                                                     This value must be a multiple of 0x200. */
-#define VECT_TAB_OFFSET         0x00040000U     /*!< Vector Table base offset field.
-                                                     This value must be a multiple of 0x200. */
-#endif /* VECT_TAB_SRAM */
+/*!< The image is position independent: its vector table holds link-time
+     addresses. It is copied in Sram with every handler moved by the load
+     offset, so the image runs from any application slot. */
+#define VECT_TAB_SRAM_WORDS     128U            /*!< Vector Table size in Sram (words).
+                                                     The table must be aligned on 0x200. */
 #endif /* USER_VECT_TAB_ADDRESS */
 /******************************************************************************/
 
@@ -126,6 +117,9 @@
 /** @addtogroup STM32F4xx_System_Private_Variables
   * @{
   */
+#if defined(USER_VECT_TAB_ADDRESS)
+static uint32_t VectTabSram[VECT_TAB_SRAM_WORDS] __attribute__((aligned(0x200)));
+#endif /* USER_VECT_TAB_ADDRESS */
   /* This variable is updated in three ways:
       1) by calling CMSIS function SystemCoreClockUpdate()
       2) by calling HAL API function HAL_RCC_GetHCLKFreq()
@@ -177,7 +171,25 @@ void SystemInit(void)
 
   /* Configure the Vector Table location -------------------------------------*/
 #if defined(USER_VECT_TAB_ADDRESS)
-  SCB->VTOR = VECT_TAB_BASE_ADDRESS | VECT_TAB_OFFSET; /* Vector Table Relocation in Internal SRAM */
+  {
+    extern uint32_t g_pfnVectors[];
+    extern uint32_t _eisr_vector[];
+    extern void Reset_Handler(void);
+
+    /* Symbol addresses come from the relocated GOT (run-time addresses),
+       the table content is the link-time one */
+    uint32_t offset = (uint32_t)&Reset_Handler - g_pfnVectors[1];
+    uint32_t nb     = (uint32_t)(_eisr_vector - g_pfnVectors);
+
+    VectTabSram[0] = g_pfnVectors[0];             /* Initial stack pointer, in Sram */
+    for (uint32_t i = 1U; (i < nb) && (i < VECT_TAB_SRAM_WORDS); i++)
+    {
+      VectTabSram[i] = (g_pfnVectors[i] != 0U) ? (g_pfnVectors[i] + offset) : 0U;
+    }
+
+    SCB->VTOR = (uint32_t)VectTabSram;            /* Vector Table Relocation in Internal SRAM */
+    __DSB();
+  }
 #endif /* USER_VECT_TAB_ADDRESS */
 }
 
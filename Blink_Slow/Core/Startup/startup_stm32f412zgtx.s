@@ -60,10 +60,19 @@ defined in linker script */
 Reset_Handler:  
   ldr   sp, =_estack       /* set stack pointer */
 
+/* Position independent image: the load offset (run address - link address)
+   is kept in r6 and added to every link-time flash address used below */
+  .align 2
+PicAnchor:
+  adr   r6, PicAnchor
+  ldr   r5, =PicAnchor
+  subs  r6, r6, r5
+
 /* Copy the data segment initializers from flash to SRAM */
   ldr r0, =_sdata
   ldr r1, =_edata
   ldr r2, =_sidata
+  add r2, r2, r6
   movs r3, #0
   b LoopCopyDataInit
 
@@ -91,10 +100,53 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Relocate the GOT (copied with the data segment): the entries pointing
+   into the image flash get the load offset */
+  ldr r0, =_sgot
+  ldr r1, =_egot
+  ldr r2, =__image_start__
+  ldr r3, =__image_end__
+  b LoopRelocGot
+
+RelocGot:
+  ldr r4, [r0]
+  cmp r4, r2
+  bcc NextGot
+  cmp r4, r3
+  bcs NextGot
+  add r4, r4, r6
+  str r4, [r0]
+
+NextGot:
+  adds r0, r0, #4
+
+LoopRelocGot:
+  cmp r0, r1
+  bcc RelocGot
+
+/* GOT base register (-msingle-pic-base -mpic-register=r9) */
+  ldr r9, =_sgot
+
 /* Call the clock system initialization function.*/
   bl  SystemInit   
-/* Call static constructors */
-    bl __libc_init_array
+/* Call static constructors. __libc_init_array is not position independent:
+   the init_array table and its entries are link-time addresses */
+  ldr r4, =__init_array_start
+  ldr r5, =__init_array_end
+  add r4, r4, r6
+  add r5, r5, r6
+  b LoopInitArray
+
+InitArray:
+  ldr r0, [r4]
+  adds r4, r4, #4
+  add r0, r0, r6
+  blx r0
+
+LoopInitArray:
+  cmp r4, r5
+  bcc InitArray
+
 /* Call the application's entry point.*/
   bl  main
   bx  lr    
@@ -112,6 +164,39 @@ Default_Handler:
 Infinite_Loop:
   b  Infinite_Loop
   .size  Default_Handler, .-Default_Handler
+
+/**
+ * @brief  Exception entries for the position independent image. An exception
+ *         can preempt newlib/libgcc code, which is not built with r9 reserved:
+ *         each veneer sets r9 to the GOT for its handler and restores it on
+ *         exit. There is one for every handler of stm32f4xx_it.c; the
+ *         peripheral vectors still go straight to their handler, so a
+ *         peripheral interrupt enabled later needs a veneer here too (and in
+ *         the vector table), or its handler runs with the r9 of the code it
+ *         preempted.
+ * @param  None
+ * @retval None
+*/
+.macro PIC_VENEER handler
+    .section  .text.\handler\()_Veneer,"ax",%progbits
+  .type  \handler\()_Veneer, %function
+\handler\()_Veneer:
+  push  {r9, lr}
+  ldr   r9, =_sgot
+  bl    \handler
+  pop   {r9, pc}
+  .size  \handler\()_Veneer, .-\handler\()_Veneer
+.endm
+
+  PIC_VENEER NMI_Handler
+  PIC_VENEER HardFault_Handler
+  PIC_VENEER MemManage_Handler
+  PIC_VENEER BusFault_Handler
+  PIC_VENEER UsageFault_Handler
+  PIC_VENEER SVC_Handler
+  PIC_VENEER DebugMon_Handler
+  PIC_VENEER PendSV_Handler
+  PIC_VENEER SysTick_Handler
 /******************************************************************************
 *
 * The minimal vector table for a Cortex M3. Note that the proper constructs
@@ -126,20 +211,20 @@ Infinite_Loop:
 g_pfnVectors:
   .word  _estack
   .word  Reset_Handler
-  .word  NMI_Handler
-  .word  HardFault_Handler
-  .word  MemManage_Handler
-  .word  BusFault_Handler
-  .word  UsageFault_Handler
+  .word  NMI_Handler_Veneer
+  .word  HardFault_Handler_Veneer
+  .word  MemManage_Handler_Veneer
+  .word  BusFault_Handler_Veneer
+  .word  UsageFault_Handler_Veneer
   .word  0
   .word  0
   .word  0
   .word  0
-  .word  SVC_Handler
-  .word  DebugMon_Handler
+  .word  SVC_Handler_Veneer
+  .word  DebugMon_Handler_Veneer
   .word  0
-  .word  PendSV_Handler
-  .word  SysTick_Handler
+  .word  PendSV_Handler_Veneer
+  .word  SysTick_Handler_Veneer
 
   /* External Interrupts */
   .word     WWDG_IRQHandler                   /* Window WatchDog                             */
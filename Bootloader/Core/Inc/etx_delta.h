@@ -0,0 +1,60 @@
+/*
+ * etx_delta.h
+ *
+ *  Delta update stream: the new image is rebuilt from the image of the
+ *  active slot (the base) and a list of records, as the stream arrives.
+ *
+ *  Record
+ *  ____________________________________
+ *  |    |        |        |            |
+ *  | Op | Length | Source | Payload    |
+ *  |____|________|________|____________|
+ *    1B     2B       4B     0 or Length
+ *
+ *  COPY: Length bytes of the base from Source, no payload
+ *  DIFF: Length bytes of the base from Source, plus the payload (byte by
+ *        byte, modulo 256): code moved by a few bytes differs only in its
+ *        addresses, the payload is mostly zeros (send it compressed)
+ *  DATA: the payload (Source unused)
+ *  Length and Source are little endian, as the fields of the protocol.
+ *
+ *  This header is shared with the host tool (ota_update), that builds the
+ *  delta.
+ */
+
+#include <stdint.h>
+
+#ifndef INC_ETX_DELTA_H_
+#define INC_ETX_DELTA_H_
+
+#define ETX_DELTA_HDR_SIZE      7u          // Record header
+#define ETX_DELTA_BLOCK_SIZE    1024u       // Rebuilt bytes written to the flash at once
+
+/*
+ * Record operations
+ */
+typedef enum
+{
+  ETX_DELTA_OP_COPY     = 0,
+  ETX_DELTA_OP_DIFF     = 1,
+  ETX_DELTA_OP_DATA     = 2,
+}ETX_DELTA_OP_;
+
+/*
+ * Decoder
+ */
+typedef struct
+{
+  const uint8_t *base;                      // Base image (in the flash)
+  uint32_t      base_size;
+  uint8_t       hdr[ETX_DELTA_HDR_SIZE];    // Record header being read
+  uint8_t       hdr_len;
+  uint8_t       op;                         // Current record
+  uint16_t      left;                       // Bytes of the record left to rebuild
+  uint32_t      src;                        // Next base byte of the record
+}ETX_DELTA_;
+
+void etx_delta_init( ETX_DELTA_ *delta, const uint8_t *base, uint32_t base_size );
+int32_t etx_delta_decode( ETX_DELTA_ *delta, const uint8_t *in, uint32_t len,
+                          uint8_t *out, uint16_t out_max, uint16_t *out_len );
+#endif /* INC_ETX_DELTA_H_ */
@@ -0,0 +1,36 @@
+/*
+ * etx_fec.h
+ *
+ *  Forward error correction of the data packets: Reed-Solomon over GF(256)
+ *  (polynomial 0x11D, generator roots alpha^0 to alpha^(ETX_FEC_NPAR-1)).
+ *
+ *  Block
+ *  ______________________________
+ *  |                 |          |
+ *  | Data            | Parity   |
+ *  |_________________|__________|
+ *   up to ETX_FEC_DATA  ETX_FEC_NPAR
+ *
+ *  The data is cut in blocks of ETX_FEC_DATA bytes (the last one shorter),
+ *  each followed by its parity: up to ETX_FEC_NPAR / 2 wrong bytes of a
+ *  block, wherever they are, are corrected by the receiver. A lost byte
+ *  can't be: the packet is sent again.
+ *
+ *  This header is shared with the host tool (ota_update), that encodes.
+ */
+
+#include <stdint.h>
+
+#ifndef INC_ETX_FEC_H_
+#define INC_ETX_FEC_H_
+
+#define ETX_FEC_NPAR    8u                              // Parity bytes of a block
+#define ETX_FEC_BLOCK   255u                            // Largest block, parity included
+#define ETX_FEC_DATA    ( ETX_FEC_BLOCK - ETX_FEC_NPAR )  // Data bytes of a full block
+
+#define ETX_FEC_SIZE( n ) ( (n) + ( ( (n) + ETX_FEC_DATA - 1u ) / ETX_FEC_DATA ) * ETX_FEC_NPAR )   //n bytes encoded
+
+void etx_fec_init( void );
+void etx_fec_encode( const uint8_t *data, uint16_t len, uint8_t *parity );
+int32_t etx_fec_decode( uint8_t *block, uint16_t len );
+#endif /* INC_ETX_FEC_H_ */
@@ -0,0 +1,25 @@
+/*
+ * etx_image_verify.h
+ *
+ *  Image validation: CRC32 of a slot computed by the CRC unit, fed by DMA2
+ *  (memory-to-memory). The result is cached in the RTC backup registers,
+ *  keyed by the image header and the flash write count, so a warm reset
+ *  doesn't check the image again.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+#ifndef INC_ETX_IMAGE_VERIFY_H_
+#define INC_ETX_IMAGE_VERIFY_H_
+
+#define ETX_VERIFY_DMA_STREAM     DMA2_Stream0      // Only DMA2 does memory-to-memory
+#define ETX_VERIFY_DMA_CHUNK      ( 16 * 1024 )     // Words per DMA transfer (NDTR is 16-bit)
+
+#define ETX_VERIFY_CACHE_MAGIC    0x444C4156        // "VALD"
+#define ETX_VERIFY_CACHE_WORDS    4u                // Backup registers per slot
+
+HAL_StatusTypeDef etx_image_crc( uint32_t addr, uint32_t image_size, uint32_t *crc );
+bool etx_image_verify( uint8_t slot, bool *cached );
+#endif /* INC_ETX_IMAGE_VERIFY_H_ */
@@ -0,0 +1,69 @@
+/*
+ * etx_lz.h
+ *
+ *  Compressed image stream (ETX_OTA_PACKET_TYPE_DATA_COMPRESSED): LZSS with
+ *  a 4KB window, decoded as it arrives, across packet boundaries.
+ *
+ *  The stream is a sequence of groups: one flag byte, then up to 8 items,
+ *  one per flag bit (LSB first).
+ *    0: literal, 1 byte
+ *    1: match, copy of earlier output
+ *
+ *  Match
+ *  ________________________________________
+ *  |        |            |           |     |
+ *  | Length | Dist[11:8] | Dist[7:0] | Ext |
+ *  |________|____________|___________|_____|
+ *      4b         4b          1B      0-1B
+ *
+ *  Distance - 1 on 12 bits (1 to 4096 bytes back).
+ *  Length - 3 on 4 bits (3 to 17 bytes), 15: an extra byte follows,
+ *  length = 18 + Ext (18 to 273 bytes).
+ *
+ *  This header is shared with the host tool (ota_update), that compresses.
+ */
+
+#include <stdint.h>
+
+#ifndef INC_ETX_LZ_H_
+#define INC_ETX_LZ_H_
+
+#define ETX_LZ_WINDOW_SIZE  4096u       // Largest match distance, and decoder RAM
+#define ETX_LZ_MIN_MATCH    3u
+#define ETX_LZ_MAX_MATCH    ( 18u + 255u )
+#define ETX_LZ_LEN_EXT      15u         // Length code followed by an extra byte
+#define ETX_LZ_BLOCK_SIZE   1024u       // Decoded bytes written to the flash at once:
+                                        // divides the window, holds the image header
+
+/*
+ * Decoder state
+ */
+typedef enum
+{
+  ETX_LZ_STATE_FLAGS    = 0,    // Next byte is a flag byte
+  ETX_LZ_STATE_ITEM     = 1,    // Literal, or first byte of a match
+  ETX_LZ_STATE_MATCH    = 2,    // Second byte of a match
+  ETX_LZ_STATE_EXT      = 3,    // Extra length byte of a match
+}ETX_LZ_STATE_;
+
+/*
+ * Decoder
+ *
+ * The window holds the last 4KB of output: the matches are copied from it,
+ * and the OTA engine writes it to the flash by blocks.
+ */
+typedef struct
+{
+  uint8_t   window[ETX_LZ_WINDOW_SIZE];
+  uint32_t  out_size;       // Bytes decoded since etx_lz_init()
+  uint8_t   state;          // ETX_LZ_STATE_
+  uint8_t   flags;          // Flags of the items left in the group
+  uint8_t   nb_flags;       // Items left in the group
+  uint8_t   token;          // First byte of the match being read
+  uint16_t  match_len;      // Bytes of the current match left to copy
+  uint16_t  match_dist;
+}ETX_LZ_;
+
+void etx_lz_init( ETX_LZ_ *lz );
+int32_t etx_lz_decode( ETX_LZ_ *lz, const uint8_t *in, uint32_t len, uint32_t out_max );
+#endif /* INC_ETX_LZ_H_ */
@@ -0,0 +1,698 @@
+/*
+ * etx_ota_proto.h
+ *
+ *  OTA protocol: packet types, commands, payloads and the codec of the
+ *  frames. This header is the only definition of the protocol: the
+ *  bootloader (etx_ota_update.h) and the host tool (ota_update.h) include it.
+ *
+ *  Frame
+ *  ____________________________________________
+ *  |     | Packet |     |        |     |     |
+ *  | SOF | Type   | Len |  Data  | CRC | EOF |
+ *  |_____|________|_____|________|_____|_____|
+ *    1B      1B     4B    Len B    4B    1B
+ *
+ *  Data, by packet type
+ *    CMD              1B: ETX_OTA_CMD_
+ *    HEADER           ETX_OTA_META_SIZE: meta_info
+ *    DATA             host: 4B stream offset, image bytes
+ *                     device: the reply of a command (ETX_OTA_INFO_,
+ *                     ETX_OTA_STATS_SIZE stage timing table)
+ *    DATA_COMPRESSED  4B stream offset, compressed image stream (etx_lz.h)
+ *    DATA_SKIP        4B stream offset, 4B length of a run of erased bytes
+ *    DATA, DATA_COMPRESSED | ETX_OTA_PACKET_FEC
+ *                     the same, cut in blocks each followed by its
+ *                     Reed-Solomon parity (etx_fec.h)
+ *    RESPONSE         ETX_OTA_RESP_SIZE: ETX_OTA_RESP_
+ *    CREDIT           ETX_OTA_RESP_SIZE: ETX_OTA_RESP_, sent by the device
+ *                     on its own
+ *
+ *  The stream offset of a data packet is where its bytes start in what the
+ *  host sends (the image, its delta or the compressed stream; a skipped run
+ *  counts for its length). The device takes the packets in sequence only
+ *  and gives the offset it expects next in every response: after a NACK the
+ *  host sends from there, a packet sent again after a lost ACK is
+ *  acknowledged without being written twice.
+ *
+ *  The response also gives the state of the device. ETX_OTA_CMD_SYNC is
+ *  taken in any state and changes nothing: after a lost response, the host
+ *  asks where the device is before it sends anything again.
+ *
+ *  Flow control: every response gives the credits of the device, the
+ *  packets it can take after the one at the offset of the response (its
+ *  receive buffers not held by a packet it has taken). The host counts the
+ *  data packets it sent that no response acknowledged yet, and never has
+ *  more of them than the credits. A data packet is acknowledged as soon as
+ *  it is in, its buffer stays taken until it is written: the device then
+ *  sends a CREDIT frame, with the result of the write (a NACK if it failed).
+ *  The responses come in the order of the packets.
+ *
+ *  The CRC is the CRC-32 of zlib/Ethernet over SOF, type, length and data.
+ *  The multi-byte fields are little-endian. The codec reads and writes them
+ *  byte by byte: a frame can sit anywhere in a buffer, and the payload of a
+ *  received frame is used where it is (ETX_OTA_FRAME_), not copied.
+ *
+ *  On the wire, each frame is COBS encoded (Consistent Overhead Byte
+ *  Stuffing) and followed by ETX_OTA_DELIM: the delimiter can't appear
+ *  inside a frame. A receiver that lost or got a wrong byte drops what it
+ *  has at the next delimiter and is in step again with the next frame,
+ *  whatever the length field said. The cost is 1 byte every 254 bytes, plus
+ *  the delimiter, whatever the data (image bytes are full of 0x00 and 0xFF).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "etx_fec.h"
+#include "etx_trace.h"
+
+#ifndef INC_ETX_OTA_PROTO_H_
+#define INC_ETX_OTA_PROTO_H_
+
+#define ETX_OTA_SOF  0xAA    // Start of Frame
+#define ETX_OTA_EOF  0xBB    // End of Frame
+#define ETX_OTA_ACK  0x00    // ACK
+#define ETX_OTA_NACK 0x01    // NACK
+
+#define ETX_OTA_DELIM 0x00   // End of a COBS encoded frame on the wire
+
+#define ETX_OTA_PROTOCOL_VERSION 6u   // Packet formats and commands below (2: 32-bit length, 3: COBS,
+                                      // 4: stream offset, NACK reasons, 5: SYNC, device state,
+                                      // 6: credits)
+
+#define ETX_OTA_DATA_MAX_SIZE ( 16 * 1024 )  //Maximum data Size (GET INFO gives the one of the device)
+#define ETX_OTA_DATA_OFFSET   (    6 )  //SOF, type and length before the data
+#define ETX_OTA_DATA_TRAILER  (    5 )  //CRC and EOF after the data
+#define ETX_OTA_DATA_OVERHEAD ( ETX_OTA_DATA_OFFSET + ETX_OTA_DATA_TRAILER )  //data overhead
+#define ETX_OTA_OFFSET_SIZE   (    4 )  //stream offset in front of the image data
+#define ETX_OTA_PACKET_MAX_SIZE ( ETX_FEC_SIZE( ETX_OTA_DATA_MAX_SIZE + ETX_OTA_OFFSET_SIZE ) + ETX_OTA_DATA_OVERHEAD )
+
+#define ETX_OTA_COBS_SIZE( n ) ( (n) + (n) / 254u + 1u )   //largest COBS encoding of n bytes
+#define ETX_OTA_WIRE_MAX_SIZE  ( ETX_OTA_COBS_SIZE( ETX_OTA_PACKET_MAX_SIZE ) + 1u )   //with the delimiter
+
+/*
+ * Packet type
+ */
+typedef enum
+{
+  ETX_OTA_PACKET_TYPE_CMD       = 0,    // Command
+  ETX_OTA_PACKET_TYPE_DATA      = 1,    // Data
+  ETX_OTA_PACKET_TYPE_HEADER    = 2,    // Header
+  ETX_OTA_PACKET_TYPE_RESPONSE  = 3,    // Response
+  ETX_OTA_PACKET_TYPE_DATA_COMPRESSED = 4, // Data, compressed image stream (etx_lz.h)
+  ETX_OTA_PACKET_TYPE_DATA_SKIP = 5,    // Data, run of erased bytes: 32-bit length, nothing to program
+  ETX_OTA_PACKET_TYPE_CREDIT    = 6,    // Credits of the device, once a data packet is written
+}ETX_OTA_PACKET_TYPE_;
+
+#define ETX_OTA_PACKET_FEC  0x80u   // Type flag of a DATA or DATA_COMPRESSED packet: with FEC parity
+
+/*
+ * OTA Commands
+ */
+typedef enum
+{
+  ETX_OTA_CMD_START = 0,    // OTA Start command
+  ETX_OTA_CMD_END   = 1,    // OTA End command
+  ETX_OTA_CMD_ABORT = 2,    // OTA Abort command
+  ETX_OTA_CMD_ROLLBACK = 3, // Go back to the previous image
+  ETX_OTA_CMD_GET_STATS = 4, // Read the stage timing table
+  ETX_OTA_CMD_GET_INFO = 5, // Read the device info (ETX_OTA_INFO_)
+  ETX_OTA_CMD_SYNC  = 6,    // Nothing to do: the response gives the state and the offset
+}ETX_OTA_CMD_;
+
+/*
+ * OTA process state (ETX_OTA_RESP_)
+ */
+typedef enum
+{
+  ETX_OTA_STATE_IDLE    = 0,
+  ETX_OTA_STATE_START   = 1,
+  ETX_OTA_STATE_HEADER  = 2,
+  ETX_OTA_STATE_DATA    = 3,
+  ETX_OTA_STATE_END     = 4,
+}ETX_OTA_STATE_;
+
+/*
+ * Reason of a NACK (ETX_OTA_RESP_)
+ */
+typedef enum
+{
+  ETX_OTA_NACK_NONE     = 0,    // ACK
+  ETX_OTA_NACK_CRC      = 1,    // Corrupted packet (decoding, length, CRC): send it again
+  ETX_OTA_NACK_SEQUENCE = 2,    // Data packet not at the expected offset: send from there
+  ETX_OTA_NACK_FLASH    = 3,    // Flash erase or programming failed
+  ETX_OTA_NACK_BUSY     = 4,    // Packet not taken now: send it again later (not sent yet)
+  ETX_OTA_NACK_STATE    = 5,    // Packet not expected in this state (or OTA Abort)
+  ETX_OTA_NACK_IMAGE    = 6,    // Image refused: header, size, delta base, stream or CRC
+}ETX_OTA_NACK_;
+
+/*
+ * Features of the device (ETX_OTA_INFO_)
+ */
+#define ETX_OTA_FEATURE_COMPRESSION ( 1u << 0 )   // ETX_OTA_PACKET_TYPE_DATA_COMPRESSED
+#define ETX_OTA_FEATURE_DELTA       ( 1u << 1 )   // meta_info base_crc
+#define ETX_OTA_FEATURE_SKIP        ( 1u << 2 )   // ETX_OTA_PACKET_TYPE_DATA_SKIP
+#define ETX_OTA_FEATURE_ROLLBACK    ( 1u << 3 )   // ETX_OTA_CMD_ROLLBACK
+#define ETX_OTA_FEATURE_STATS       ( 1u << 4 )   // ETX_OTA_CMD_GET_STATS
+#define ETX_OTA_FEATURE_PACKET_CRC  ( 1u << 5 )   // Packet CRC checked
+#define ETX_OTA_FEATURE_WINDOW      ( 1u << 6 )   // ETX_OTA_RESP_ credits, ETX_OTA_PACKET_TYPE_CREDIT
+#define ETX_OTA_FEATURE_FEC         ( 1u << 7 )   // ETX_OTA_PACKET_FEC
+
+/*
+ * OTA meta info, the data of the header packet (ETX_OTA_META_SIZE bytes)
+ */
+#define ETX_OTA_META_SIZE   16u
+
+typedef struct
+{
+  uint32_t package_size;
+  uint32_t package_crc;
+  uint32_t base_crc;     // Delta update: CRC of the image it applies to, 0 if none
+  uint32_t reserved2;
+}meta_info;
+
+/*
+ * Device info, the data packet sent back for ETX_OTA_CMD_GET_INFO (the ACK
+ * follows). The OTA session goes on: ETX_OTA_CMD_START may come next.
+ * ETX_OTA_INFO_SIZE bytes, in the order of the fields.
+ */
+#define ETX_OTA_INFO_SIZE   48u
+
+typedef struct
+{
+  uint8_t   protocol;       // ETX_OTA_PROTOCOL_VERSION
+  uint8_t   bl_major;       // Bootloader version
+  uint8_t   bl_minor;
+  uint8_t   nb_rx_buffers;  // Packets the device can hold (1: stop-and-wait)
+  uint32_t  max_payload;    // Largest data packet payload
+  uint8_t   program_width;  // Flash programming width, in bytes
+  uint8_t   active_slot;    // Slot of the running image, the other one is updated
+  uint16_t  reserved;
+  uint32_t  features;       // ETX_OTA_FEATURE_x
+  uint32_t  baud;           // Baud rate of the OTA UART (the only one)
+  uint32_t  slot_addr[2];   // Slot A and slot B
+  uint32_t  slot_size;
+  uint32_t  active_crc;     // CRC of the running image (delta base), 0 if none
+  uint32_t  uid[3];         // Device unique ID
+}ETX_OTA_INFO_;
+
+/*
+ * Stage timing table, the data packet sent back for ETX_OTA_CMD_GET_STATS
+ * (the ACK follows): ETX_TRACE_TABLE_ (etx_trace.h), in the order of the
+ * fields, each entry in the order of its fields. ETX_OTA_STATS_SIZE bytes.
+ */
+#define ETX_OTA_STATS_ENTRY_SIZE  8u
+#define ETX_OTA_STATS_SIZE        ( 24u + ETX_OTA_STATS_ENTRY_SIZE * ETX_TRACE_MAX_ENTRIES )
+
+/*
+ * Response, the data of a response packet (ETX_OTA_RESP_SIZE bytes)
+ */
+#define ETX_OTA_RESP_SIZE   8u
+
+typedef struct
+{
+  uint8_t   status;         // ETX_OTA_ACK or ETX_OTA_NACK
+  uint8_t   reason;         // ETX_OTA_NACK_
+  uint8_t   state;          // ETX_OTA_STATE_ after the packet
+  uint8_t   credits;        // Packets the device takes from now on, 0: wait for a CREDIT frame
+  uint32_t  next_offset;    // Stream offset of the next data packet expected
+}ETX_OTA_RESP_;
+
+/*
+ * Received frame: a view into the receive buffer
+ */
+typedef struct
+{
+  uint8_t         type;     // ETX_OTA_PACKET_TYPE_
+  uint32_t        len;      // Data length
+  const uint8_t  *data;     // Data, in the receive buffer
+  uint32_t        crc;
+}ETX_OTA_FRAME_;
+
+/*
+ * Image data of a received data packet
+ */
+typedef struct
+{
+  uint32_t        offset;   // Stream offset
+  const uint8_t  *data;     // Data, in the receive buffer
+  uint32_t        len;      // Data length
+}ETX_OTA_DATA_;
+
+/*
+ * COBS encoder: the bytes of a frame are given in pieces (head, data, tail)
+ */
+typedef struct
+{
+  uint8_t   *out;         // Encoded frame
+  uint32_t  len;          // Bytes written to out
+  uint32_t  code_pos;     // Code byte of the current block
+  uint8_t   code;         // 1 + bytes in the current block
+}ETX_OTA_COBS_;
+
+/*
+ * Little-endian fields
+ */
+static inline uint16_t etx_ota_get16( const uint8_t *p )
+{
+  return (uint16_t)( p[0] | ( p[1] << 8 ) );
+}
+
+static inline uint32_t etx_ota_get32( const uint8_t *p )
+{
+  return (uint32_t)p[0] | ( (uint32_t)p[1] << 8 ) | ( (uint32_t)p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+static inline void etx_ota_put16( uint8_t *p, uint16_t v )
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)( v >> 8 );
+}
+
+static inline void etx_ota_put32( uint8_t *p, uint32_t v )
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)( v >> 8 );
+  p[2] = (uint8_t)( v >> 16 );
+  p[3] = (uint8_t)( v >> 24 );
+}
+
+/**
+  * @brief CRC-32 (zlib, Ethernet) of bytes, 4 bits at a time: 64 bytes of
+  *        table, any length (the CRC unit of the STM32 takes words only).
+  * @param crc ETX_OTA_CRC_INIT, or the CRC of the bytes before
+  * @param data bytes
+  * @param len number of bytes
+  * @retval running CRC, etx_ota_crc_end() gives the final one
+  */
+#define ETX_OTA_CRC_INIT  0xFFFFFFFFu
+
+static inline uint32_t etx_ota_crc( uint32_t crc, const uint8_t *data, uint32_t len )
+{
+  static const uint32_t nibble[16] =
+  {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    crc ^= data[i];
+    crc = ( crc >> 4 ) ^ nibble[crc & 0x0Fu];
+    crc = ( crc >> 4 ) ^ nibble[crc & 0x0Fu];
+  }
+
+  return crc;
+}
+
+static inline uint32_t etx_ota_crc_end( uint32_t crc )
+{
+  return ~crc;
+}
+
+/**
+  * @brief Write the bytes before the data of a frame.
+  * @param head ETX_OTA_DATA_OFFSET bytes
+  * @param type packet type
+  * @param len data length
+  * @retval None
+  */
+static inline void etx_ota_frame_head( uint8_t *head, uint8_t type, uint32_t len )
+{
+  head[0] = ETX_OTA_SOF;
+  head[1] = type;
+  etx_ota_put32( &head[2], len );
+}
+
+/**
+  * @brief Write the bytes after the data of a frame.
+  * @param tail ETX_OTA_DATA_TRAILER bytes
+  * @param crc packet CRC
+  * @retval None
+  */
+static inline void etx_ota_frame_tail( uint8_t *tail, uint32_t crc )
+{
+  etx_ota_put32( &tail[0], crc );
+  tail[4] = ETX_OTA_EOF;
+}
+
+/**
+  * @brief Start the COBS encoding of a frame.
+  * @param cobs encoder
+  * @param out encoded frame, ETX_OTA_COBS_SIZE( frame size ) + 1 bytes
+  * @retval None
+  */
+static inline void etx_ota_cobs_begin( ETX_OTA_COBS_ *cobs, uint8_t *out )
+{
+  cobs->out      = out;
+  cobs->len      = 1u;
+  cobs->code_pos = 0u;
+  cobs->code     = 1u;
+}
+
+/**
+  * @brief Encode the next bytes of a frame.
+  * @param cobs encoder
+  * @param data bytes
+  * @param len number of bytes
+  * @retval None
+  */
+static inline void etx_ota_cobs_put( ETX_OTA_COBS_ *cobs, const uint8_t *data, uint32_t len )
+{
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    if( data[i] != ETX_OTA_DELIM )
+    {
+      cobs->out[cobs->len++] = data[i];
+      cobs->code++;
+    }
+
+    //a zero ends the block, so does a full one (254 bytes, no zero)
+    if( ( data[i] == ETX_OTA_DELIM ) || ( cobs->code == 0xFFu ) )
+    {
+      cobs->out[cobs->code_pos] = cobs->code;
+      cobs->code_pos = cobs->len++;
+      cobs->code     = 1u;
+    }
+  }
+}
+
+/**
+  * @brief End the COBS encoding of a frame, add the delimiter.
+  * @param cobs encoder
+  * @retval size of the encoded frame, delimiter included
+  */
+static inline uint32_t etx_ota_cobs_end( ETX_OTA_COBS_ *cobs )
+{
+  cobs->out[cobs->code_pos] = cobs->code;
+  cobs->out[cobs->len++]    = ETX_OTA_DELIM;
+
+  return cobs->len;
+}
+
+/**
+  * @brief Decode a COBS encoded frame, in place.
+  * @param buf encoded frame, without the delimiter
+  * @param len size of the encoded frame
+  * @retval size of the frame, 0 if buf isn't a valid encoding
+  */
+static inline uint32_t etx_ota_cobs_decode( uint8_t *buf, uint32_t len )
+{
+  uint32_t in  = 0u;
+  uint32_t out = 0u;
+
+  while( in < len )
+  {
+    uint8_t code = buf[in++];
+
+    if( ( code == ETX_OTA_DELIM ) || ( code - 1u > len - in ) )
+    {
+      return 0u;
+    }
+
+    for( uint8_t i = 1u; i < code; i++ )
+    {
+      buf[out++] = buf[in++];
+    }
+
+    //the zero the block stood for, not after a full block or the last one
+    if( ( code != 0xFFu ) && ( in < len ) )
+    {
+      buf[out++] = ETX_OTA_DELIM;
+    }
+  }
+
+  return out;
+}
+
+/**
+  * @brief Data length of a frame, from its first ETX_OTA_DATA_OFFSET bytes.
+  */
+static inline uint32_t etx_ota_frame_len( const uint8_t *head )
+{
+  return etx_ota_get32( &head[2] );
+}
+
+/**
+  * @brief Decode a received frame. The data stays in the buffer.
+  * @param buf received bytes, from the SOF
+  * @param len number of bytes received
+  * @param frame decoded frame
+  * @retval size of the frame, 0 if buf doesn't hold a complete frame
+  */
+static inline uint32_t etx_ota_frame_decode( const uint8_t *buf, uint32_t len, ETX_OTA_FRAME_ *frame )
+{
+  uint32_t data_len;
+
+  if( ( len < ETX_OTA_DATA_OVERHEAD ) || ( buf[0] != ETX_OTA_SOF ) )
+  {
+    return 0u;
+  }
+
+  data_len = etx_ota_frame_len( buf );
+
+  if( ( data_len > len - ETX_OTA_DATA_OVERHEAD ) ||
+      ( buf[ETX_OTA_DATA_OFFSET + data_len + 4u] != ETX_OTA_EOF ) )
+  {
+    return 0u;
+  }
+
+  frame->type = buf[1];
+  frame->len  = data_len;
+  frame->data = &buf[ETX_OTA_DATA_OFFSET];
+  frame->crc  = etx_ota_get32( &buf[ETX_OTA_DATA_OFFSET + data_len] );
+
+  return data_len + ETX_OTA_DATA_OVERHEAD;
+}
+
+/**
+  * @brief Check the CRC of a decoded frame.
+  * @param buf received bytes, from the SOF
+  * @param frame decoded frame
+  * @retval true if the CRC matches
+  */
+static inline bool etx_ota_frame_crc_ok( const uint8_t *buf, const ETX_OTA_FRAME_ *frame )
+{
+  return etx_ota_crc_end( etx_ota_crc( ETX_OTA_CRC_INIT, buf, ETX_OTA_DATA_OFFSET + frame->len ) ) == frame->crc;
+}
+
+/**
+  * @brief Command of a frame.
+  * @param frame received frame
+  * @param cmd command
+  * @retval true if it is a command frame
+  */
+static inline bool etx_ota_cmd_decode( const ETX_OTA_FRAME_ *frame, uint8_t *cmd )
+{
+  if( ( frame->type != ETX_OTA_PACKET_TYPE_CMD ) || ( frame->len != 1u ) )
+  {
+    return false;
+  }
+
+  *cmd = frame->data[0];
+  return true;
+}
+
+/**
+  * @brief Image data of a data frame (DATA, DATA_COMPRESSED, DATA_SKIP).
+  * @param frame received frame
+  * @param data stream offset and image data
+  * @retval true if it is a data frame with its stream offset
+  */
+static inline bool etx_ota_data_decode( const ETX_OTA_FRAME_ *frame, ETX_OTA_DATA_ *data )
+{
+  if( ( ( frame->type != ETX_OTA_PACKET_TYPE_DATA ) &&
+        ( frame->type != ETX_OTA_PACKET_TYPE_DATA_COMPRESSED ) &&
+        ( frame->type != ETX_OTA_PACKET_TYPE_DATA_SKIP ) ) || ( frame->len < ETX_OTA_OFFSET_SIZE ) )
+  {
+    return false;
+  }
+
+  data->offset = etx_ota_get32( frame->data );
+  data->data   = &frame->data[ETX_OTA_OFFSET_SIZE];
+  data->len    = frame->len - ETX_OTA_OFFSET_SIZE;
+  return true;
+}
+
+static inline void etx_ota_resp_encode( uint8_t *data, const ETX_OTA_RESP_ *resp )
+{
+  data[0] = resp->status;
+  data[1] = resp->reason;
+  data[2] = resp->state;
+  data[3] = resp->credits;
+  etx_ota_put32( &data[4], resp->next_offset );
+}
+
+/**
+  * @brief Response of a response frame, or of a credit frame.
+  * @param frame received frame
+  * @param resp ACK or NACK, reason, device state, credits, next offset expected
+  * @retval true if it is a response or a credit frame
+  */
+static inline bool etx_ota_resp_decode( const ETX_OTA_FRAME_ *frame, ETX_OTA_RESP_ *resp )
+{
+  if( ( ( frame->type != ETX_OTA_PACKET_TYPE_RESPONSE ) && ( frame->type != ETX_OTA_PACKET_TYPE_CREDIT ) ) ||
+      ( frame->len != ETX_OTA_RESP_SIZE ) )
+  {
+    return false;
+  }
+
+  resp->status      = frame->data[0];
+  resp->reason      = frame->data[1];
+  resp->state       = frame->data[2];
+  resp->credits     = frame->data[3];
+  resp->next_offset = etx_ota_get32( &frame->data[4] );
+  return true;
+}
+
+/**
+  * @brief Can the host go on after a NACK, sending again?
+  * @param reason ETX_OTA_NACK_
+  * @retval true for a corrupted packet, one out of sequence or not taken now
+  */
+static inline bool etx_ota_nack_retry( uint8_t reason )
+{
+  return ( reason == ETX_OTA_NACK_CRC ) || ( reason == ETX_OTA_NACK_SEQUENCE ) ||
+         ( reason == ETX_OTA_NACK_BUSY );
+}
+
+static inline void etx_ota_meta_encode( uint8_t *data, const meta_info *meta )
+{
+  etx_ota_put32( &data[0],  meta->package_size );
+  etx_ota_put32( &data[4],  meta->package_crc );
+  etx_ota_put32( &data[8],  meta->base_crc );
+  etx_ota_put32( &data[12], meta->reserved2 );
+}
+
+/**
+  * @brief Meta info of a header frame.
+  * @param frame received frame
+  * @param meta meta info
+  * @retval true if it is a header frame
+  */
+static inline bool etx_ota_meta_decode( const ETX_OTA_FRAME_ *frame, meta_info *meta )
+{
+  if( ( frame->type != ETX_OTA_PACKET_TYPE_HEADER ) || ( frame->len != ETX_OTA_META_SIZE ) )
+  {
+    return false;
+  }
+
+  meta->package_size = etx_ota_get32( &frame->data[0] );
+  meta->package_crc  = etx_ota_get32( &frame->data[4] );
+  meta->base_crc     = etx_ota_get32( &frame->data[8] );
+  meta->reserved2    = etx_ota_get32( &frame->data[12] );
+  return true;
+}
+
+static inline void etx_ota_info_encode( uint8_t *data, const ETX_OTA_INFO_ *info )
+{
+  data[0] = info->protocol;
+  data[1] = info->bl_major;
+  data[2] = info->bl_minor;
+  data[3] = info->nb_rx_buffers;
+  etx_ota_put32( &data[4], info->max_payload );
+  data[8] = info->program_width;
+  data[9] = info->active_slot;
+  etx_ota_put16( &data[10], info->reserved );
+  etx_ota_put32( &data[12], info->features );
+  etx_ota_put32( &data[16], info->baud );
+  etx_ota_put32( &data[20], info->slot_addr[0] );
+  etx_ota_put32( &data[24], info->slot_addr[1] );
+  etx_ota_put32( &data[28], info->slot_size );
+  etx_ota_put32( &data[32], info->active_crc );
+  etx_ota_put32( &data[36], info->uid[0] );
+  etx_ota_put32( &data[40], info->uid[1] );
+  etx_ota_put32( &data[44], info->uid[2] );
+}
+
+/**
+  * @brief Device info of a data frame (reply of ETX_OTA_CMD_GET_INFO).
+  * @param frame received frame
+  * @param info device info
+  * @retval true if the frame holds the device info
+  */
+static inline bool etx_ota_info_decode( const ETX_OTA_FRAME_ *frame, ETX_OTA_INFO_ *info )
+{
+  const uint8_t *data = frame->data;
+
+  if( ( frame->type != ETX_OTA_PACKET_TYPE_DATA ) || ( frame->len != ETX_OTA_INFO_SIZE ) )
+  {
+    return false;
+  }
+
+  info->protocol      = data[0];
+  info->bl_major      = data[1];
+  info->bl_minor      = data[2];
+  info->nb_rx_buffers = data[3];
+  info->max_payload   = etx_ota_get32( &data[4] );
+  info->program_width = data[8];
+  info->active_slot   = data[9];
+  info->reserved      = etx_ota_get16( &data[10] );
+  info->features      = etx_ota_get32( &data[12] );
+  info->baud          = etx_ota_get32( &data[16] );
+  info->slot_addr[0]  = etx_ota_get32( &data[20] );
+  info->slot_addr[1]  = etx_ota_get32( &data[24] );
+  info->slot_size     = etx_ota_get32( &data[28] );
+  info->active_crc    = etx_ota_get32( &data[32] );
+  info->uid[0]        = etx_ota_get32( &data[36] );
+  info->uid[1]        = etx_ota_get32( &data[40] );
+  info->uid[2]        = etx_ota_get32( &data[44] );
+  return true;
+}
+
+static inline void etx_ota_stats_encode( uint8_t *data, const ETX_TRACE_TABLE_ *table )
+{
+  etx_ota_put32( &data[0],  table->magic );
+  etx_ota_put32( &data[4],  table->core_clock );
+  etx_ota_put32( &data[8],  table->count );
+  etx_ota_put32( &data[12], table->boot );
+  etx_ota_put16( &data[16], table->rx_pool.blocks );
+  etx_ota_put16( &data[18], table->rx_pool.high_water );
+  etx_ota_put32( &data[20], table->rx_pool.empty );
+
+  for( uint32_t i = 0u; i < ETX_TRACE_MAX_ENTRIES; i++ )
+  {
+    uint8_t *entry = &data[24u + i * ETX_OTA_STATS_ENTRY_SIZE];
+
+    entry[0] = table->entry[i].stage;
+    entry[1] = table->entry[i].reserved;
+    etx_ota_put16( &entry[2], table->entry[i].boot );
+    etx_ota_put32( &entry[4], table->entry[i].cycles );
+  }
+}
+
+/**
+  * @brief Stage timing table of a data frame (reply of ETX_OTA_CMD_GET_STATS).
+  * @param frame received frame
+  * @param table stage timing table
+  * @retval true if the frame holds the table
+  */
+static inline bool etx_ota_stats_decode( const ETX_OTA_FRAME_ *frame, ETX_TRACE_TABLE_ *table )
+{
+  const uint8_t *data = frame->data;
+
+  if( ( frame->type != ETX_OTA_PACKET_TYPE_DATA ) || ( frame->len != ETX_OTA_STATS_SIZE ) )
+  {
+    return false;
+  }
+
+  table->magic              = etx_ota_get32( &data[0] );
+  table->core_clock         = etx_ota_get32( &data[4] );
+  table->count              = etx_ota_get32( &data[8] );
+  table->boot               = etx_ota_get32( &data[12] );
+  table->rx_pool.blocks     = etx_ota_get16( &data[16] );
+  table->rx_pool.high_water = etx_ota_get16( &data[18] );
+  table->rx_pool.empty      = etx_ota_get32( &data[20] );
+
+  for( uint32_t i = 0u; i < ETX_TRACE_MAX_ENTRIES; i++ )
+  {
+    const uint8_t *entry = &data[24u + i * ETX_OTA_STATS_ENTRY_SIZE];
+
+    table->entry[i].stage    = entry[0];
+    table->entry[i].reserved = entry[1];
+    table->entry[i].boot     = etx_ota_get16( &entry[2] );
+    table->entry[i].cycles   = etx_ota_get32( &entry[4] );
+  }
+  return true;
+}
+
+#endif /* INC_ETX_OTA_PROTO_H_ */
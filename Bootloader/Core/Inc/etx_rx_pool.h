@@ -0,0 +1,44 @@
+/*
+ * etx_rx_pool.h
+ *
+ *  Pool of receive buffers: ETX_OTA_RX_BUFFERS blocks, each one holds a
+ *  packet as it comes on the wire (COBS encoded, then decoded in place).
+ *
+ *  A block is taken for the receiver (USART6 interrupt), then handed to the
+ *  parser and, for a data packet, to the flash writer; the last owner puts
+ *  it back. Getting, handing and putting back a block take a constant time
+ *  (free list). The main loop alone calls these functions: the interrupt
+ *  only fills the blocks it was given. The free blocks, with the ones of
+ *  the receiver not filled yet, are the credits of the host (ETX_OTA_RESP_).
+ *
+ *  The most blocks taken at once and the requests that found none free
+ *  are kept with the stage timing (etx_trace.h), read with GET_STATS.
+ */
+
+#include <stdint.h>
+#include "etx_ota_update.h"
+
+#ifndef INC_ETX_RX_POOL_H_
+#define INC_ETX_RX_POOL_H_
+
+#define ETX_RX_POOL_BLOCK_SIZE  ( ( ETX_OTA_WIRE_MAX_SIZE + 3u ) & ~3u )    //A packet on the wire, word aligned
+
+/*
+ * Owner of a block
+ */
+typedef enum
+{
+  ETX_RX_OWNER_FREE   = 0,    // In the pool
+  ETX_RX_OWNER_RX     = 1,    // Receiver: for the next packet, or the packet is coming
+  ETX_RX_OWNER_PARSER = 2,    // Packet decoded and processed
+  ETX_RX_OWNER_FLASH  = 3,    // Data written to the flash
+  ETX_RX_OWNER_COUNT
+}ETX_RX_OWNER_;
+
+void etx_rx_pool_init( void );
+uint8_t *etx_rx_pool_get( void );
+void etx_rx_pool_give( uint8_t *buf, ETX_RX_OWNER_ owner );
+void etx_rx_pool_put( uint8_t *buf );
+uint16_t etx_rx_pool_free( void );
+uint16_t etx_rx_pool_owned( ETX_RX_OWNER_ owner );
+#endif /* INC_ETX_RX_POOL_H_ */
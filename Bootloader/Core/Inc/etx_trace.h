@@ -0,0 +1,101 @@
+/*
+ * etx_trace.h
+ *
+ *  Boot and OTA stage timing, measured with the DWT cycle counter.
+ *
+ *  Every measure is appended to a table in .noinit RAM (overwriting the
+ *  oldest one when it is full), so it survives a reset of the bootloader.
+ *  It has the last 1KB of the RAM (NOINIT in the linker scripts): the
+ *  applications end their RAM before it and leave it as it is.
+ *  The use of the receive buffer pool (etx_rx_pool.h) is kept there too.
+ *  The table is read back with ETX_OTA_CMD_GET_STATS (etx_ota_stats_encode).
+ *
+ *  This header is shared with the host tool (ota_update): types only.
+ */
+
+#include <stdint.h>
+
+#ifndef INC_ETX_TRACE_H_
+#define INC_ETX_TRACE_H_
+
+#define ETX_TRACE_MAGIC         0x45435254      // "TRCE"
+#define ETX_TRACE_MAX_ENTRIES   125u            // The table fits into one data packet (1KB)
+
+/*
+ * Stages
+ */
+typedef enum
+{
+  ETX_TRACE_HAL_INIT    = 0,    // HAL_Init()
+  ETX_TRACE_CLOCK       = 1,    // System clock configuration
+  ETX_TRACE_BUTTON      = 2,    // OTA button window
+  ETX_TRACE_RX_PACKET   = 3,    // Reception of one packet (first byte to delimiter)
+  ETX_TRACE_CRC         = 4,    // Image CRC
+  ETX_TRACE_ERASE       = 5,    // Slot erase
+  ETX_TRACE_PROGRAM     = 6,    // Programming of one data packet
+  ETX_TRACE_ACK         = 7,    // ACK/NACK transmission
+  ETX_TRACE_JUMP        = 8,    // From reset to the jump into the application
+  ETX_TRACE_STAGE_COUNT
+}ETX_TRACE_STAGE_;
+
+/*
+ * Trace entry
+ *
+ * _____________________________________
+ * |       |          |      |         |
+ * | Stage | Reserved | Boot | Cycles  |
+ * |_______|__________|______|_________|
+ *    1B       1B        2B      4B
+ */
+typedef struct
+{
+  uint8_t   stage;
+  uint8_t   reserved;
+  uint16_t  boot;           // Boot number the measure was taken in
+  uint32_t  cycles;
+}__attribute__((packed)) ETX_TRACE_ENTRY_;
+
+/*
+ * Receive buffer pool statistics, since the power-on reset
+ *
+ * _____________________________
+ * |        |            |       |
+ * | Blocks | High water | Empty |
+ * |________|____________|_______|
+ *     2B        2B         4B
+ */
+typedef struct
+{
+  uint16_t  blocks;         // Blocks of the pool (ETX_OTA_RX_BUFFERS)
+  uint16_t  high_water;     // Most blocks taken at once
+  uint32_t  empty;          // Packets that came with no block free (dropped)
+}__attribute__((packed)) ETX_TRACE_RX_POOL_;
+
+/*
+ * Trace table
+ *
+ * _________________________________________________________________
+ * |       | Core  |       |      |         |                        |
+ * | Magic | Clock | Count | Boot | RX pool | Entries                |
+ * |_______|_______|_______|______|_________|________________________|
+ *    4B      4B      4B      4B      8B      8B x ETX_TRACE_MAX_ENTRIES
+ *
+ * Count is the number of measures ever recorded: the next entry is
+ * Count % ETX_TRACE_MAX_ENTRIES.
+ */
+typedef struct
+{
+  uint32_t          magic;
+  uint32_t          core_clock;     // Cycles per second
+  uint32_t          count;
+  uint32_t          boot;
+  ETX_TRACE_RX_POOL_ rx_pool;
+  ETX_TRACE_ENTRY_  entry[ETX_TRACE_MAX_ENTRIES];
+}__attribute__((packed)) ETX_TRACE_TABLE_;
+
+void etx_trace_init( void );
+uint32_t etx_trace_now( void );
+void etx_trace_record( ETX_TRACE_STAGE_ stage, uint32_t start );
+const ETX_TRACE_TABLE_ *etx_trace_table( void );
+ETX_TRACE_RX_POOL_ *etx_trace_rx_pool( void );
+#endif /* INC_ETX_TRACE_H_ */
@@ -53,12 +53,17 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+void printd(char *pMsg);
+void printdln(char *pMsg);
 
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
 
 /* USER CODE BEGIN Private defines */
+#define BL_VERSION_MAJOR	3	/* Major version number	*/
+#define BL_VERSION_MINOR	2	/* Minor version number	*/
+
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef huart6;
 /* USER CODE END Private defines */
@@ -0,0 +1,106 @@
+/*
+ * etx_delta.c
+ *
+ *  Streaming decoder of the delta update stream (see etx_delta.h).
+ */
+
+#include <string.h>
+#include "etx_delta.h"
+#include "etx_ota_proto.h"
+
+/**
+  * @brief Start a new delta stream.
+  * @param delta decoder
+  * @param base base image
+  * @param base_size base image size
+  * @retval None
+  */
+void etx_delta_init( ETX_DELTA_ *delta, const uint8_t *base, uint32_t base_size )
+{
+  memset( delta, 0, sizeof(ETX_DELTA_) );
+  delta->base      = base;
+  delta->base_size = base_size;
+}
+
+/**
+  * @brief Rebuild a part of the new image.
+  *        Stops when the input is used up, or when out_max bytes have been
+  *        rebuilt (the rest of a record is kept for the next call).
+  * @param delta decoder
+  * @param in stream bytes
+  * @param len number of stream bytes
+  * @param out rebuilt image bytes
+  * @param out_max room in out
+  * @param out_len number of bytes rebuilt
+  * @retval number of stream bytes used, -1 if the stream is corrupt
+  */
+int32_t etx_delta_decode( ETX_DELTA_ *delta, const uint8_t *in, uint32_t len,
+                          uint8_t *out, uint16_t out_max, uint16_t *out_len )
+{
+  uint32_t i = 0u;
+  uint16_t o = 0u;
+
+  while( o < out_max )
+  {
+    if( delta->left == 0u )
+    {
+      //next record header
+      if( i >= len )
+      {
+        break;
+      }
+
+      delta->hdr[delta->hdr_len++] = in[i++];
+
+      if( delta->hdr_len < ETX_DELTA_HDR_SIZE )
+      {
+        continue;
+      }
+
+      delta->hdr_len = 0u;
+      delta->op      = delta->hdr[0];
+      delta->left    = etx_ota_get16( &delta->hdr[1] );
+      delta->src     = etx_ota_get32( &delta->hdr[3] );
+
+      if( ( delta->op > ETX_DELTA_OP_DATA ) || ( delta->left == 0u ) )
+      {
+        return -1;
+      }
+
+      if( ( delta->op != ETX_DELTA_OP_DATA ) &&
+          ( ( delta->src > delta->base_size ) || ( delta->left > delta->base_size - delta->src ) ) )
+      {
+        //Out of the base image
+        return -1;
+      }
+      continue;
+    }
+
+    if( delta->op == ETX_DELTA_OP_COPY )
+    {
+      out[o++] = delta->base[delta->src++];
+    }
+    else
+    {
+      if( i >= len )
+      {
+        break;
+      }
+
+      if( delta->op == ETX_DELTA_OP_DIFF )
+      {
+        out[o++] = (uint8_t)( delta->base[delta->src++] + in[i++] );
+      }
+      else
+      {
+        out[o++] = in[i++];
+      }
+    }
+
+    delta->left--;
+  }
+
+  *out_len = o;
+
+  return i;
+}
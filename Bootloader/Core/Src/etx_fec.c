@@ -0,0 +1,263 @@
+/*
+ * etx_fec.c
+ *
+ *  Reed-Solomon encoder and decoder of the data packets (see etx_fec.h).
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "etx_fec.h"
+
+#define ETX_FEC_POLY    0x11Du      // x^8 + x^4 + x^3 + x^2 + 1
+#define ETX_FEC_MAX_ERR ( ETX_FEC_NPAR / 2u )
+
+static uint8_t gf_exp[2u * 255u];     // alpha^i, twice: no modulo in the products
+static uint8_t gf_log[256];
+static uint8_t fec_gen[ETX_FEC_NPAR + 1u];   // Generator polynomial, highest degree first
+static bool    fec_ready;
+
+static uint8_t gf_mul( uint8_t a, uint8_t b );
+static uint8_t gf_div( uint8_t a, uint8_t b );
+static uint8_t gf_poly_eval( const uint8_t *poly, uint16_t nb, uint16_t x_log );
+
+/**
+  * @brief Build the GF(256) tables and the generator polynomial (once).
+  * @param None
+  * @retval None
+  */
+void etx_fec_init( void )
+{
+  uint16_t x = 1u;
+
+  if( fec_ready )
+  {
+    return;
+  }
+
+  for( uint16_t i = 0u; i < 255u; i++ )
+  {
+    gf_exp[i]        = (uint8_t)x;
+    gf_exp[i + 255u] = (uint8_t)x;
+    gf_log[x]        = (uint8_t)i;
+
+    x <<= 1;
+    if( x & 0x100u )
+    {
+      x ^= ETX_FEC_POLY;
+    }
+  }
+
+  //g(x) = (x + alpha^0) (x + alpha^1) ... (x + alpha^(NPAR-1))
+  memset( fec_gen, 0, sizeof(fec_gen) );
+  fec_gen[0] = 1u;
+
+  for( uint16_t j = 0u; j < ETX_FEC_NPAR; j++ )
+  {
+    for( uint16_t i = j + 1u; i > 0u; i-- )
+    {
+      fec_gen[i] ^= gf_mul( fec_gen[i - 1u], gf_exp[j] );
+    }
+  }
+
+  fec_ready = true;
+}
+
+/**
+  * @brief Parity of a block.
+  * @param data data of the block
+  * @param len number of data bytes, up to ETX_FEC_DATA
+  * @param parity the ETX_FEC_NPAR parity bytes, sent after the data
+  * @retval None
+  */
+void etx_fec_encode( const uint8_t *data, uint16_t len, uint8_t *parity )
+{
+  memset( parity, 0, ETX_FEC_NPAR );
+
+  //remainder of data(x) x^NPAR divided by g(x)
+  for( uint16_t i = 0u; i < len; i++ )
+  {
+    uint8_t feedback = data[i] ^ parity[0];
+
+    for( uint16_t j = 0u; j < ETX_FEC_NPAR - 1u; j++ )
+    {
+      parity[j] = parity[j + 1u] ^ gf_mul( feedback, fec_gen[j + 1u] );
+    }
+    parity[ETX_FEC_NPAR - 1u] = gf_mul( feedback, fec_gen[ETX_FEC_NPAR] );
+  }
+}
+
+/**
+  * @brief Correct a received block in place.
+  * @param block data, then parity
+  * @param len block length, parity included (ETX_FEC_NPAR + 1 to ETX_FEC_BLOCK)
+  * @retval number of bytes corrected, -1 if there are too many wrong bytes
+  *         (the block is left as it is)
+  */
+int32_t etx_fec_decode( uint8_t *block, uint16_t len )
+{
+  uint8_t  synd[ETX_FEC_NPAR];              // Syndromes, S(x) lowest degree first
+  uint8_t  lambda[ETX_FEC_NPAR + 1u];       // Error locator, lowest degree first
+  uint8_t  prev[ETX_FEC_NPAR + 1u];         // Locator before the last length change
+  uint8_t  tmp[ETX_FEC_NPAR + 1u];
+  uint8_t  omega[ETX_FEC_NPAR];             // Error evaluator
+  uint8_t  deriv[ETX_FEC_NPAR];             // lambda'(x)
+  uint16_t err_pos[ETX_FEC_MAX_ERR];
+  uint8_t  err_val[ETX_FEC_MAX_ERR];
+  uint16_t nb_err = 0u;
+  uint16_t L      = 0u;
+  uint16_t m      = 1u;
+  uint8_t  b      = 1u;
+  bool     errors = false;
+
+  if( ( len <= ETX_FEC_NPAR ) || ( len > ETX_FEC_BLOCK ) )
+  {
+    return -1;
+  }
+
+  //S_j = r(alpha^j): all zero for a block received as it was sent
+  for( uint16_t j = 0u; j < ETX_FEC_NPAR; j++ )
+  {
+    uint8_t s = 0u;
+
+    for( uint16_t i = 0u; i < len; i++ )
+    {
+      s = gf_mul( s, gf_exp[j] ) ^ block[i];
+    }
+    synd[j] = s;
+    errors |= ( s != 0u );
+  }
+
+  if( !errors )
+  {
+    return 0;
+  }
+
+  //Berlekamp-Massey: the shortest locator that generates the syndromes
+  memset( lambda, 0, sizeof(lambda) );
+  memset( prev, 0, sizeof(prev) );
+  lambda[0] = 1u;
+  prev[0]   = 1u;
+
+  for( uint16_t r = 0u; r < ETX_FEC_NPAR; r++ )
+  {
+    uint8_t d = synd[r];
+    uint8_t coef;
+
+    for( uint16_t i = 1u; i <= L; i++ )
+    {
+      d ^= gf_mul( lambda[i], synd[r - i] );
+    }
+
+    if( d == 0u )
+    {
+      m++;
+      continue;
+    }
+
+    coef = gf_div( d, b );
+    memcpy( tmp, lambda, sizeof(tmp) );
+
+    for( uint16_t i = 0u; i + m <= ETX_FEC_NPAR; i++ )
+    {
+      lambda[i + m] ^= gf_mul( coef, prev[i] );
+    }
+
+    if( 2u * L <= r )
+    {
+      L = r + 1u - L;
+      memcpy( prev, tmp, sizeof(prev) );
+      b = d;
+      m = 1u;
+    }
+    else
+    {
+      m++;
+    }
+  }
+
+  if( L > ETX_FEC_MAX_ERR )
+  {
+    return -1;
+  }
+
+  //omega(x) = S(x) lambda(x) mod x^NPAR, lambda'(x): the odd terms
+  for( uint16_t i = 0u; i < ETX_FEC_NPAR; i++ )
+  {
+    omega[i] = 0u;
+
+    for( uint16_t k = 0u; k <= i; k++ )
+    {
+      omega[i] ^= gf_mul( synd[i - k], lambda[k] );
+    }
+    deriv[i] = ( i & 1u ) ? 0u : lambda[i + 1u];
+  }
+
+  //Chien search: byte i is the power p = len - 1 - i, it is wrong if
+  //lambda(alpha^-p) = 0. Forney: its error is alpha^p omega(alpha^-p) / lambda'(alpha^-p)
+  for( uint16_t i = 0u; i < len; i++ )
+  {
+    uint16_t p     = len - 1u - i;
+    uint16_t x_log = ( 255u - p ) % 255u;
+    uint8_t  den;
+
+    if( gf_poly_eval( lambda, L + 1u, x_log ) != 0u )
+    {
+      continue;
+    }
+
+    den = gf_poly_eval( deriv, L, x_log );
+
+    if( ( den == 0u ) || ( nb_err == ETX_FEC_MAX_ERR ) )
+    {
+      return -1;
+    }
+
+    err_pos[nb_err] = i;
+    err_val[nb_err] = gf_mul( gf_exp[p], gf_div( gf_poly_eval( omega, ETX_FEC_NPAR, x_log ), den ) );
+    nb_err++;
+  }
+
+  //a root per error, all of them in the block: otherwise more errors than
+  //the code can locate
+  if( nb_err != L )
+  {
+    return -1;
+  }
+
+  for( uint16_t k = 0u; k < nb_err; k++ )
+  {
+    block[err_pos[k]] ^= err_val[k];
+  }
+
+  return nb_err;
+}
+
+/**
+  * @brief Product in GF(256).
+  */
+static uint8_t gf_mul( uint8_t a, uint8_t b )
+{
+  return ( ( a == 0u ) || ( b == 0u ) ) ? 0u : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+/**
+  * @brief Quotient in GF(256), b not 0.
+  */
+static uint8_t gf_div( uint8_t a, uint8_t b )
+{
+  return ( a == 0u ) ? 0u : gf_exp[gf_log[a] + 255u - gf_log[b]];
+}
+
+/**
+  * @brief Value of a polynomial (lowest degree first) at alpha^x_log.
+  */
+static uint8_t gf_poly_eval( const uint8_t *poly, uint16_t nb, uint16_t x_log )
+{
+  uint8_t v = 0u;
+
+  for( uint16_t k = 0u; k < nb; k++ )
+  {
+    v ^= gf_mul( poly[k], gf_exp[( x_log * k ) % 255u] );
+  }
+  return v;
+}
@@ -0,0 +1,186 @@
+/*
+ * etx_image_verify.c
+ *
+ *  Image validation with the CRC unit fed by DMA, and its cache in the RTC
+ *  backup registers.
+ */
+
+#include <string.h>
+#include "etx_image_verify.h"
+#include "etx_boot_ctrl.h"
+#include "etx_image.h"
+#include "etx_trace.h"
+
+static DMA_HandleTypeDef hdma_crc;
+
+static HAL_StatusTypeDef etx_crc_feed( uint32_t addr, uint32_t nb_words );
+static volatile uint32_t *etx_verify_cache( uint8_t slot );
+
+/**
+  * @brief Compute the CRC32 of an image (the header is skipped).
+  *        Same algorithm as the post-link tool: STM32 CRC unit, initial value
+  *        0xFFFFFFFF, 32-bit words.
+  * @param addr image address
+  * @param image_size image size, multiple of 4
+  * @param crc CRC32, set only on success
+  * @retval HAL_OK, or the DMA error: no CRC then
+  */
+HAL_StatusTypeDef etx_image_crc( uint32_t addr, uint32_t image_size, uint32_t *crc )
+{
+  HAL_StatusTypeDef ret;
+  uint32_t body = ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_);
+
+  __HAL_RCC_CRC_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  /* Memory-to-memory: the flash is on the peripheral port (incremented),
+     the CRC data register on the memory port (fixed). */
+  hdma_crc.Instance                 = ETX_VERIFY_DMA_STREAM;
+  hdma_crc.Init.Channel             = DMA_CHANNEL_0;
+  hdma_crc.Init.Direction           = DMA_MEMORY_TO_MEMORY;
+  hdma_crc.Init.PeriphInc           = DMA_PINC_ENABLE;
+  hdma_crc.Init.MemInc              = DMA_MINC_DISABLE;
+  hdma_crc.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+  hdma_crc.Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
+  hdma_crc.Init.Mode                = DMA_NORMAL;
+  hdma_crc.Init.Priority            = DMA_PRIORITY_HIGH;
+  hdma_crc.Init.FIFOMode            = DMA_FIFOMODE_ENABLE;   //Direct mode is not allowed in memory-to-memory
+  hdma_crc.Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
+  hdma_crc.Init.MemBurst            = DMA_MBURST_SINGLE;
+  hdma_crc.Init.PeriphBurst         = DMA_PBURST_INC4;
+
+  ret = HAL_DMA_Init( &hdma_crc );
+  if( ret != HAL_OK )
+  {
+    return ret;
+  }
+
+  CRC->CR = CRC_CR_RESET;
+
+  ret = etx_crc_feed( addr, ETX_IMAGE_HDR_OFFSET / sizeof(uint32_t) );
+  if( ret == HAL_OK )
+  {
+    ret = etx_crc_feed( addr + body, ( image_size - body ) / sizeof(uint32_t) );
+  }
+
+  HAL_DMA_DeInit( &hdma_crc );
+
+  if( ret == HAL_OK )
+  {
+    *crc = CRC->DR;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief Check the CRC of the image of a slot.
+  *        A successful check is cached in the RTC backup registers. It is
+  *        reused as long as the header and the flash write count are the same.
+  * @param slot slot to check
+  * @param cached set to true if the result came from the cache (can be NULL)
+  * @retval true if the image is valid
+  */
+bool etx_image_verify( uint8_t slot, bool *cached )
+{
+  const ETX_SLOT_INFO_ *info = etx_slot_info( slot );
+  const ETX_IMAGE_HDR_ *hdr  = etx_slot_header( slot );
+  volatile uint32_t    *bkp  = etx_verify_cache( slot );
+  ETX_BOOT_RECORD_      rec;
+  bool                  valid;
+  uint32_t              start;
+  uint32_t              crc;
+
+  if( cached != NULL )
+  {
+    *cached = false;
+  }
+
+  if( ( hdr == NULL ) || ( bkp == NULL ) )
+  {
+    return false;
+  }
+
+  etx_boot_ctrl_load( &rec );
+
+  __HAL_RCC_PWR_CLK_ENABLE();
+
+  if( ( bkp[0] == ( ETX_VERIFY_CACHE_MAGIC ^ slot ) ) &&
+      ( bkp[1] == hdr->crc32 ) &&
+      ( bkp[2] == hdr->image_size ) &&
+      ( bkp[3] == rec.write_count ) )
+  {
+    if( cached != NULL )
+    {
+      *cached = true;
+    }
+    return true;
+  }
+
+  start = etx_trace_now();
+
+  //A DMA error is no CRC at all: the image is not valid, whatever its CRC
+  valid = ( etx_image_crc( info->addr, hdr->image_size, &crc ) == HAL_OK ) && ( crc == hdr->crc32 );
+
+  etx_trace_record( ETX_TRACE_CRC, start );
+
+  HAL_PWR_EnableBkUpAccess();
+
+  if( valid )
+  {
+    bkp[1] = hdr->crc32;
+    bkp[2] = hdr->image_size;
+    bkp[3] = rec.write_count;
+    bkp[0] = ETX_VERIFY_CACHE_MAGIC ^ slot;     //written last
+  }
+  else
+  {
+    bkp[0] = 0u;
+  }
+
+  HAL_PWR_DisableBkUpAccess();
+
+  return valid;
+}
+
+/**
+  * @brief Feed the CRC unit with DMA.
+  * @param addr first word
+  * @param nb_words number of words
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef etx_crc_feed( uint32_t addr, uint32_t nb_words )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+
+  while( ( nb_words > 0u ) && ( ret == HAL_OK ) )
+  {
+    uint32_t len = ( nb_words > ETX_VERIFY_DMA_CHUNK ) ? ETX_VERIFY_DMA_CHUNK : nb_words;
+
+    ret = HAL_DMA_Start( &hdma_crc, addr, (uint32_t)&CRC->DR, len );
+    if( ret == HAL_OK )
+    {
+      ret = HAL_DMA_PollForTransfer( &hdma_crc, HAL_DMA_FULL_TRANSFER, HAL_MAX_DELAY );
+    }
+
+    addr     += len * sizeof(uint32_t);
+    nb_words -= len;
+  }
+
+  return ret;
+}
+
+/**
+  * @brief Get the backup registers holding the validation cache of a slot.
+  * @param slot slot
+  * @retval first backup register, NULL if the slot doesn't exist
+  */
+static volatile uint32_t *etx_verify_cache( uint8_t slot )
+{
+  if( slot >= ETX_SLOT_COUNT )
+  {
+    return NULL;
+  }
+
+  return &RTC->BKP0R + slot * ETX_VERIFY_CACHE_WORDS;
+}
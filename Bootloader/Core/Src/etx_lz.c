@@ -0,0 +1,131 @@
+/*
+ * etx_lz.c
+ *
+ *  Streaming decoder of the compressed image stream (see etx_lz.h).
+ */
+
+#include <string.h>
+#include "etx_lz.h"
+
+#define ETX_LZ_WINDOW_MASK  ( ETX_LZ_WINDOW_SIZE - 1u )
+
+static void etx_lz_next_item( ETX_LZ_ *lz );
+
+/**
+  * @brief Start a new stream.
+  * @param lz decoder
+  * @retval None
+  */
+void etx_lz_init( ETX_LZ_ *lz )
+{
+  memset( lz, 0, sizeof(ETX_LZ_) );
+  lz->state = ETX_LZ_STATE_FLAGS;
+}
+
+/**
+  * @brief Decode a part of the stream into the window.
+  *        Stops when the input is used up, or when out_max bytes have been
+  *        decoded (the rest of a match is kept for the next call).
+  * @param lz decoder
+  * @param in stream bytes
+  * @param len number of stream bytes
+  * @param out_max stop at this output size (at most one window ahead of
+  *        the output not yet used)
+  * @retval number of stream bytes used, -1 if the stream is corrupt
+  */
+int32_t etx_lz_decode( ETX_LZ_ *lz, const uint8_t *in, uint32_t len, uint32_t out_max )
+{
+  uint32_t i = 0u;
+
+  while( lz->out_size < out_max )
+  {
+    if( lz->match_len > 0u )
+    {
+      lz->window[lz->out_size & ETX_LZ_WINDOW_MASK] =
+        lz->window[( lz->out_size - lz->match_dist ) & ETX_LZ_WINDOW_MASK];
+      lz->out_size++;
+      lz->match_len--;
+      continue;
+    }
+
+    if( i >= len )
+    {
+      break;
+    }
+
+    uint8_t b = in[i++];
+
+    switch( lz->state )
+    {
+      case ETX_LZ_STATE_FLAGS:
+      {
+        lz->flags    = b;
+        lz->nb_flags = 8u;
+        lz->state    = ETX_LZ_STATE_ITEM;
+      }
+      break;
+
+      case ETX_LZ_STATE_ITEM:
+      {
+        if( lz->flags & 1u )
+        {
+          lz->token = b;
+          lz->state = ETX_LZ_STATE_MATCH;
+        }
+        else
+        {
+          lz->window[lz->out_size & ETX_LZ_WINDOW_MASK] = b;
+          lz->out_size++;
+          etx_lz_next_item( lz );
+        }
+      }
+      break;
+
+      case ETX_LZ_STATE_MATCH:
+      {
+        lz->match_dist = (uint16_t)( ( ( lz->token & 0x0Fu ) << 8 ) | b ) + 1u;
+
+        if( lz->match_dist > lz->out_size )
+        {
+          //Points before the start of the image
+          return -1;
+        }
+
+        if( ( lz->token >> 4 ) == ETX_LZ_LEN_EXT )
+        {
+          lz->state = ETX_LZ_STATE_EXT;
+        }
+        else
+        {
+          lz->match_len = ( lz->token >> 4 ) + ETX_LZ_MIN_MATCH;
+          etx_lz_next_item( lz );
+        }
+      }
+      break;
+
+      case ETX_LZ_STATE_EXT:
+      {
+        lz->match_len = ETX_LZ_LEN_EXT + ETX_LZ_MIN_MATCH + b;
+        etx_lz_next_item( lz );
+      }
+      break;
+
+      default:
+      {
+        return -1;
+      }
+    }
+  }
+
+  return i;
+}
+
+/**
+  * @brief Move on to the next item of the group.
+  */
+static void etx_lz_next_item( ETX_LZ_ *lz )
+{
+  lz->flags >>= 1;
+  lz->nb_flags--;
+  lz->state = ( lz->nb_flags > 0u ) ? ETX_LZ_STATE_ITEM : ETX_LZ_STATE_FLAGS;
+}
@@ -7,28 +7,105 @@
 
 #include <stdio.h>
 #include "etx_ota_update.h"
+#include "etx_boot_ctrl.h"
+#include "etx_image_verify.h"
+#include "etx_lz.h"
+#include "etx_delta.h"
+#include "etx_trace.h"
+#include "etx_rx_pool.h"
 #include "main.h"
 #include <string.h>
 #include <stdbool.h>
 
-/* Buffer to hold the received data */
-static uint8_t Rx_Buffer[ ETX_OTA_PACKET_MAX_SIZE ];
+/* Largest packet data sent to the host: the stage timing table */
+#define ETX_OTA_TX_DATA_MAX_SIZE  ETX_OTA_STATS_SIZE
+
+/* Buffer to hold the COBS encoded packet to send */
+static uint8_t Tx_Buffer[ ETX_OTA_COBS_SIZE( ETX_OTA_TX_DATA_MAX_SIZE + ETX_OTA_DATA_OVERHEAD ) + 1u ];
 
 /* OTA State */
 static ETX_OTA_STATE_ ota_state = ETX_OTA_STATE_IDLE;
 
+/* Stream offset of the next data packet expected */
+static uint32_t ota_stream_offset;
+
+/* Reason of the NACK of the last packet (ETX_OTA_NACK_) */
+static uint8_t ota_nack;
+
+/* The data packet in the buffer was ACKed: the result of its write goes in a credit frame */
+static bool ota_acked;
+
 /* Firmware Total Size that we are going to receive */
 static uint32_t ota_fw_total_size;
 /* Firmware image's CRC32 */
 static uint32_t ota_fw_crc;
 /* Firmware Size that we have received */
 static uint32_t ota_fw_received_size;
+/* Slot the firmware is written to */
+static uint8_t ota_slot;
+/* The image comes as a compressed stream */
+static bool ota_compressed;
+/* Decoder of the compressed stream */
+static ETX_LZ_ ota_lz;
+/* A data packet has been received: the mode of the image is known */
+static bool ota_data_started;
+/* The image comes as a delta of the active one */
+static bool ota_delta;
+/* Decoder of the delta stream, and the block it rebuilds */
+static ETX_DELTA_ ota_delta_dec;
+static uint8_t ota_block[ETX_DELTA_BLOCK_SIZE];
+static uint16_t ota_block_len;
+/* Bytes corrected by the FEC in this session */
+static uint32_t ota_fec_corrected;
+
+/*
+ * Interrupt reception (USART6): the receiver fills the pool blocks while the
+ * main loop decodes and writes the packets before. A frame ends at its
+ * delimiter and goes to the queue of received frames; the next one takes the
+ * spare block the main loop gave (etx_ota_rx_arm). One writer each side:
+ * no interrupt masking.
+ */
+#define ETX_OTA_RX_QUEUE_SIZE  ( ETX_OTA_RX_BUFFERS + 2u )   //a frame per block, a dropped one, a free entry
+#define ETX_OTA_WINDOW         ( ETX_OTA_RX_BUFFERS > 1u )   //a packet comes in while one is written
 
-static uint16_t etx_receive_chunk( uint8_t *buf, uint16_t max_len );
-static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len );
-static void etx_ota_send_resp( uint8_t type );
+typedef struct
+{
+  uint8_t   *buf;       // Pool block, NULL if the frame was dropped (no block, overrun, too long)
+  uint32_t  len;        // Bytes received, delimiter excluded
+  uint32_t  cycles;     // First byte to delimiter
+}ETX_OTA_RX_FRAME_;
+
+static uint8_t                     rx_byte;              // Byte of HAL_UART_Receive_IT
+static uint8_t * volatile          rx_cur;               // Block being filled (interrupt)
+static uint8_t * volatile          rx_spare;             // Next block (main loop to interrupt)
+static volatile uint32_t           rx_index;             // Bytes in rx_cur
+static uint32_t                    rx_start;             // Cycles at the first byte
+static bool                        rx_drop;              // Frame broken: dropped up to its delimiter
+static volatile ETX_OTA_RX_FRAME_  rx_queue[ETX_OTA_RX_QUEUE_SIZE];
+static volatile uint8_t            rx_head;              // Next frame for the main loop
+static volatile uint8_t            rx_tail;              // Next entry for the interrupt
+
+static void etx_ota_rx_start( void );
+static void etx_ota_rx_stop( void );
+static void etx_ota_rx_arm( void );
+static void etx_ota_rx_frame( uint8_t *buf, uint32_t len );
+static uint32_t etx_receive_chunk( uint8_t **buf );
+static uint32_t etx_ota_fec_receive( uint8_t *buf, const ETX_OTA_FRAME_ *frame );
+static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint32_t len );
+static uint8_t etx_ota_credits( void );
+static void etx_ota_send_resp( uint8_t packet, uint8_t type, uint8_t reason );
+static void etx_ota_send_packet( uint8_t type, const uint8_t *data, uint32_t len );
+static void etx_ota_send_stats( void );
+static void etx_ota_send_info( void );
+static bool etx_ota_check_image_hdr( uint8_t *data, uint32_t data_len );
 static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
-                                        uint16_t data_len, bool is_full_image );
+                                        uint32_t data_len, bool is_full_image );
+static HAL_StatusTypeDef write_compressed_to_flash_app( uint8_t *data,
+                                                        uint32_t data_len );
+static HAL_StatusTypeDef write_delta_to_flash_app( const uint8_t *data,
+                                                   uint32_t data_len );
+static bool etx_ota_delta_init( uint32_t base_crc );
+static HAL_StatusTypeDef skip_erased_flash_app( uint8_t *data, uint32_t data_len );
 
 /**
   * @brief Download the application from UART and flash it.
@@ -38,7 +115,8 @@ static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
 ETX_OTA_EX_ etx_ota_download_and_flash( void )
 {
   ETX_OTA_EX_ ret  = ETX_OTA_EX_OK;
-  uint16_t    len;
+  uint32_t    len;
+  uint8_t    *buf;
 
   printf("Waiting for the OTA data...\r\n");
 
@@ -46,64 +124,112 @@ ETX_OTA_EX_ etx_ota_download_and_flash( void )
   ota_fw_total_size    = 0u;
   ota_fw_received_size = 0u;
   ota_fw_crc           = 0u;
+  ota_stream_offset    = 0u;
+  ota_compressed       = false;
+  ota_data_started     = false;
+  ota_delta            = false;
+  ota_fec_corrected    = 0u;
+  ota_slot             = etx_boot_ctrl_update_slot();
   ota_state            = ETX_OTA_STATE_START;
   char txt[48];
 
+  etx_fec_init();
+  etx_rx_pool_init();
+  etx_ota_rx_start();
+
   do
   {
-    //clear the buffer
-    memset( Rx_Buffer, 0, ETX_OTA_PACKET_MAX_SIZE );
-
     //printf("wait for data...\r\n");
 
+    //Noise before the first packet is dropped, a corrupted packet after it is NACKed
     do {
-    	len = etx_receive_chunk( Rx_Buffer, ETX_OTA_PACKET_MAX_SIZE );
+    	len = etx_receive_chunk( &buf );
+    	if( ( len == 0u ) && ( ota_state == ETX_OTA_STATE_START ) )
+    	{
+    	  etx_rx_pool_put( buf );
+    	}
     }
-    while (!len);
+    while ( ( len == 0u ) && ( ota_state == ETX_OTA_STATE_START ) );
 
-    sprintf(txt, "len_1=%d\n", len);
+    sprintf(txt, "len_1=%ld\n", len);
     printd(txt);
 
-    for (int i=0; i<len; i++)
+#if ETX_OTA_DEBUG
+    for (uint32_t i=0; i<len; i++)
     {
-    	sprintf(txt, "%02X.", Rx_Buffer[i]);
+    	sprintf(txt, "%02X.", buf[i]);
     	printd(txt);
     }
     sprintf(txt, "\n");
     printd(txt);
+#endif
+
+    ota_acked = false;
 
     if ( len != 0u )
     {
-      ret = etx_process_data( Rx_Buffer, len );
+      etx_rx_pool_give( buf, ETX_RX_OWNER_PARSER );
+      ret = etx_process_data( buf, len );
       //sprintf(txt, "toto 2\n");
       //printd(txt);
       //printf(".... end of process... ret=%d\n", ret);
     }
     else
     {
-      //didn't received data. break.
+      //corrupted packet: the host sends it again
+      ota_nack = ETX_OTA_NACK_CRC;
       ret = ETX_OTA_EX_ERR;
     }
+    //Every block is back in the pool once its packet is done, then back to the receiver
+    etx_rx_pool_put( buf );
+    etx_ota_rx_arm();
 
     //Send ACK or NACK
-    if( ret != ETX_OTA_EX_OK )
+    uint32_t ack_start = etx_trace_now();
+
+    if( ota_acked )
+    {
+      //The data packet was ACKed when it came in, it is written now: its
+      //buffer is free again. The credit frame gives the result of the write.
+      sprintf(txt, "Sending credits (%d)\n", etx_ota_credits());
+      printd(txt);
+      etx_ota_send_resp( ETX_OTA_PACKET_TYPE_CREDIT, ( ret == ETX_OTA_EX_OK ) ? ETX_OTA_ACK : ETX_OTA_NACK,
+                         ( ret == ETX_OTA_EX_OK ) ? ETX_OTA_NACK_NONE : ota_nack );
+      etx_trace_record( ETX_TRACE_ACK, ack_start );
+
+      if( ( ret != ETX_OTA_EX_OK ) && !etx_ota_nack_retry( ota_nack ) )
+      {
+        //the host can't go on
+        break;
+      }
+    }
+    else if( ret != ETX_OTA_EX_OK )
     {
       //printf("Sending NACK\r\n");
-      sprintf(txt, "Sending NACK\n");
+      sprintf(txt, "Sending NACK (%d)\n", ota_nack);
       printd(txt);
-      etx_ota_send_resp( ETX_OTA_NACK );
-      break;
+      etx_ota_send_resp( ETX_OTA_PACKET_TYPE_RESPONSE, ETX_OTA_NACK, ota_nack );
+      etx_trace_record( ETX_TRACE_ACK, ack_start );
+
+      if( !etx_ota_nack_retry( ota_nack ) )
+      {
+        //the host can't go on
+        break;
+      }
     }
     else
     {
       //printf("Sending ACK\r\n");
       sprintf(txt, "Sending ACK\n");
       printd(txt);
-      etx_ota_send_resp( ETX_OTA_ACK );
+      etx_ota_send_resp( ETX_OTA_PACKET_TYPE_RESPONSE, ETX_OTA_ACK, ETX_OTA_NACK_NONE );
+      etx_trace_record( ETX_TRACE_ACK, ack_start );
     }
 
   } while( ota_state != ETX_OTA_STATE_IDLE );
 
+  etx_ota_rx_stop();
+
   return ret;
 }
 
@@ -113,27 +239,37 @@ ETX_OTA_EX_ etx_ota_download_and_flash( void )
   * @param max_len maximum length to receive
   * @retval ETX_OTA_EX_
   */
-static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
+static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint32_t len )
 {
   ETX_OTA_EX_ ret = ETX_OTA_EX_ERR;
-  char txt[256];
+  ETX_OTA_FRAME_ frame;
+  ETX_OTA_DATA_ dat;
+  uint8_t cmd;
+  char txt[48];
+
+  //Unless said otherwise: the packet isn't expected in this state
+  ota_nack = ETX_OTA_NACK_STATE;
 
   do
   {
-    if( ( buf == NULL ) || ( len == 0u) )
+    if( ( buf == NULL ) || ( etx_ota_frame_decode( buf, len, &frame ) == 0u ) )
     {
+      ota_nack = ETX_OTA_NACK_CRC;
       break;
     }
 
     //Check we received OTA Abort command
-    ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*)buf;
-    if( cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD )
+    if( etx_ota_cmd_decode( &frame, &cmd ) && ( cmd == ETX_OTA_CMD_ABORT ) )
     {
-      if( cmd->cmd == ETX_OTA_CMD_ABORT )
-      {
-        //received OTA Abort command. Stop the process
-        break;
-      }
+      //received OTA Abort command. Stop the process
+      break;
+    }
+
+    //OTA Sync command: nothing to do, the response says where we are
+    if( etx_ota_cmd_decode( &frame, &cmd ) && ( cmd == ETX_OTA_CMD_SYNC ) )
+    {
+      ret = ETX_OTA_EX_OK;
+      break;
     }
 
     sprintf(txt, "state=%d\n", ota_state);
@@ -150,28 +286,70 @@ static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
 
       case ETX_OTA_STATE_START:
       {
-        ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*)buf;
-
-        if( cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD )
+        if( etx_ota_cmd_decode( &frame, &cmd ) )
         {
-          if( cmd->cmd == ETX_OTA_CMD_START )
+          if( cmd == ETX_OTA_CMD_START )
           {
             //printf("Received OTA START Command\r\n");
             ota_state = ETX_OTA_STATE_HEADER;
             ret = ETX_OTA_EX_OK;
           }
+          else if( cmd == ETX_OTA_CMD_ROLLBACK )
+          {
+            //No transfer: just switch back to the previous image.
+            if( etx_boot_ctrl_rollback() == HAL_OK )
+            {
+              ota_state = ETX_OTA_STATE_IDLE;
+              ret = ETX_OTA_EX_OK;
+            }
+            else
+            {
+              ota_nack = ETX_OTA_NACK_FLASH;
+            }
+          }
+          else if( cmd == ETX_OTA_CMD_GET_STATS )
+          {
+            //Send the stage timing table, the ACK follows
+            etx_ota_send_stats();
+            ota_state = ETX_OTA_STATE_IDLE;
+            ret = ETX_OTA_EX_OK;
+          }
+          else if( cmd == ETX_OTA_CMD_GET_INFO )
+          {
+            //Send the device info, the ACK follows. Still waiting for START.
+            etx_ota_send_info();
+            ret = ETX_OTA_EX_OK;
+          }
         }
       }
       break;
 
       case ETX_OTA_STATE_HEADER:
       {
-        ETX_OTA_HEADER_ *header = (ETX_OTA_HEADER_*)buf;
-        if( header->packet_type == ETX_OTA_PACKET_TYPE_HEADER )
+        meta_info meta;
+
+        if( etx_ota_meta_decode( &frame, &meta ) )
         {
-          ota_fw_total_size = header->meta_data.package_size;
-          ota_fw_crc        = header->meta_data.package_crc;
+          ota_fw_total_size = meta.package_size;
+          ota_fw_crc        = meta.package_crc;
           //printf("Received OTA Header. FW Size = %ld\r\n", ota_fw_total_size);
+
+          if( ota_fw_total_size > etx_slot_info( ota_slot )->size )
+          {
+            //Image doesn't fit into the slot
+            ota_nack = ETX_OTA_NACK_IMAGE;
+            break;
+          }
+
+          ota_delta = ( meta.base_crc != 0u );
+          if( ota_delta && !etx_ota_delta_init( meta.base_crc ) )
+          {
+            //The delta doesn't apply to the image we have
+            printf("Delta base mismatch\r\n");
+            ota_nack = ETX_OTA_NACK_IMAGE;
+            break;
+          }
+          etx_lz_init( &ota_lz );
           ota_state = ETX_OTA_STATE_DATA;
           ret = ETX_OTA_EX_OK;
         }
@@ -180,22 +358,120 @@ static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
 
       case ETX_OTA_STATE_DATA:
       {
-        ETX_OTA_DATA_     *data     = (ETX_OTA_DATA_*) buf;
-        uint16_t          data_len = data->data_len;
+        bool              compressed = ( frame.type == ETX_OTA_PACKET_TYPE_DATA_COMPRESSED );
+        bool              skip       = ( frame.type == ETX_OTA_PACKET_TYPE_DATA_SKIP );
         HAL_StatusTypeDef ex;
 
-        if ( data->packet_type == ETX_OTA_PACKET_TYPE_DATA )
+        if ( etx_ota_data_decode( &frame, &dat ) )
         {
-          /* write the chunk to the Flash (App location) */
-          sprintf(txt, "   > write data [%d]\n", data_len);
-          printd(txt);
+          uint8_t  *data     = (uint8_t *)dat.data;   //in the receive buffer, writable
+          uint32_t data_len  = dat.len;
+          uint32_t size      = ( skip && ( data_len == 4u ) ) ? etx_ota_get32( data ) : data_len;
+
+          if( dat.offset != ota_stream_offset )
+          {
+            //sent again (its ACK was lost): acknowledged, not written twice
+            if( ( dat.offset < ota_stream_offset ) && ( size <= ota_stream_offset - dat.offset ) )
+            {
+              ret = ETX_OTA_EX_OK;
+              break;
+            }
 
-          ex = write_data_to_flash_app( buf+4, data_len, ( ota_fw_received_size == 0) );
+            //a packet was missed: the host sends from the expected offset
+            ota_nack = ETX_OTA_NACK_SEQUENCE;
+            break;
+          }
+
+          if( !ota_data_started && skip )
+          {
+            //The first data packet holds the image header
+            break;
+          }
+          else if( !ota_data_started )
+          {
+            //The first data packet gives the mode of the whole image
+            ota_compressed   = compressed;
+            ota_data_started = true;
+          }
+          else if( compressed != ota_compressed )
+          {
+            break;
+          }
+
+          if( !skip && !compressed && !ota_delta && ( ota_fw_received_size == 0u ) &&
+              !etx_ota_check_image_hdr( data, data_len ) )
+          {
+            //Not a valid image: refuse it before erasing anything
+            sprintf(txt, "   > invalid image header\n");
+            printd(txt);
+            ota_nack = ETX_OTA_NACK_IMAGE;
+            break;
+          }
 
-          /* Blink red led during update	*/
-          HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2, GPIO_PIN_SET);		/* Red led is OFF	*/
-          HAL_Delay(200);
-          HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2, GPIO_PIN_RESET);		/* Red led is ON	*/
+          //The packet is in: its buffer goes to the flash writer until it is
+          //written, the receiver takes the next packet meanwhile: ACKed now.
+          //Not before the slot is erased (first write): the erase stalls the
+          //CPU, the receive interrupt too, the host must not send then. With
+          //a single block there is no window: ACKed once written.
+          etx_rx_pool_give( buf, ETX_RX_OWNER_FLASH );
+          ota_stream_offset += size;
+
+          if( ETX_OTA_WINDOW && ( ota_fw_received_size > 0u ) )
+          {
+            uint32_t ack_start = etx_trace_now();
+
+            ota_acked = true;
+            etx_ota_send_resp( ETX_OTA_PACKET_TYPE_RESPONSE, ETX_OTA_ACK, ETX_OTA_NACK_NONE );
+            etx_trace_record( ETX_TRACE_ACK, ack_start );
+          }
+
+          //the writers tell a stream they refuse (ETX_OTA_NACK_IMAGE) from a flash failure
+          ota_nack = ETX_OTA_NACK_FLASH;
+
+          if( skip )
+          {
+            /* leave a run of erased bytes as it is */
+            sprintf(txt, "   > skip data\n");
+            printd(txt);
+
+            ex = skip_erased_flash_app( data, data_len );
+          }
+          else if( compressed )
+          {
+            /* inflate the chunk to the Flash (App location) */
+            sprintf(txt, "   > inflate data [%ld]\n", data_len);
+            printd(txt);
+
+            ex = write_compressed_to_flash_app( data, data_len );
+          }
+          else if( ota_delta )
+          {
+            /* rebuild the image from the active one */
+            sprintf(txt, "   > patch data [%ld]\n", data_len);
+            printd(txt);
+
+            ex = write_delta_to_flash_app( data, data_len );
+          }
+          else
+          {
+            /* write the chunk to the Flash (App location) */
+            sprintf(txt, "   > write data [%ld]\n", data_len);
+            printd(txt);
+
+            ex = write_data_to_flash_app( data, data_len, ( ota_fw_received_size == 0) );
+          }
+
+          if( !skip )
+          {
+            /* Blink red led during update	*/
+#if ETX_OTA_DEBUG
+            HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2, GPIO_PIN_SET);		/* Red led is OFF	*/
+            HAL_Delay(200);
+            HAL_GPIO_WritePin(GPIOE, GPIO_PIN_2, GPIO_PIN_RESET);		/* Red led is ON	*/
+#else
+            HAL_GPIO_TogglePin(GPIOE, GPIO_PIN_2);		/* Red led changes at each packet	*/
+#endif
+          }
 
           if ( ex == HAL_OK )
           {
@@ -214,6 +490,11 @@ static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
             }
             ret = ETX_OTA_EX_OK;
           }
+          else
+          {
+            //not written: the credit frame gives the offset of the packet again
+            ota_stream_offset -= size;
+          }
         }
       }
       break;
@@ -223,24 +504,43 @@ static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
     	sprintf(txt, "   > state end\n");
     	printd(txt);
 
-        ETX_OTA_COMMAND_ *cmd = (ETX_OTA_COMMAND_*) buf;
+        //the last data packet sent again (its ACK was lost): acknowledged
+        if( etx_ota_data_decode( &frame, &dat ) && ( dat.offset < ota_stream_offset ) )
+        {
+          ret = ETX_OTA_EX_OK;
+          break;
+        }
 
-        if( cmd->packet_type == ETX_OTA_PACKET_TYPE_CMD )
+        if( etx_ota_cmd_decode( &frame, &cmd ) )
         {
           sprintf(txt, "   > CMD packet\n");
           printd(txt);
 
-          if( cmd->cmd == ETX_OTA_CMD_END )
+          if( cmd == ETX_OTA_CMD_END )
           {
         	sprintf(txt, "   > END CMD\n");
         	printd(txt);
 
             printf("Received OTA END Command\r\n");
 
-            //TODO: Very full package CRC
+            //Verify the full image CRC before the slot can be booted
+            if( !etx_image_verify( ota_slot, NULL ) )
+            {
+              printf("Image CRC mismatch\r\n");
+              ota_nack = ETX_OTA_NACK_IMAGE;
+              break;
+            }
 
-            ota_state = ETX_OTA_STATE_IDLE;
-            ret = ETX_OTA_EX_OK;
+            //Trial-boot the new image. The running one stays untouched.
+            if( etx_boot_ctrl_set_pending( ota_slot ) == HAL_OK )
+            {
+              ota_state = ETX_OTA_STATE_IDLE;
+              ret = ETX_OTA_EX_OK;
+            }
+            else
+            {
+              ota_nack = ETX_OTA_NACK_FLASH;
+            }
           }
         }
       }
@@ -259,208 +559,425 @@ static ETX_OTA_EX_ etx_process_data( uint8_t *buf, uint16_t len )
 }
 
 /**
-  * @brief Receive a one chunk of data.
-  * @param buf buffer to store the received data
-  * @param max_len maximum length to receive
-  * @retval ETX_OTA_EX_
+  * @brief Start the interrupt reception: a block for the first frame, then
+  *        one byte at a time (HAL_UART_RxCpltCallback).
+  * @param None
+  * @retval None
   */
-static uint16_t etx_receive_chunk( uint8_t *buf, uint16_t max_len )
+static void etx_ota_rx_start( void )
 {
-  int16_t  ret;
-  uint16_t index     = 0u;
-  uint16_t data_len;
+  rx_cur   = NULL;
+  rx_spare = NULL;
+  rx_index = 0u;
+  rx_drop  = false;
+  rx_head  = 0u;
+  rx_tail  = 0u;
+
+  etx_ota_rx_arm();
+  HAL_UART_Receive_IT( &huart6, &rx_byte, 1 );
+}
 
+/**
+  * @brief Stop the interrupt reception (the application doesn't handle it).
+  * @param None
+  * @retval None
+  */
+static void etx_ota_rx_stop( void )
+{
+  HAL_UART_AbortReceive( &huart6 );
+}
 
-  char txt[48];
-#ifdef READ_ALL_10
-  //printf("into chunk...\n");
+/**
+  * @brief Give the receiver its next block, if it has none and one is free.
+  * @param None
+  * @retval None
+  */
+static void etx_ota_rx_arm( void )
+{
+  //only the interrupt takes the spare (and clears it)
+  if( ( rx_spare == NULL ) && ( etx_rx_pool_free() > 0u ) )
+  {
+    rx_spare = etx_rx_pool_get();
+  }
+}
 
-  ret = HAL_UART_Receive( &huart6, &buf[index], 10, HAL_MAX_DELAY );
-  sprintf(txt, "ret10=%d", ret);
-  printd(txt);
+/**
+  * @brief Queue a received frame for the main loop (interrupt).
+  * @param buf block, NULL for a dropped frame
+  * @param len bytes received
+  * @retval None
+  */
+static void etx_ota_rx_frame( uint8_t *buf, uint32_t len )
+{
+  uint8_t next = ( rx_tail + 1u ) % ETX_OTA_RX_QUEUE_SIZE;
 
-  for (int j=0; j<10; j++)
+  if( next == rx_head )
   {
-	  sprintf(txt, "%02X.", buf[j]);
-	  printd(txt);
+    //can't happen with a block per frame: only dropped frames pile up
+    return;
   }
 
-  sprintf(txt, "");
-  printd(txt);
-#endif
+  rx_queue[rx_tail].buf    = buf;
+  rx_queue[rx_tail].len    = len;
+  rx_queue[rx_tail].cycles = etx_trace_now() - rx_start;
+  rx_tail = next;
+}
 
-  //sprintf(txt, "ENTER_CHUNKIE");
-  //printd(txt);
+/**
+  * @brief A byte came on the OTA UART: it goes to the block being filled,
+  *        a delimiter ends the frame. Runs in the USART6 interrupt, also
+  *        while the main loop writes the flash (it stalls only during an
+  *        erase: the host sends nothing then, see ETX_OTA_STATE_DATA).
+  * @param huart UART handle
+  * @retval None
+  */
+void HAL_UART_RxCpltCallback( UART_HandleTypeDef *huart )
+{
+  uint8_t byte = rx_byte;
 
-  do
+  if( huart != &huart6 )
   {
-    //receive SOF byte (1 byte)
-    ret = HAL_UART_Receive( &huart6, &buf[index], 1, HAL_MAX_DELAY );
-    //sprintf(txt, "ret1=%d i=%d (%02X)", ret, index, buf[index]);
-    //printd(txt);
+    return;
+  }
 
-    if( ret != HAL_OK )
+  HAL_UART_Receive_IT( &huart6, &rx_byte, 1 );
+
+  if( byte == ETX_OTA_DELIM )
+  {
+    if( rx_drop )
     {
-      break;
+      //the host gets a NACK, one answer per packet
+      etx_ota_rx_frame( NULL, rx_index );
     }
-
-    if( buf[index] != ETX_OTA_SOF )
+    else if( ( rx_index >= 2u ) && ( rx_cur[1] == ETX_OTA_SOF ) )
     {
-      //Not received start of frame
-      ret = ETX_OTA_EX_ERR;
-      break;
+      etx_ota_rx_frame( rx_cur, rx_index );
+      rx_cur = NULL;
     }
+    //else: empty frame (zeros between the packets), or not the start of a
+    //packet (its COBS code, then the SOF): the tail of a packet split by a
+    //wrong byte, or noise. Dropped, the host gets one answer per packet.
 
-    index++;						/* Next zone		*/
+    rx_index = 0u;
+    rx_drop  = false;
+    return;
+  }
 
-    //printf("after SOF !!!!!!!!!!!!\n");
-    //Receive the packet type (1 byte).
-    ret = HAL_UART_Receive( &huart6, &buf[index], 1, HAL_MAX_DELAY );
-    //sprintf(txt, "ret2=%d i=%d (%02X)", ret, index, buf[index]);
-    //printd(txt);
+  if( ( rx_index == 0u ) && !rx_drop )
+  {
+    //The packet is timed from its first byte: the host's idle time isn't counted
+    rx_start = etx_trace_now();
+  }
 
-    index++;						/* Next zone		*/
+  if( rx_cur == NULL )
+  {
+    rx_cur   = rx_spare;
+    rx_spare = NULL;
+  }
 
-    if( ret != HAL_OK )
+  if( rx_cur == NULL )
+  {
+    //No free block: the host sent more than its credits
+    if( !rx_drop )
     {
-      break;
+      etx_trace_rx_pool()->empty++;
     }
+    rx_drop = true;
+  }
+  else if( rx_index < ETX_OTA_WIRE_MAX_SIZE - 1u )
+  {
+    rx_cur[rx_index] = byte;
+  }
+  else
+  {
+    //The packet doesn't fit: drop it, up to its delimiter
+    rx_drop = true;
+  }
+  rx_index++;
+}
 
-    //Get the data length (2 bytes).
-    ret = HAL_UART_Receive( &huart6, &buf[index], 2, HAL_MAX_DELAY );
-    //sprintf(txt, "ret3=%d i=%d (%02X)", ret, index, buf[index]);
-    //printd(txt);
-    //sprintf(txt, "ret3=%d i=%d (%02X)", ret, index+1, buf[index+1]);
-    //printd(txt);
+/**
+  * @brief A byte was lost (overrun, noise, framing): the frame is dropped.
+  *        The HAL stops the reception on an error, it starts again.
+  * @param huart UART handle
+  * @retval None
+  */
+void HAL_UART_ErrorCallback( UART_HandleTypeDef *huart )
+{
+  if( huart != &huart6 )
+  {
+    return;
+  }
 
-    if( ret != HAL_OK )
-    {
-      break;
-    }
-    data_len = *(uint16_t *) &buf[index];
-    //index += 2u;
+  rx_drop = true;
+  HAL_UART_Receive_IT( &huart6, &rx_byte, 1 );
+}
 
-    index+=2;						/* Next zone		*/
+/**
+  * @brief Receive a one chunk of data: the next frame of the receiver,
+  *        COBS decoded in place.
+  * @param buf block of the frame (etx_rx_pool.h), NULL if it was dropped
+  * @retval length of the packet, 0 if it is corrupted
+  */
+static uint32_t etx_receive_chunk( uint8_t **buf )
+{
+  ETX_OTA_FRAME_ frame;
+  uint32_t       index;
+  uint32_t       cycles;
+  uint32_t       len = 0u;
+  char           txt[80];
+
+  //Wait for a frame: the CPU sleeps up to the next interrupt (a byte, or the tick)
+  while( rx_head == rx_tail )
+  {
+    etx_ota_rx_arm();
+    HAL_PWR_EnterSLEEPMode( PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI );
+  }
 
-    //sprintf(txt, "datalen=%d", data_len);
-    //printd(txt);
+  *buf   = rx_queue[rx_head].buf;
+  index  = rx_queue[rx_head].len;
+  cycles = rx_queue[rx_head].cycles;
+  rx_head = ( rx_head + 1u ) % ETX_OTA_RX_QUEUE_SIZE;
 
-    uint16_t begin=index;
+  //The receiver took its spare for this frame: the next one, while it is processed
+  etx_ota_rx_arm();
 
-    for( uint16_t i = 0u; i < data_len; i++ )
-    {
-      ret = HAL_UART_Receive( &huart6, &buf[index], 1, HAL_MAX_DELAY );
-      //sprintf(txt, "ret4=%d i=%d (%02X)", ret, index, buf[index]);
-      //printd(txt);
-      index++;
+  if( *buf != NULL )
+  {
+    len = etx_ota_cobs_decode( *buf, index );
 
-      if( ret != HAL_OK )
-      {
-    	//sprintf(txt, "break #4");
-    	//printd(txt);
-        break;
-      }
+    if( ( len == 0u ) || ( etx_ota_frame_decode( *buf, len, &frame ) != len ) )
+    {
+      //lost or wrong bytes: the length, the SOF or the EOF don't match
+      len = 0u;
+    }
+    else if( frame.type & ETX_OTA_PACKET_FEC )
+    {
+      //wrong bytes corrected, then the CRC: a plain data packet
+      len = etx_ota_fec_receive( *buf, &frame );
+    }
+    else if( !etx_ota_frame_crc_ok( *buf, &frame ) )
+    {
+      len = 0u;
     }
+  }
 
-    //sprintf(txt, "datalen=%d", data_len);
-    //printd(txt);
+  if( len == 0u )
+  {
+    sprintf(txt, "Corrupted packet (%ld bytes)\r\n", index );
+    printdln(txt);
+  }
+  else
+  {
+    //The packet is timed from its first byte to its delimiter (interrupt)
+    etx_trace_record( ETX_TRACE_RX_PACKET, etx_trace_now() - cycles );
+  }
 
-    //for( uint16_t i = 0; i < data_len; i++ )
-    //{
-    //	sprintf(txt, "%d (%02X)", i, buf[begin+i]);
-    //	printd(txt);
-    //}
+  return len;
+}
 
-    //sprintf(txt, "after #4");
-    //printd(txt);
+/**
+  * @brief Correct a data packet with FEC parity in place, check its CRC and
+  *        drop the parity: it becomes the plain data packet it carries.
+  * @param buf received packet, COBS decoded
+  * @param frame its frame
+  * @retval length of the plain packet, 0 if it can't be corrected
+  */
+static uint32_t etx_ota_fec_receive( uint8_t *buf, const ETX_OTA_FRAME_ *frame )
+{
+  uint8_t  *data = &buf[ETX_OTA_DATA_OFFSET];
+  uint32_t out   = 0u;
+  uint32_t n;
+  int32_t  ret;
+  char     txt[48];
 
-    //Get the CRC.
-    ret = HAL_UART_Receive( &huart6, &buf[index], 4, HAL_MAX_DELAY );
+  for( uint32_t in = 0u; in < frame->len; in += n )
+  {
+    n = ( frame->len - in < ETX_FEC_BLOCK ) ? frame->len - in : ETX_FEC_BLOCK;
 
-    if( ret != HAL_OK )
+    ret = etx_fec_decode( &data[in], n );
+    if( ret < 0 )
     {
-      break;
+      return 0u;
     }
+    ota_fec_corrected += ret;
+  }
 
-    index += 4u;
-
-    //TODO: Add CRC verification
+  //The CRC is the one of the packet sent, parity included
+  if( !etx_ota_frame_crc_ok( buf, frame ) )
+  {
+    return 0u;
+  }
 
-    //receive EOF byte (1 byte)
-    ret = HAL_UART_Receive( &huart6, &buf[index], 1, HAL_MAX_DELAY );
-    //sprintf(txt, "ret6=%d i=%d (%02X)", ret, index, buf[index]);
-    //printd(txt);
+  for( uint32_t in = 0u; in < frame->len; in += n )
+  {
+    n = ( frame->len - in < ETX_FEC_BLOCK ) ? frame->len - in : ETX_FEC_BLOCK;
 
-    if( ret != HAL_OK )
-    {
-      break;
-    }
+    memmove( &data[out], &data[in], n - ETX_FEC_NPAR );
+    out += n - ETX_FEC_NPAR;
+  }
 
-    if ( buf[index] != ETX_OTA_EOF )
-    {
-      //Not received end of frame
-      ret = ETX_OTA_EX_ERR;
-      break;
-    }
+  etx_ota_frame_head( buf, frame->type & ~ETX_OTA_PACKET_FEC, out );
+  etx_ota_frame_tail( &data[out], etx_ota_crc_end( etx_ota_crc( ETX_OTA_CRC_INIT, buf, ETX_OTA_DATA_OFFSET + out ) ) );
 
-    index++;
+  sprintf(txt, "FEC: %ld bytes corrected\n", ota_fec_corrected);
+  printd(txt);
 
-  } while( false );
+  return out + ETX_OTA_DATA_OVERHEAD;
+}
 
-  //sprintf(txt, "RET_CHUNKIE");
-  //printd(txt);
+/**
+  * @brief Packets the host can send after the one at the offset of the
+  *        response: the blocks not held by a packet before it (parsed, or
+  *        written). The packets the host sent after it are on their way and
+  *        take the others: the host counts them (sent, not acknowledged).
+  *        One before the slot is erased: the erase stalls the CPU, the
+  *        receive interrupt too.
+  * @param None
+  * @retval credits (ETX_OTA_RESP_)
+  */
+static uint8_t etx_ota_credits( void )
+{
+  uint32_t credits = ETX_OTA_RX_BUFFERS - etx_rx_pool_owned( ETX_RX_OWNER_PARSER ) -
+                     etx_rx_pool_owned( ETX_RX_OWNER_FLASH );
 
-  if( ret != HAL_OK )
+  if( ( ota_fw_received_size == 0u ) && ( credits > 1u ) )
   {
-    //clear the index if error
-    index = 0u;
+    credits = 1u;
   }
 
-  if ( max_len < index )
+  return (uint8_t)credits;
+}
+
+/**
+  * @brief Send the response, with the state, the credits and the stream
+  *        offset expected next.
+  * @param packet ETX_OTA_PACKET_TYPE_RESPONSE, or ETX_OTA_PACKET_TYPE_CREDIT
+  *        once a data packet is written
+  * @param type ACK or NACK
+  * @param reason ETX_OTA_NACK_ (ETX_OTA_NACK_NONE with an ACK)
+  * @retval none
+  */
+static void etx_ota_send_resp( uint8_t packet, uint8_t type, uint8_t reason )
+{
+  ETX_OTA_RESP_ resp =
   {
-    sprintf(txt, "Received more data than expected. Expected = %d, Received = %d\r\n", max_len, index );
-    printdln(txt);
+    .status      = type,
+    .reason      = reason,
+    .state       = ota_state,
+    .credits     = etx_ota_credits(),
+    .next_offset = ota_stream_offset,
+  };
+  uint8_t data[ETX_OTA_RESP_SIZE];
 
-    index = 0u;
-  }
+  //send response
+  etx_ota_resp_encode( data, &resp );
+  etx_ota_send_packet( packet, data, sizeof(data) );
+}
 
-  //sprintf(txt, "tot len=%d", index);
-  //printdln(txt);
+/**
+  * @brief Send a packet to the host.
+  * @param type packet type
+  * @param data packet data
+  * @param len data length
+  * @retval none
+  */
+static void etx_ota_send_packet( uint8_t type, const uint8_t *data, uint32_t len )
+{
+  uint8_t       head[ETX_OTA_DATA_OFFSET];
+  uint8_t       tail[ETX_OTA_DATA_TRAILER];
+  ETX_OTA_COBS_ cobs;
+  uint32_t      crc;
 
-  /*
-  for (int j=0; j<index; j++)
+  if( len > ETX_OTA_TX_DATA_MAX_SIZE )
   {
-    sprintf(txt, "%02X.", buf[j]);
-    printd(txt);
+    return;
   }
 
-  sprintf(txt, "");
-  printdln(txt);
-  */
+  etx_ota_frame_head( head, type, len );
+  crc = etx_ota_crc( ETX_OTA_CRC_INIT, head, sizeof(head) );
+  crc = etx_ota_crc( crc, data, len );
+  etx_ota_frame_tail( tail, etx_ota_crc_end( crc ) );
 
+  etx_ota_cobs_begin( &cobs, Tx_Buffer );
+  etx_ota_cobs_put( &cobs, head, sizeof(head) );
+  etx_ota_cobs_put( &cobs, data, len );
+  etx_ota_cobs_put( &cobs, tail, sizeof(tail) );
 
-  return index;
+  HAL_UART_Transmit(&huart6, Tx_Buffer, etx_ota_cobs_end( &cobs ), HAL_MAX_DELAY);
 }
 
 /**
-  * @brief Send the response.
-  * @param type ACK or NACK
+  * @brief Send the stage timing table in a data packet.
+  * @param None
   * @retval none
   */
-static void etx_ota_send_resp( uint8_t type )
+static void etx_ota_send_stats( void )
 {
-  ETX_OTA_RESP_ rsp =
+  static uint8_t data[ETX_OTA_STATS_SIZE];    //not on the stack (1KB)
+
+  etx_ota_stats_encode( data, etx_trace_table() );
+  etx_ota_send_packet( ETX_OTA_PACKET_TYPE_DATA, data, sizeof(data) );
+}
+
+/**
+  * @brief Send the device info in a data packet: what the host can use
+  *        for the transfer, the slots and the running image.
+  * @param None
+  * @retval none
+  */
+static void etx_ota_send_info( void )
+{
+  uint8_t               active = ( ota_slot == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+  const ETX_IMAGE_HDR_ *hdr    = etx_slot_header( active );
+  ETX_OTA_INFO_         info;
+  uint8_t               data[ETX_OTA_INFO_SIZE];
+
+  memset( &info, 0, sizeof(info) );
+
+  info.protocol      = ETX_OTA_PROTOCOL_VERSION;
+  info.bl_major      = BL_VERSION_MAJOR;
+  info.bl_minor      = BL_VERSION_MINOR;
+  info.nb_rx_buffers = ETX_OTA_RX_BUFFERS;
+  info.max_payload   = ETX_OTA_DATA_MAX_SIZE;
+  info.program_width = ETX_OTA_PROGRAM_WIDTH;
+  info.active_slot   = active;
+  info.features      = ETX_OTA_FEATURE_COMPRESSION | ETX_OTA_FEATURE_DELTA | ETX_OTA_FEATURE_SKIP |
+                       ETX_OTA_FEATURE_ROLLBACK | ETX_OTA_FEATURE_STATS | ETX_OTA_FEATURE_PACKET_CRC |
+                       ( ETX_OTA_WINDOW ? ETX_OTA_FEATURE_WINDOW : 0u ) | ETX_OTA_FEATURE_FEC;
+  info.baud          = huart6.Init.BaudRate;
+  info.slot_addr[0]  = etx_slot_info( ETX_SLOT_A )->addr;
+  info.slot_addr[1]  = etx_slot_info( ETX_SLOT_B )->addr;
+  info.slot_size     = etx_slot_info( ota_slot )->size;
+  info.active_crc    = ( hdr != NULL ) ? hdr->crc32 : 0u;
+  info.uid[0]        = HAL_GetUIDw0();
+  info.uid[1]        = HAL_GetUIDw1();
+  info.uid[2]        = HAL_GetUIDw2();
+
+  etx_ota_info_encode( data, &info );
+  etx_ota_send_packet( ETX_OTA_PACKET_TYPE_DATA, data, sizeof(data) );
+}
+
+/**
+  * @brief Check the image header carried by the first data chunk.
+  * @param data first chunk of the image
+  * @param data_len chunk length
+  * @retval true if the header is valid and matches the OTA header
+  */
+static bool etx_ota_check_image_hdr( uint8_t *data, uint32_t data_len )
+{
+  ETX_IMAGE_HDR_ hdr;
+
+  if( data_len < ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_) )
   {
-    .sof         = ETX_OTA_SOF,
-    .packet_type = ETX_OTA_PACKET_TYPE_RESPONSE,
-    .data_len    = 1u,
-    .status      = type,
-    .crc         = 0u,                //TODO: Add CRC
-    .eof         = ETX_OTA_EOF
-  };
+    return false;
+  }
 
-  //send response
-  HAL_UART_Transmit(&huart6, (uint8_t *)&rsp, sizeof(ETX_OTA_RESP_), HAL_MAX_DELAY);
+  memcpy( &hdr, &data[ETX_IMAGE_HDR_OFFSET], sizeof(ETX_IMAGE_HDR_) );
+
+  return etx_image_hdr_is_valid( &hdr, etx_slot_info( ota_slot )->size ) &&
+         ( hdr.image_size == ota_fw_total_size ) &&
+         ( hdr.crc32      == ota_fw_crc        );
 }
 
 /**
@@ -471,14 +988,26 @@ static void etx_ota_send_resp( uint8_t type )
   * @retval HAL_StatusTypeDef
   */
 static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
-                                        uint16_t data_len, bool is_first_block )
+                                        uint32_t data_len, bool is_first_block )
 {
   HAL_StatusTypeDef ret;
   uint32_t pos=ota_fw_received_size;
+  uint32_t start;
+  const ETX_SLOT_INFO_ *slot = etx_slot_info( ota_slot );
   char txt[64];
 
   do
   {
+    //The slot content changes: invalidate the cached validation
+    if( is_first_block )
+    {
+      ret = etx_boot_ctrl_count_write();
+      if( ret != HAL_OK )
+      {
+        break;
+      }
+    }
+
     ret = HAL_FLASH_Unlock();
     if( ret != HAL_OK )
     {
@@ -495,35 +1024,48 @@ static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
       uint32_t SectorError;
 
       EraseInitStruct.TypeErase     = FLASH_TYPEERASE_SECTORS;
-      EraseInitStruct.Sector        = FLASH_SECTOR_5;
-      EraseInitStruct.NbSectors     = 2;                    //erase 2 sectors(5,6)
+      EraseInitStruct.Sector        = slot->first_sector;
+      EraseInitStruct.NbSectors     = slot->nb_sectors;     //erase the whole slot
       EraseInitStruct.VoltageRange  = FLASH_VOLTAGE_RANGE_3;
 
+      start = etx_trace_now();
       ret = HAL_FLASHEx_Erase( &EraseInitStruct, &SectorError );
+      etx_trace_record( ETX_TRACE_ERASE, start );
       if( ret != HAL_OK )
       {
         break;
       }
     }
 
-    for (int i = 0; i < data_len; i++ )
+    start = etx_trace_now();
+
+    for( uint32_t i = 0u; i < data_len; i += ETX_OTA_PROGRAM_WIDTH )
     {
-      /*
-      ret = HAL_FLASH_Program( FLASH_TYPEPROGRAM_BYTE,
-                               (ETX_APP_FLASH_ADDR + ota_fw_received_size),
-                               data[4+i]
-                             );
-      */
+      //A short last chunk is completed with the erased flash value
+      uint64_t value = 0xFFFFFFFFFFFFFFFFull;
+      uint32_t nb    = data_len - i;
+
+      if( nb > ETX_OTA_PROGRAM_WIDTH )
+      {
+        nb = ETX_OTA_PROGRAM_WIDTH;
+      }
 
-	ret = HAL_FLASH_Program( FLASH_TYPEPROGRAM_BYTE,
-								   (ETX_APP_FLASH_ADDR + ota_fw_received_size),
-								   data[i]
-								 );
+      memcpy( &value, &data[i], nb );
+
+      //The slot is erased: nothing to program for erased bytes
+      ret = HAL_OK;
+      if( value != 0xFFFFFFFFFFFFFFFFull )
+      {
+        ret = HAL_FLASH_Program( ETX_OTA_PROGRAM_TYPE,
+                                 (slot->addr + ota_fw_received_size),
+                                 value
+                               );
+      }
 
       if( ret == HAL_OK )
       {
         //update the data count
-        ota_fw_received_size += 1;
+        ota_fw_received_size += nb;
       }
       else
       {
@@ -532,7 +1074,9 @@ static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
       }
     }
 
-    sprintf(txt, "   >>> write %d bytes at %08X\n", data_len, ETX_APP_FLASH_ADDR+pos );
+    etx_trace_record( ETX_TRACE_PROGRAM, start );
+
+    sprintf(txt, "   >>> write %ld bytes at %08lX\n", data_len, slot->addr+pos );
     printd(txt);
 
     if( ret != HAL_OK )
@@ -549,3 +1093,223 @@ static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data,
 
   return ret;
 }
+
+/**
+  * @brief Decompress a chunk of the image stream and write the result to
+  *        the Application's flash location, by blocks of ETX_LZ_BLOCK_SIZE.
+  *        A match or a block can span several chunks.
+  * @param data compressed data (etx_lz.h)
+  * @param data_len data length
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef write_compressed_to_flash_app( uint8_t *data,
+                                                        uint32_t data_len )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+
+  for( ;; )
+  {
+    uint32_t limit = ota_fw_received_size + ETX_LZ_BLOCK_SIZE;
+    uint32_t from  = ota_lz.out_size;
+    int32_t  nb;
+
+    if( ota_delta )
+    {
+      //the delta decoder takes the output as it comes, up to the end of the window
+      limit = ( from / ETX_LZ_WINDOW_SIZE + 1u ) * ETX_LZ_WINDOW_SIZE;
+    }
+    else if( limit > ota_fw_total_size )
+    {
+      limit = ota_fw_total_size;
+    }
+
+    nb = etx_lz_decode( &ota_lz, data, data_len, limit );
+    if( nb < 0 )
+    {
+      printf("Corrupt compressed data\r\n");
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      ret = HAL_ERROR;
+      break;
+    }
+
+    data     += nb;
+    data_len -= (uint32_t)nb;
+
+    if( ota_delta )
+    {
+      ret = write_delta_to_flash_app( &ota_lz.window[from % ETX_LZ_WINDOW_SIZE],
+                                      ota_lz.out_size - from );
+      if( ( ret != HAL_OK ) || ( ota_lz.out_size < limit ) )
+      {
+        break;
+      }
+      continue;
+    }
+
+    if( ota_lz.out_size < limit )
+    {
+      //chunk used up, the block isn't complete yet
+      break;
+    }
+
+    if( limit == ota_fw_received_size )
+    {
+      //image complete: nothing may follow it
+      ret = ( data_len == 0u ) ? HAL_OK : HAL_ERROR;
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      break;
+    }
+
+    uint8_t  *block     = &ota_lz.window[ota_fw_received_size % ETX_LZ_WINDOW_SIZE];
+    uint32_t  block_len = limit - ota_fw_received_size;
+    bool      is_first  = ( ota_fw_received_size == 0u );
+
+    if( is_first && !etx_ota_check_image_hdr( block, block_len ) )
+    {
+      //Not a valid image: refuse it before erasing anything
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      ret = HAL_ERROR;
+      break;
+    }
+
+    ret = write_data_to_flash_app( block, block_len, is_first );
+    if( ret != HAL_OK )
+    {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+/**
+  * @brief Check the base of a delta update: the image of the active slot,
+  *        valid and with the expected CRC. Start the delta decoder on it.
+  * @param base_crc CRC of the image the delta applies to
+  * @retval true if the delta can be applied
+  */
+static bool etx_ota_delta_init( uint32_t base_crc )
+{
+  uint8_t               base = ( ota_slot == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+  const ETX_IMAGE_HDR_ *hdr  = etx_slot_header( base );
+
+  if( ( hdr == NULL ) || ( hdr->crc32 != base_crc ) || !etx_image_verify( base, NULL ) )
+  {
+    return false;
+  }
+
+  etx_delta_init( &ota_delta_dec, (const uint8_t *)etx_slot_info( base )->addr, hdr->image_size );
+  ota_block_len = 0u;
+
+  return true;
+}
+
+/**
+  * @brief Rebuild the image from a chunk of the delta stream and write it to
+  *        the Application's flash location, by blocks of ETX_DELTA_BLOCK_SIZE.
+  *        A record or a block can span several chunks.
+  * @param data delta stream (etx_delta.h)
+  * @param data_len data length
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef write_delta_to_flash_app( const uint8_t *data,
+                                                   uint32_t data_len )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+
+  for( ;; )
+  {
+    uint32_t room = ETX_DELTA_BLOCK_SIZE - ota_block_len;
+    uint32_t left = ota_fw_total_size - ota_fw_received_size - ota_block_len;
+    uint16_t nb_out;
+    int32_t  nb;
+
+    if( room > left )
+    {
+      room = left;
+    }
+
+    nb = etx_delta_decode( &ota_delta_dec, data, data_len,
+                           &ota_block[ota_block_len], (uint16_t)room, &nb_out );
+    if( nb < 0 )
+    {
+      printf("Corrupt delta data\r\n");
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      ret = HAL_ERROR;
+      break;
+    }
+
+    data          += nb;
+    data_len      -= (uint32_t)nb;
+    ota_block_len += nb_out;
+
+    if( ( ota_block_len < ETX_DELTA_BLOCK_SIZE ) &&
+        ( ota_fw_received_size + ota_block_len < ota_fw_total_size ) )
+    {
+      //chunk used up, the block isn't complete yet
+      break;
+    }
+
+    if( ota_block_len == 0u )
+    {
+      //image complete: nothing may follow it
+      ret = ( ( data_len == 0u ) && ( ota_delta_dec.left == 0u ) &&
+              ( ota_delta_dec.hdr_len == 0u ) ) ? HAL_OK : HAL_ERROR;
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      break;
+    }
+
+    bool is_first = ( ota_fw_received_size == 0u );
+
+    if( is_first && !etx_ota_check_image_hdr( ota_block, ota_block_len ) )
+    {
+      //Not a valid image: refuse it before erasing anything
+      ota_nack = ETX_OTA_NACK_IMAGE;
+      ret = HAL_ERROR;
+      break;
+    }
+
+    ret = write_data_to_flash_app( ota_block, ota_block_len, is_first );
+    ota_block_len = 0u;
+    if( ret != HAL_OK )
+    {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+/**
+  * @brief Skip a run of erased bytes (0xFF) of the image: the slot was erased
+  *        with the first data packet, the run is left as it is.
+  *        Plain images only (a compressed or delta stream has no gaps).
+  * @param data number of bytes to skip (32-bit)
+  * @param data_len data length
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef skip_erased_flash_app( uint8_t *data, uint32_t data_len )
+{
+  uint32_t nb;
+
+  //a run is part of the image stream: a wrong one refuses the image
+  ota_nack = ETX_OTA_NACK_IMAGE;
+
+  if( ( data_len != sizeof(nb) ) || ota_delta )
+  {
+    return HAL_ERROR;
+  }
+
+  nb = etx_ota_get32( data );
+
+  //Within the image, and the programming stays aligned
+  if( ( nb > ota_fw_total_size - ota_fw_received_size ) ||
+      ( ( ota_fw_received_size + nb < ota_fw_total_size ) && ( nb % ETX_OTA_PROGRAM_WIDTH ) ) )
+  {
+    return HAL_ERROR;
+  }
+
+  ota_fw_received_size += nb;
+
+  return HAL_OK;
+}
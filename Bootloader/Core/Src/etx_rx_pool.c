@@ -0,0 +1,166 @@
+/*
+ * etx_rx_pool.c
+ *
+ *  Pool of receive buffers (see etx_rx_pool.h).
+ */
+
+#include <stddef.h>
+#include "etx_rx_pool.h"
+#include "etx_trace.h"
+
+#if ( ETX_OTA_RX_BUFFERS < 1u ) || ( ETX_OTA_RX_BUFFERS > 255u )
+#error "ETX_OTA_RX_BUFFERS: 1 to 255 receive buffers"
+#endif
+
+#if ( ETX_OTA_RX_BUFFERS * ETX_RX_POOL_BLOCK_SIZE ) > ETX_OTA_RX_RAM_MAX
+#error "The receive buffers take more than their share of the RAM (ETX_OTA_RX_RAM_MAX)"
+#endif
+
+#define ETX_RX_POOL_NONE  0xFFu   // End of the free list
+
+/* The blocks, word aligned: the codec reads the frames in place */
+static uint32_t pool_mem[ETX_OTA_RX_BUFFERS][ETX_RX_POOL_BLOCK_SIZE / 4u];
+/* Free list: first free block, then the next one of each free block */
+static uint8_t  pool_head;
+static uint8_t  pool_next[ETX_OTA_RX_BUFFERS];
+/* Owner of each block, and number of blocks of each owner */
+static uint8_t  pool_owner[ETX_OTA_RX_BUFFERS];
+static uint16_t pool_nb[ETX_RX_OWNER_COUNT];
+
+static uint8_t pool_index( const uint8_t *buf );
+
+/**
+  * @brief All the blocks back in the pool. The statistics are kept.
+  * @param None
+  * @retval None
+  */
+void etx_rx_pool_init( void )
+{
+  ETX_TRACE_RX_POOL_ *stats = etx_trace_rx_pool();
+
+  for( uint8_t i = 0u; i < ETX_OTA_RX_BUFFERS; i++ )
+  {
+    pool_next[i]  = ( i + 1u < ETX_OTA_RX_BUFFERS ) ? i + 1u : ETX_RX_POOL_NONE;
+    pool_owner[i] = ETX_RX_OWNER_FREE;
+  }
+  pool_head = 0u;
+
+  for( uint8_t owner = 0u; owner < ETX_RX_OWNER_COUNT; owner++ )
+  {
+    pool_nb[owner] = 0u;
+  }
+  pool_nb[ETX_RX_OWNER_FREE] = ETX_OTA_RX_BUFFERS;
+
+  stats->blocks = ETX_OTA_RX_BUFFERS;
+}
+
+/**
+  * @brief Take a free block for the receiver.
+  * @param None
+  * @retval block of ETX_RX_POOL_BLOCK_SIZE bytes, NULL if none is free
+  */
+uint8_t *etx_rx_pool_get( void )
+{
+  ETX_TRACE_RX_POOL_ *stats = etx_trace_rx_pool();
+  uint8_t i = pool_head;
+  uint16_t used;
+
+  if( i == ETX_RX_POOL_NONE )
+  {
+    return NULL;
+  }
+
+  pool_head     = pool_next[i];
+  pool_owner[i] = ETX_RX_OWNER_RX;
+  pool_nb[ETX_RX_OWNER_FREE]--;
+  pool_nb[ETX_RX_OWNER_RX]++;
+
+  used = ETX_OTA_RX_BUFFERS - pool_nb[ETX_RX_OWNER_FREE];
+  if( used > stats->high_water )
+  {
+    stats->high_water = used;
+  }
+
+  return (uint8_t *)pool_mem[i];
+}
+
+/**
+  * @brief Hand a taken block to its next owner.
+  * @param buf block (etx_rx_pool_get)
+  * @param owner ETX_RX_OWNER_RX, _PARSER or _FLASH
+  * @retval None
+  */
+void etx_rx_pool_give( uint8_t *buf, ETX_RX_OWNER_ owner )
+{
+  uint8_t i = pool_index( buf );
+
+  if( ( i == ETX_RX_POOL_NONE ) || ( pool_owner[i] == ETX_RX_OWNER_FREE ) ||
+      ( owner == ETX_RX_OWNER_FREE ) || ( owner >= ETX_RX_OWNER_COUNT ) )
+  {
+    return;
+  }
+
+  pool_nb[pool_owner[i]]--;
+  pool_nb[owner]++;
+  pool_owner[i] = (uint8_t)owner;
+}
+
+/**
+  * @brief Put a block back in the pool (a block already free is left as it is).
+  * @param buf block (etx_rx_pool_get)
+  * @retval None
+  */
+void etx_rx_pool_put( uint8_t *buf )
+{
+  uint8_t i = pool_index( buf );
+
+  if( ( i == ETX_RX_POOL_NONE ) || ( pool_owner[i] == ETX_RX_OWNER_FREE ) )
+  {
+    return;
+  }
+
+  pool_nb[pool_owner[i]]--;
+  pool_nb[ETX_RX_OWNER_FREE]++;
+  pool_owner[i] = ETX_RX_OWNER_FREE;
+  pool_next[i]  = pool_head;
+  pool_head     = i;
+}
+
+/**
+  * @brief Number of free blocks.
+  */
+uint16_t etx_rx_pool_free( void )
+{
+  return pool_nb[ETX_RX_OWNER_FREE];
+}
+
+/**
+  * @brief Number of blocks of an owner.
+  */
+uint16_t etx_rx_pool_owned( ETX_RX_OWNER_ owner )
+{
+  return ( owner < ETX_RX_OWNER_COUNT ) ? pool_nb[owner] : 0u;
+}
+
+/**
+  * @brief Block of a buffer, ETX_RX_POOL_NONE if it isn't the start of one.
+  */
+static uint8_t pool_index( const uint8_t *buf )
+{
+  const uint8_t *first = (const uint8_t *)pool_mem;
+  uint32_t       pos;
+
+  if( ( buf == NULL ) || ( buf < first ) )
+  {
+    return ETX_RX_POOL_NONE;
+  }
+
+  pos = (uint32_t)( buf - first );
+
+  if( ( pos % ETX_RX_POOL_BLOCK_SIZE != 0u ) || ( pos / ETX_RX_POOL_BLOCK_SIZE >= ETX_OTA_RX_BUFFERS ) )
+  {
+    return ETX_RX_POOL_NONE;
+  }
+
+  return (uint8_t)( pos / ETX_RX_POOL_BLOCK_SIZE );
+}
@@ -0,0 +1,85 @@
+/*
+ * etx_trace.c
+ *
+ *  Boot and OTA stage timing with the DWT cycle counter.
+ */
+
+#include <string.h>
+#include "etx_trace.h"
+#include "main.h"
+
+/* Not cleared by the startup: kept across a reset */
+static ETX_TRACE_TABLE_ trace __attribute__((section(".noinit")));
+
+/**
+  * @brief Start the cycle counter. To be called first thing in main().
+  *        The table is cleared if it doesn't hold a valid content
+  *        (power-on reset).
+  * @param None
+  * @retval None
+  */
+void etx_trace_init( void )
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT       = 0u;
+  DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+
+  if( trace.magic != ETX_TRACE_MAGIC )
+  {
+    memset( &trace, 0, sizeof(trace) );
+    trace.magic = ETX_TRACE_MAGIC;
+  }
+
+  trace.boot++;
+}
+
+/**
+  * @brief Get the cycle counter.
+  * @param None
+  * @retval cycles since etx_trace_init()
+  */
+uint32_t etx_trace_now( void )
+{
+  return DWT->CYCCNT;
+}
+
+/**
+  * @brief Record the duration of a stage.
+  * @param stage stage
+  * @param start etx_trace_now() at the beginning of the stage
+  *        (0 to record the time since etx_trace_init())
+  * @retval None
+  */
+void etx_trace_record( ETX_TRACE_STAGE_ stage, uint32_t start )
+{
+  ETX_TRACE_ENTRY_ *entry = &trace.entry[ trace.count % ETX_TRACE_MAX_ENTRIES ];
+
+  entry->cycles   = DWT->CYCCNT - start;      //modulo 2^32: a wrap is harmless
+  entry->stage    = (uint8_t)stage;
+  entry->reserved = 0u;
+  entry->boot     = (uint16_t)trace.boot;
+
+  trace.count++;
+}
+
+/**
+  * @brief Get the trace table.
+  * @param None
+  * @retval trace table
+  */
+const ETX_TRACE_TABLE_ *etx_trace_table( void )
+{
+  trace.core_clock = SystemCoreClock;
+
+  return &trace;
+}
+
+/**
+  * @brief Get the receive buffer pool statistics, kept with the table.
+  * @param None
+  * @retval receive buffer pool statistics
+  */
+ETX_TRACE_RX_POOL_ *etx_trace_rx_pool( void )
+{
+  return &trace.rx_pool;
+}
@@ -22,6 +22,9 @@
 /* USER CODE BEGIN Includes */
 #include <stdio.h>
 #include "etx_ota_update.h"
+#include "etx_boot_ctrl.h"
+#include "etx_image_verify.h"
+#include "etx_trace.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -31,8 +34,8 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-#define MAJOR	3	/* Major version number	*/
-#define MINOR	2	/* Minor version number	*/
+#define MAJOR	BL_VERSION_MAJOR
+#define MINOR	BL_VERSION_MINOR
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -55,7 +58,7 @@ static void MX_GPIO_Init(void);
 static void MX_USART6_UART_Init(void);
 static void MX_USART2_UART_Init(void);
 /* USER CODE BEGIN PFP */
-static void goto_application(void);
+static void goto_application(uint8_t slot);
 
 void printd(char *pMsg)
 {
@@ -86,6 +89,8 @@ int main(void)
 {
   /* USER CODE BEGIN 1 */
   //char txt[64];
+  etx_trace_init();							/* Stage timing, before anything else	*/
+  uint32_t stage_start = etx_trace_now();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -94,13 +99,15 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-
+  etx_trace_record(ETX_TRACE_HAL_INIT, stage_start);
+  stage_start = etx_trace_now();
   /* USER CODE END Init */
 
   /* Configure the system clock */
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  etx_trace_record(ETX_TRACE_CLOCK, stage_start);
 
   /* USER CODE END SysInit */
 
@@ -123,6 +130,8 @@ int main(void)
   sprintf(txt, "Press the Joystick central button to trigger OTA update...");
   printdln(txt);
 
+  stage_start = etx_trace_now();
+
   do
   {
     OTA_Pin_state = HAL_GPIO_ReadPin( GPIOA, GPIO_PIN_0 );
@@ -136,6 +145,8 @@ int main(void)
     }
   } while (1);
 
+  etx_trace_record(ETX_TRACE_BUTTON, stage_start);
+
   /*Start the Firmware or Application update */
   if (OTA_Pin_state == GPIO_PIN_SET)
   {
@@ -163,10 +174,48 @@ int main(void)
     }
   }
 
-  sprintf(txt, "Starting application...");
+  uint8_t slot = ETX_SLOT_NONE;
+
+  /* Select a slot and check its CRC. A corrupted image is rolled back	*/
+  for (uint8_t attempt = 0; attempt < ETX_SLOT_COUNT; attempt++)
+  {
+    bool cached;
+
+    slot = etx_boot_ctrl_select_slot();
+    if (slot == ETX_SLOT_NONE)
+    {
+      break;
+    }
+
+    if (etx_image_verify(slot, &cached))
+    {
+      sprintf(txt, "Slot %c image valid%s", 'A' + slot, cached ? " (cached)" : "");
+      printdln(txt);
+      break;
+    }
+
+    sprintf(txt, "Slot %c image CRC mismatch !!! Rolling back...", 'A' + slot);
+    printdln(txt);
+
+    slot = ETX_SLOT_NONE;
+    if (etx_boot_ctrl_rollback() != HAL_OK)
+    {
+      break;
+    }
+  }
+
+  if (slot == ETX_SLOT_NONE)
+  {
+    sprintf(txt, "No bootable application !!! HALT !!!");
+    printdln(txt);
+
+    while( 1 );
+  }
+
+  sprintf(txt, "Starting application (slot %c)...", 'A' + slot);
   printdln(txt);
 
-  goto_application();
+  goto_application(slot);
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -345,14 +394,19 @@ static void MX_GPIO_Init(void)
 ////}
 
 
-static void goto_application(void)
+static void goto_application(uint8_t slot)
 {
+	uint32_t app_addr = etx_slot_info(slot)->addr;
+
 	printf("Gonna jump to application\n ");
 
-	void (*app_reset_handler)(void) = (void*)(*((volatile uint32_t*) (0x08040000 + 4U)));
+	void (*app_reset_handler)(void) = (void*)etx_slot_entry(slot);	/* Image is position independent	*/
 
 	HAL_GPIO_WritePin(GPIOE, GPIO_PIN_0, GPIO_PIN_SET);			/* Green led is OFF	*/
 
+	etx_trace_record(ETX_TRACE_JUMP, 0);						/* Time from reset to the jump	*/
+
+	__set_MSP(*((volatile uint32_t*) app_addr));				/* Application stack pointer	*/
 	app_reset_handler();										/* Call the reset handler application	*/
 }
 /* USER CODE END 4 */
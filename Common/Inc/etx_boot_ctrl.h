@@ -0,0 +1,94 @@
+/*
+ * etx_boot_ctrl.h
+ *
+ *  A/B application slots and the boot-control record.
+ *
+ *  Flash layout (STM32F412ZG, 1MB):
+ *
+ *  ______________________________________________________________
+ *  | Sectors 0-2 | Sector 3     | Sectors 4-5 | Sectors 6-8 | Sectors 9-11 |
+ *  | Bootloader  | Boot control | Spare       | Slot A      | Slot B       |
+ *  | 48KB        | 16KB         | 192KB       | 384KB       | 384KB        |
+ *  |_____________|______________|_____________|_____________|______________|
+ *   0x08000000    0x0800C000     0x08010000    0x08040000    0x080A0000
+ *
+ *  The boot-control sector is used as a log: every update appends a new
+ *  record, the one with the highest position is the current one. The sector
+ *  is only erased when it is full. A blank sector (a reset right after that
+ *  erase) is rebuilt from the image versions of the slots.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+#include "etx_image.h"
+
+#ifndef INC_ETX_BOOT_CTRL_H_
+#define INC_ETX_BOOT_CTRL_H_
+
+#define ETX_BOOT_CTRL_ADDR      0x0800C000      // Boot-control sector address
+#define ETX_BOOT_CTRL_SIZE      ( 16 * 1024 )   // Boot-control sector size
+#define ETX_BOOT_CTRL_SECTOR    FLASH_SECTOR_3  // Boot-control sector number
+#define ETX_BOOT_CTRL_MAGIC     0x4C544342      // "BCTL"
+
+#define ETX_SLOT_A              0u
+#define ETX_SLOT_B              1u
+#define ETX_SLOT_COUNT          2u
+#define ETX_SLOT_NONE           0xFFu
+
+#define ETX_SLOT_A_ADDR         0x08040000      // Slot A (sectors 6 to 8)
+#define ETX_SLOT_B_ADDR         0x080A0000      // Slot B (sectors 9 to 11)
+#define ETX_SLOT_SIZE           ( 384 * 1024 )  // Size of one slot
+#define ETX_APP_LINK_ADDR       ETX_SLOT_A_ADDR // Applications are position independent,
+                                                // linked for slot A
+
+#define ETX_BOOT_TRIAL_MAX      3u              // Boots allowed before rollback
+
+/*
+ * Slot description
+ */
+typedef struct
+{
+  uint32_t  addr;           // Slot base address
+  uint32_t  size;           // Slot size
+  uint32_t  first_sector;   // First flash sector of the slot
+  uint32_t  nb_sectors;     // Number of flash sectors of the slot
+}ETX_SLOT_INFO_;
+
+/*
+ * Boot-control record
+ *
+ * ______________________________________________________________________
+ * |     | Active | Pending | Trials |          | Flash Write |          |
+ * | Seq | Slot   | Slot    | Left   | Reserved | Count       |  Magic   |
+ * |_____|________|_________|________|__________|_____________|__________|
+ *   4B      1B       1B       1B        1B           4B           4B
+ *
+ * The magic is programmed last, so a record torn by a reset is ignored.
+ * The flash write count is incremented before a slot is erased: it is part
+ * of the key of the cached image validation.
+ */
+typedef struct
+{
+  uint32_t  seq;
+  uint8_t   active_slot;
+  uint8_t   pending_slot;
+  uint8_t   trials_left;
+  uint8_t   reserved;
+  uint32_t  write_count;
+  uint32_t  magic;
+}__attribute__((packed)) ETX_BOOT_RECORD_;
+
+const ETX_SLOT_INFO_ *etx_slot_info( uint8_t slot );
+uint8_t etx_slot_running( void );
+uint32_t etx_slot_entry( uint8_t slot );
+const ETX_IMAGE_HDR_ *etx_slot_header( uint8_t slot );
+bool etx_image_hdr_is_valid( const ETX_IMAGE_HDR_ *hdr, uint32_t max_size );
+void etx_boot_ctrl_load( ETX_BOOT_RECORD_ *rec );
+uint8_t etx_boot_ctrl_select_slot( void );
+uint8_t etx_boot_ctrl_update_slot( void );
+HAL_StatusTypeDef etx_boot_ctrl_set_pending( uint8_t slot );
+HAL_StatusTypeDef etx_boot_ctrl_confirm( void );
+HAL_StatusTypeDef etx_boot_ctrl_rollback( void );
+HAL_StatusTypeDef etx_boot_ctrl_count_write( void );
+#endif /* INC_ETX_BOOT_CTRL_H_ */
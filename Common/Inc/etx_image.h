@@ -0,0 +1,58 @@
+/*
+ * etx_image.h
+ *
+ *  Application image header.
+ *
+ *  The header is placed by the linker script at a fixed offset, right after
+ *  the vector table. The application fills the static fields, the post-link
+ *  tool (ota_update/etx_image) fills the image size and the CRC.
+ *
+ *  _____________________________________________
+ *  | Vector | Pad  | Header | Code and data     |
+ *  | table  |      |        |                   |
+ *  |________|______|________|___________________|
+ *  0               0x200    0x220               image_size
+ *
+ *  The CRC covers the whole image except the header itself. It is the one
+ *  computed by the STM32 CRC unit: polynomial 0x04C11DB7, initial value
+ *  0xFFFFFFFF, no reflection, fed with 32-bit little-endian words (the image
+ *  size is a multiple of 4).
+ */
+
+#include <stdint.h>
+
+#ifndef INC_ETX_IMAGE_H_
+#define INC_ETX_IMAGE_H_
+
+#define ETX_IMAGE_MAGIC         0x49585445      // "ETXI"
+#define ETX_IMAGE_HDR_VERSION   1u              // Header layout version
+#define ETX_IMAGE_HDR_OFFSET    0x200           // Header offset into the image
+#define ETX_IMAGE_UNSET         0xFFFFFFFF      // Field to be filled by the post-link tool
+
+#define ETX_IMAGE_FLAG_PIC      ( 1u << 0 )     // Image is position independent
+
+/*
+ * Image header
+ *
+ * _________________________________________________________________________
+ * |       | Hdr     | Hdr  | Image | Load |         |       |       |      |
+ * | Magic | Version | Size | Size  | Addr | Version | CRC32 | Flags | Rsvd |
+ * |_______|_________|______|_______|______|_________|_______|_______|______|
+ *    4B       2B       2B     4B     4B      4B        4B      4B      4B
+ */
+typedef struct
+{
+  uint32_t  magic;
+  uint16_t  hdr_version;
+  uint16_t  hdr_size;
+  uint32_t  image_size;
+  uint32_t  load_addr;
+  uint8_t   version_major;
+  uint8_t   version_minor;
+  uint16_t  version_patch;
+  uint32_t  crc32;
+  uint32_t  flags;
+  uint32_t  reserved;
+}__attribute__((packed)) ETX_IMAGE_HDR_;
+
+#endif /* INC_ETX_IMAGE_H_ */
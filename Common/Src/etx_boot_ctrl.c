@@ -0,0 +1,482 @@
+/*
+ * etx_boot_ctrl.c
+ *
+ *  A/B application slots and the boot-control record.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include "etx_boot_ctrl.h"
+
+#define ETX_BOOT_RECORD_WORDS   ( sizeof(ETX_BOOT_RECORD_) / sizeof(uint32_t) )
+#define ETX_BOOT_RECORD_COUNT   ( ETX_BOOT_CTRL_SIZE / sizeof(ETX_BOOT_RECORD_) )
+
+/* Slots location into the flash */
+static const ETX_SLOT_INFO_ etx_slots[ETX_SLOT_COUNT] =
+{
+  { ETX_SLOT_A_ADDR, ETX_SLOT_SIZE, FLASH_SECTOR_6, 3u },
+  { ETX_SLOT_B_ADDR, ETX_SLOT_SIZE, FLASH_SECTOR_9, 3u },
+};
+
+static int32_t etx_boot_ctrl_find( uint32_t *free_index );
+static void etx_boot_ctrl_recover( ETX_BOOT_RECORD_ *rec );
+static HAL_StatusTypeDef etx_boot_ctrl_store( ETX_BOOT_RECORD_ *rec );
+static bool etx_slot_is_bootable( uint8_t slot );
+static uint32_t etx_slot_version( uint8_t slot );
+
+/**
+  * @brief Get the description of a slot.
+  * @param slot ETX_SLOT_A or ETX_SLOT_B
+  * @retval slot description, NULL if the slot doesn't exist
+  */
+const ETX_SLOT_INFO_ *etx_slot_info( uint8_t slot )
+{
+  if( slot >= ETX_SLOT_COUNT )
+  {
+    return NULL;
+  }
+
+  return &etx_slots[slot];
+}
+
+/**
+  * @brief Get the slot the code is currently running from.
+  *        The address of this function is the run-time one, the VTOR points
+  *        to a copy of the vector table in SRAM.
+  * @param None
+  * @retval ETX_SLOT_A, ETX_SLOT_B or ETX_SLOT_NONE (bootloader)
+  */
+uint8_t etx_slot_running( void )
+{
+  uint32_t pc = (uint32_t)&etx_slot_running;
+
+  for( uint8_t slot = 0u; slot < ETX_SLOT_COUNT; slot++ )
+  {
+    if( ( pc >= etx_slots[slot].addr ) &&
+        ( pc <  etx_slots[slot].addr + etx_slots[slot].size ) )
+    {
+      return slot;
+    }
+  }
+
+  return ETX_SLOT_NONE;
+}
+
+/**
+  * @brief Get the run-time address of the reset handler of a slot.
+  *        The image is linked at the load address of its header: the reset
+  *        vector is moved by the offset of the slot.
+  * @param slot slot to boot
+  * @retval reset handler address, 0 if the slot has no valid image
+  */
+uint32_t etx_slot_entry( uint8_t slot )
+{
+  const ETX_SLOT_INFO_ *info = etx_slot_info( slot );
+  const ETX_IMAGE_HDR_ *hdr  = etx_slot_header( slot );
+
+  if( hdr == NULL )
+  {
+    return 0u;
+  }
+
+  return *(volatile uint32_t *)( info->addr + 4u ) - hdr->load_addr + info->addr;
+}
+
+/**
+  * @brief Get the image header of a slot.
+  * @param slot slot to read
+  * @retval image header, NULL if the slot doesn't hold a valid header
+  */
+const ETX_IMAGE_HDR_ *etx_slot_header( uint8_t slot )
+{
+  const ETX_SLOT_INFO_ *info = etx_slot_info( slot );
+  const ETX_IMAGE_HDR_ *hdr;
+
+  if( info == NULL )
+  {
+    return NULL;
+  }
+
+  hdr = (const ETX_IMAGE_HDR_ *)( info->addr + ETX_IMAGE_HDR_OFFSET );
+
+  return etx_image_hdr_is_valid( hdr, info->size ) ? hdr : NULL;
+}
+
+/**
+  * @brief Check an image header (no flash scan: the CRC is not verified here).
+  * @param hdr header to check
+  * @param max_size size of the slot the image is for
+  * @retval true if the header is complete and the image fits into the slot
+  */
+bool etx_image_hdr_is_valid( const ETX_IMAGE_HDR_ *hdr, uint32_t max_size )
+{
+  return ( hdr->magic       == ETX_IMAGE_MAGIC       ) &&
+         ( hdr->hdr_version == ETX_IMAGE_HDR_VERSION ) &&
+         ( hdr->hdr_size    == sizeof(ETX_IMAGE_HDR_) ) &&
+         ( hdr->image_size  != ETX_IMAGE_UNSET       ) &&
+         ( hdr->crc32       != ETX_IMAGE_UNSET       ) &&
+         ( hdr->image_size  >  ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_) ) &&
+         ( hdr->image_size  <= max_size              ) &&
+         ( ( hdr->image_size % sizeof(uint32_t) ) == 0u );
+}
+
+/**
+  * @brief Read the current boot-control record.
+  *        If there is no valid record, one is rebuilt from the slots
+  *        (etx_boot_ctrl_recover).
+  * @param rec record to fill
+  * @retval none
+  */
+void etx_boot_ctrl_load( ETX_BOOT_RECORD_ *rec )
+{
+  uint32_t free_index;
+  int32_t  last = etx_boot_ctrl_find( &free_index );
+
+  if( last < 0 )
+  {
+    etx_boot_ctrl_recover( rec );
+  }
+  else
+  {
+    memcpy( rec, (void *)( ETX_BOOT_CTRL_ADDR + last * sizeof(ETX_BOOT_RECORD_) ),
+            sizeof(ETX_BOOT_RECORD_) );
+  }
+}
+
+/**
+  * @brief Select the slot to boot. Called once per boot by the bootloader.
+  *        A pending slot is tried ETX_BOOT_TRIAL_MAX times. If the application
+  *        didn't confirm itself in the meantime, we roll back to the active slot.
+  * @param None
+  * @retval slot to boot, ETX_SLOT_NONE if there is no bootable image
+  */
+uint8_t etx_boot_ctrl_select_slot( void )
+{
+  ETX_BOOT_RECORD_ rec;
+  uint8_t          slot;
+
+  etx_boot_ctrl_load( &rec );
+
+  if( rec.pending_slot != ETX_SLOT_NONE )
+  {
+    if( ( rec.trials_left > 0u ) && etx_slot_is_bootable( rec.pending_slot ) )
+    {
+      //one more trial boot of the new image
+      rec.trials_left--;
+      etx_boot_ctrl_store( &rec );
+
+      return rec.pending_slot;
+    }
+
+    //the new image never confirmed itself. Roll back.
+    rec.pending_slot = ETX_SLOT_NONE;
+    rec.trials_left  = 0u;
+    etx_boot_ctrl_store( &rec );
+  }
+
+  slot = rec.active_slot;
+
+  if( !etx_slot_is_bootable( slot ) )
+  {
+    //try the other one
+    slot = ( slot == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+
+    if( !etx_slot_is_bootable( slot ) )
+    {
+      slot = ETX_SLOT_NONE;
+    }
+  }
+
+  return slot;
+}
+
+/**
+  * @brief Get the slot an update has to be written to (the one not active).
+  * @param None
+  * @retval ETX_SLOT_A or ETX_SLOT_B
+  */
+uint8_t etx_boot_ctrl_update_slot( void )
+{
+  ETX_BOOT_RECORD_ rec;
+
+  etx_boot_ctrl_load( &rec );
+
+  return ( rec.active_slot == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+}
+
+/**
+  * @brief Mark a freshly written slot as pending: it will be trial-booted.
+  * @param slot slot holding the new image
+  * @retval HAL_StatusTypeDef
+  */
+HAL_StatusTypeDef etx_boot_ctrl_set_pending( uint8_t slot )
+{
+  ETX_BOOT_RECORD_ rec;
+
+  if( slot >= ETX_SLOT_COUNT )
+  {
+    return HAL_ERROR;
+  }
+
+  etx_boot_ctrl_load( &rec );
+
+  rec.pending_slot = slot;
+  rec.trials_left  = ETX_BOOT_TRIAL_MAX;
+
+  return etx_boot_ctrl_store( &rec );
+}
+
+/**
+  * @brief Confirm the running image. Called by the application once it is up.
+  *        Nothing is written if the running image is already the active one.
+  * @param None
+  * @retval HAL_StatusTypeDef
+  */
+HAL_StatusTypeDef etx_boot_ctrl_confirm( void )
+{
+  ETX_BOOT_RECORD_ rec;
+  uint8_t          slot = etx_slot_running();
+
+  if( slot == ETX_SLOT_NONE )
+  {
+    return HAL_ERROR;
+  }
+
+  etx_boot_ctrl_load( &rec );
+
+  if( ( rec.active_slot == slot ) && ( rec.pending_slot == ETX_SLOT_NONE ) )
+  {
+    return HAL_OK;
+  }
+
+  rec.active_slot  = slot;
+  rec.pending_slot = ETX_SLOT_NONE;
+  rec.trials_left  = 0u;
+
+  return etx_boot_ctrl_store( &rec );
+}
+
+/**
+  * @brief Go back to the previous image.
+  *        A pending image is dropped, otherwise the other slot becomes active.
+  * @param None
+  * @retval HAL_StatusTypeDef
+  */
+HAL_StatusTypeDef etx_boot_ctrl_rollback( void )
+{
+  ETX_BOOT_RECORD_ rec;
+
+  etx_boot_ctrl_load( &rec );
+
+  if( rec.pending_slot != ETX_SLOT_NONE )
+  {
+    rec.pending_slot = ETX_SLOT_NONE;
+  }
+  else
+  {
+    uint8_t other = ( rec.active_slot == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+
+    if( !etx_slot_is_bootable( other ) )
+    {
+      return HAL_ERROR;
+    }
+    rec.active_slot = other;
+  }
+  rec.trials_left = 0u;
+
+  return etx_boot_ctrl_store( &rec );
+}
+
+/**
+  * @brief Count a flash write. To be called before a slot is erased, so the
+  *        cached validation of the previous image can't match any more.
+  * @param None
+  * @retval HAL_StatusTypeDef
+  */
+HAL_StatusTypeDef etx_boot_ctrl_count_write( void )
+{
+  ETX_BOOT_RECORD_ rec;
+
+  etx_boot_ctrl_load( &rec );
+
+  rec.write_count++;
+
+  return etx_boot_ctrl_store( &rec );
+}
+
+/**
+  * @brief Scan the boot-control sector.
+  * @param free_index index of the first blank record (ETX_BOOT_RECORD_COUNT if full)
+  * @retval index of the last valid record, -1 if there is none
+  */
+static int32_t etx_boot_ctrl_find( uint32_t *free_index )
+{
+  int32_t last = -1;
+  uint32_t i;
+
+  for( i = 0u; i < ETX_BOOT_RECORD_COUNT; i++ )
+  {
+    const uint32_t *words = (const uint32_t *)( ETX_BOOT_CTRL_ADDR + i * sizeof(ETX_BOOT_RECORD_) );
+    const ETX_BOOT_RECORD_ *rec = (const ETX_BOOT_RECORD_ *)words;
+    bool blank = true;
+
+    for( uint32_t w = 0u; w < ETX_BOOT_RECORD_WORDS; w++ )
+    {
+      if( words[w] != 0xFFFFFFFFu )
+      {
+        blank = false;
+        break;
+      }
+    }
+
+    if( blank )
+    {
+      break;
+    }
+
+    if( rec->magic == ETX_BOOT_CTRL_MAGIC )
+    {
+      last = (int32_t)i;
+    }
+  }
+
+  *free_index = i;
+
+  return last;
+}
+
+/**
+  * @brief Rebuild the record of a sector with no valid one: a new board, or
+  *        a reset between the erase of a full sector and the programming of
+  *        the record (etx_boot_ctrl_store). With two bootable slots, the one
+  *        with the older image version is active and the newer one is pending:
+  *        it is trial-booted and confirms itself, or we roll back. Otherwise
+  *        the bootable slot (slot A if none) is active.
+  * @param rec record to fill
+  * @retval none
+  */
+static void etx_boot_ctrl_recover( ETX_BOOT_RECORD_ *rec )
+{
+  bool a_ok = etx_slot_is_bootable( ETX_SLOT_A );
+  bool b_ok = etx_slot_is_bootable( ETX_SLOT_B );
+
+  rec->seq          = 0u;
+  rec->active_slot  = ( b_ok && !a_ok ) ? ETX_SLOT_B : ETX_SLOT_A;
+  rec->pending_slot = ETX_SLOT_NONE;
+  rec->trials_left  = 0u;
+  rec->reserved     = 0xFFu;
+  rec->write_count  = 0u;
+  rec->magic        = ETX_BOOT_CTRL_MAGIC;
+
+  if( a_ok && b_ok && ( etx_slot_version( ETX_SLOT_A ) != etx_slot_version( ETX_SLOT_B ) ) )
+  {
+    uint8_t newer = ( etx_slot_version( ETX_SLOT_B ) > etx_slot_version( ETX_SLOT_A ) ) ? ETX_SLOT_B : ETX_SLOT_A;
+
+    rec->active_slot  = ( newer == ETX_SLOT_A ) ? ETX_SLOT_B : ETX_SLOT_A;
+    rec->pending_slot = newer;
+    rec->trials_left  = ETX_BOOT_TRIAL_MAX;
+  }
+}
+
+/**
+  * @brief Append a new record to the boot-control sector.
+  *        The sector is erased only when there is no room left, and the
+  *        record is programmed right after: a reset in between leaves a
+  *        blank sector, rebuilt from the slots (etx_boot_ctrl_recover).
+  * @param rec record to write (its sequence number is updated)
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef etx_boot_ctrl_store( ETX_BOOT_RECORD_ *rec )
+{
+  HAL_StatusTypeDef ret;
+  uint32_t          free_index;
+  uint32_t          words[ETX_BOOT_RECORD_WORDS];
+
+  etx_boot_ctrl_find( &free_index );
+
+  rec->seq++;
+  rec->magic = ETX_BOOT_CTRL_MAGIC;
+  memcpy( words, rec, sizeof(words) );
+
+  do
+  {
+    ret = HAL_FLASH_Unlock();
+    if( ret != HAL_OK )
+    {
+      break;
+    }
+
+    if( free_index >= ETX_BOOT_RECORD_COUNT )
+    {
+      //Sector is full. Erase it and restart from the beginning.
+      FLASH_EraseInitTypeDef EraseInitStruct;
+      uint32_t SectorError;
+
+      EraseInitStruct.TypeErase     = FLASH_TYPEERASE_SECTORS;
+      EraseInitStruct.Sector        = ETX_BOOT_CTRL_SECTOR;
+      EraseInitStruct.NbSectors     = 1;
+      EraseInitStruct.VoltageRange  = FLASH_VOLTAGE_RANGE_3;
+
+      ret = HAL_FLASHEx_Erase( &EraseInitStruct, &SectorError );
+      if( ret != HAL_OK )
+      {
+        break;
+      }
+      free_index = 0u;
+    }
+
+    uint32_t addr = ETX_BOOT_CTRL_ADDR + free_index * sizeof(ETX_BOOT_RECORD_);
+
+    //Magic is the last word, so it is programmed last.
+    for( uint32_t w = 0u; w < ETX_BOOT_RECORD_WORDS; w++ )
+    {
+      ret = HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, addr + w * sizeof(uint32_t), words[w] );
+      if( ret != HAL_OK )
+      {
+        break;
+      }
+    }
+  } while( false );
+
+  HAL_FLASH_Lock();
+
+  return ret;
+}
+
+/**
+  * @brief Check that a slot holds something that looks like an application.
+  * @param slot slot to check
+  * @retval true if the header is valid, the stack pointer and the reset handler are sane
+  */
+static bool etx_slot_is_bootable( uint8_t slot )
+{
+  const ETX_SLOT_INFO_ *info = etx_slot_info( slot );
+
+  if( ( info == NULL ) || ( etx_slot_header( slot ) == NULL ) )
+  {
+    return false;
+  }
+
+  uint32_t sp    = *(volatile uint32_t *)( info->addr );
+  uint32_t reset = etx_slot_entry( slot );
+
+  return ( sp    >  SRAM1_BASE ) && ( sp <= SRAM1_BASE + ( 256 * 1024 ) ) &&
+         ( reset >= info->addr ) && ( reset <  info->addr + info->size );
+}
+
+/**
+  * @brief Get the image version of a slot, comparable as a number.
+  * @param slot slot to read
+  * @retval major.minor.patch as 0xMMmmPPPP, 0 if the slot has no valid header
+  */
+static uint32_t etx_slot_version( uint8_t slot )
+{
+  const ETX_IMAGE_HDR_ *hdr = etx_slot_header( slot );
+
+  if( hdr == NULL )
+  {
+    return 0u;
+  }
+
+  return ( (uint32_t)hdr->version_major << 24 ) | ( (uint32_t)hdr->version_minor << 16 ) | hdr->version_patch;
+}
@@ -0,0 +1,685 @@
+/**************************************************
+
+file: ota_bench.c
+purpose: -
+  -OTA throughput benchmark: runs full OTA sessions (ota_update against
+   ota_sim, or against a board) over a matrix of parameters:
+   baud rate, data packet payload (fixed or adaptive), host pacing, flash programming width,
+   and in the simulator the receive buffers of the bootloader (the window), the bit errors
+   injected on the link and the FEC.
+  -workloads: the reference images of ota_update (blinky.bin, blinky3.bin)
+   and synthetic images (64KB to the slot size).
+  -one result per session: effective bytes/s, ACK round-trip time
+   percentiles, NACKs and retransmissions, the window used, written as CSV or JSON.
+
+compile with the command:
+$ make
+
+use it:
+$ ./ota_bench -o results.csv
+$ ./ota_bench -B 57600,115200 -c 576,1024 -P 0,10 -W 1,4 -o results.json
+$ ./ota_bench -p /dev/ttyUSB0 -s 64 -o board.csv
+$ ./ota_bench -T -s 384 -c 16384 -E 0,100,1000,3000 -F off,on,auto
+$ ./ota_bench -T -s 384 -c 0,16384 -w 1,2,4
+
+**************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "etx_image.h"
+#include "etx_boot_ctrl.h"
+#include "etx_ota_update.h"
+
+#define MAX_FILES     16          /* reference workloads (-i) */
+#define MAX_VALUES    16          /* values per swept parameter */
+#define MAX_IMAGES    ( MAX_FILES + MAX_VALUES )
+#define RUN_TIMEOUT   900         /* seconds, one OTA session */
+
+/*
+ * Swept parameter
+ */
+typedef struct
+{
+  int nb;
+  int value[MAX_VALUES];
+}bench_list;
+
+/*
+ * Workload
+ */
+typedef struct
+{
+  char name[64];              /* as reported */
+  char path[256];             /* image ready for ota_update */
+  uint32_t size;
+}bench_image;
+
+/*
+ * Measures of one session (the Result line of ota_update)
+ */
+typedef struct
+{
+  bool ok;
+  uint32_t bytes, time_ms, rate, packets, nacks, retx;
+  uint32_t rtt_p50, rtt_p90, rtt_p99, rtt_max;
+  uint32_t window;            /* most data packets in flight */
+}bench_result;
+
+const char *ota_sim_exe = "./ota_sim";
+const char *ota_vsim_exe = "./ota_vsim";
+const char *ota_update_exe = "../ota_update/ota_update";
+const char *etx_image_exe = "../ota_update/etx_image";
+
+const char *fec_names[] = {"auto", "off", "on"};   /* -F, --fec of ota_update: value + 1 */
+
+uint8_t APP_BIN[ETX_SLOT_SIZE];
+bool virtual_time = false;            /* -T: sessions in ota_vsim */
+
+void usage(void)
+{
+  printf("Usage: ./ota_bench [-p port] [-i image]... [-s sizes] [-B bauds] [-c chunks] [-P paces]\n");
+  printf("                   [-W widths] [-w buffers] [-E errors] [-F fec] [-L link] [-T]\n");
+  printf("                   [-o results.csv|results.json]\n");
+  printf("  -p  board port (e.g. /dev/ttyUSB0) instead of the simulator\n");
+  printf("  -i  workload image (default: ../ota_update/blinky.bin and blinky3.bin)\n");
+  printf("  -s  synthetic images, sizes in KB, 0 for none (default: 64,128,256,384; max %d)\n",
+         ETX_SLOT_SIZE / 1024);
+  printf("  -B  baud rates (default: 115200)\n");
+  printf("  -c  data packet payloads, bytes, 0 for the adaptive one of ota_update (default: 1024,4096,16384)\n");
+  printf("  -P  host pacing, us between two bytes (default: 0, the bootloader gives credits)\n");
+  printf("  -W  flash programming widths, bytes (simulator only, default: 1)\n");
+  printf("  -w  receive buffers of the bootloader, the most packets in flight (simulator only, default: %u;\n"
+         "      others are ota_sim_rxN and ota_vsim_rxN: make builds 1 and 4)\n", ETX_OTA_RX_BUFFERS);
+  printf("  -E  bit errors injected on the link, flipped bits per million bytes (simulator only, default: 0)\n");
+  printf("  -F  FEC of the data packets: off, on, auto (default: auto)\n");
+  printf("  -L  simulator link profile (default: uart)\n");
+  printf("  -T  virtual time (ota_vsim): modelled durations, a session takes milliseconds\n");
+  printf("  -o  results file, JSON if it ends with .json (default: CSV on stdout)\n");
+  printf("Lists are comma separated, every combination is run.\n");
+}
+
+/* the simulator built with that many receive buffers (ETX_OTA_RX_BUFFERS):
+   the default one, or its _rxN build */
+const char *sim_exe(char *exe, size_t size, const char *base, int buffers)
+{
+  if (buffers == ETX_OTA_RX_BUFFERS)
+  {
+    snprintf(exe, size, "%s", base);
+  }
+  else
+  {
+    snprintf(exe, size, "%s_rx%d", base, buffers);
+  }
+
+  return exe;
+}
+
+/* parse a comma separated list of numbers */
+int parse_list(const char *arg, bench_list *list)
+{
+  char *end;
+
+  list->nb = 0;
+
+  do
+  {
+    if (list->nb == MAX_VALUES)
+    {
+      return -1;
+    }
+
+    list->value[list->nb++] = strtol(arg, &end, 0);
+
+    if ((end == arg) || ((*end != ',') && (*end != '\0')))
+    {
+      return -1;
+    }
+    arg = end + 1;
+  } while (*end == ',');
+
+  return 0;
+}
+
+/* parse a comma separated list of FEC modes, as -1 (auto), 0 (off), 1 (on) */
+int parse_fec(const char *arg, bench_list *list)
+{
+  size_t len;
+
+  list->nb = 0;
+
+  do
+  {
+    int mode = 3;
+
+    len = strcspn(arg, ",");
+
+    for (int m = 0; m < 3; m++)
+    {
+      if ((strlen(fec_names[m]) == len) && (strncmp(arg, fec_names[m], len) == 0))
+      {
+        mode = m;
+      }
+    }
+
+    if ((list->nb == MAX_VALUES) || (mode == 3))
+    {
+      return -1;
+    }
+
+    list->value[list->nb++] = mode - 1;
+    arg += len + 1;
+  } while (arg[-1] == ',');
+
+  return 0;
+}
+
+/* monotonic time in seconds */
+double now_s(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* read one line of a child output, -1 on end of file or deadline */
+int read_line(int fd, char *line, int size, double deadline)
+{
+  int n = 0;
+
+  while (n < size - 1)
+  {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    double left = deadline - now_s();
+
+    if ((left <= 0) || (poll(&pfd, 1, (int)(left * 1000) + 1) <= 0))
+    {
+      return -1;
+    }
+
+    if (read(fd, &line[n], 1) != 1)
+    {
+      return -1;
+    }
+
+    if (line[n] == '\n')
+    {
+      break;
+    }
+    n++;
+  }
+
+  line[n] = '\0';
+  return n;
+}
+
+/* start a program, its output in a pipe */
+pid_t spawn(char *const argv[], int *out)
+{
+  int fd[2];
+  pid_t pid;
+
+  if (pipe(fd) < 0)
+  {
+    return -1;
+  }
+
+  pid = fork();
+
+  if (pid == 0)
+  {
+    dup2(fd[1], STDOUT_FILENO);
+    close(fd[0]);
+    close(fd[1]);
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+
+  close(fd[1]);
+  *out = fd[0];
+
+  return pid;
+}
+
+/* write a workload, with an image header, and let etx_image fill it */
+int make_image(bench_image *img, const char *dir, const char *name, uint32_t size)
+{
+  ETX_IMAGE_HDR_ *hdr = (ETX_IMAGE_HDR_ *)&APP_BIN[ETX_IMAGE_HDR_OFFSET];
+  char cmd[600];
+  FILE *Fptr;
+
+  // The reference binaries predate the image header: one is put at its
+  // offset. They are transfer workloads, not bootable images any more.
+  if (hdr->magic != ETX_IMAGE_MAGIC)
+  {
+    ETX_IMAGE_HDR_ stamp =
+    {
+      .magic         = ETX_IMAGE_MAGIC,
+      .hdr_version   = ETX_IMAGE_HDR_VERSION,
+      .hdr_size      = sizeof(ETX_IMAGE_HDR_),
+      .image_size    = ETX_IMAGE_UNSET,
+      .load_addr     = ETX_APP_LINK_ADDR,
+      .crc32         = ETX_IMAGE_UNSET,
+      .flags         = ETX_IMAGE_FLAG_PIC,
+      .reserved      = ETX_IMAGE_UNSET,
+    };
+
+    memcpy(hdr, &stamp, sizeof(stamp));
+  }
+
+  snprintf(img->name, sizeof(img->name), "%s", name);
+  snprintf(img->path, sizeof(img->path), "%s/%s", dir, name);
+  img->size = (size + 3) & ~3u;
+
+  Fptr = fopen(img->path, "wb");
+
+  if ((Fptr == NULL) || (fwrite(APP_BIN, 1, size, Fptr) != size))
+  {
+    printf("Can not write %s\n", img->path);
+    return -1;
+  }
+  fclose(Fptr);
+
+  snprintf(cmd, sizeof(cmd), "%s %s > /dev/null", etx_image_exe, img->path);
+
+  if (system(cmd) != 0)
+  {
+    printf("%s failed on %s\n", etx_image_exe, img->path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* reference workload: a binary file */
+int load_image(bench_image *img, const char *dir, const char *file)
+{
+  const char *name = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+  FILE *Fptr = fopen(file, "rb");
+  uint32_t size;
+
+  if (Fptr == NULL)
+  {
+    printf("Can not open %s\n", file);
+    return -1;
+  }
+
+  memset(APP_BIN, 0xFF, sizeof(APP_BIN));
+  size = fread(APP_BIN, 1, sizeof(APP_BIN), Fptr);
+  fclose(Fptr);
+
+  if (size < ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_))
+  {
+    printf("%s is too small for an image header\n", file);
+    return -1;
+  }
+
+  return make_image(img, dir, name, size);
+}
+
+/* synthetic workload: pseudo-random content (xorshift, same every run) */
+int synth_image(bench_image *img, const char *dir, uint32_t kb)
+{
+  char name[32];
+  uint32_t x = 0x2545F491;
+
+  for (uint32_t i = 0; i < kb * 1024; i += 4)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    memcpy(&APP_BIN[i], &x, sizeof(x));
+  }
+
+  snprintf(name, sizeof(name), "synth_%uk.bin", kb);
+  return make_image(img, dir, name, kb * 1024);
+}
+
+/* one OTA session: in ota_vsim (virtual time), or ota_update against a
+   board or against ota_sim (started here) */
+void run(const char *port, const char *link, const bench_image *img, int baud, int chunk,
+         int pace, int width, int buffers, int errors, int fec, bench_result *res)
+{
+  char line[512], pts[64], a_chunk[16], a_pace[16], a_baud[16], a_width[16], a_errors[16];
+  char exe[64];
+  char *a_fec = (char *)fec_names[fec + 1];
+  double deadline = now_s() + RUN_TIMEOUT;
+  pid_t sim = -1, host;
+  int sim_out = -1, host_out, status;
+
+  memset(res, 0, sizeof(*res));
+  snprintf(a_chunk, sizeof(a_chunk), "%d", chunk);
+  snprintf(a_pace, sizeof(a_pace), "%d", pace);
+  snprintf(a_baud, sizeof(a_baud), "%d", baud);
+  snprintf(a_width, sizeof(a_width), "%d", width);
+  snprintf(a_errors, sizeof(a_errors), "%d", errors);
+
+  // The link is measured: the images are sent as they are (--no-compress)
+  do
+  {
+    if (virtual_time)
+    {
+      char *const vsim_argv[] = {(char *)sim_exe(exe, sizeof(exe), ota_vsim_exe, buffers), "-L", (char *)link, "-B", a_baud, "-W", a_width,
+                                 "-E", a_errors, (char *)img->path, "--chunk", a_chunk, "--pace", a_pace,
+                                 "--baud", a_baud, "--no-compress", "--fec", a_fec, NULL};
+
+      host = spawn(vsim_argv, &host_out);
+    }
+    else
+    {
+      if (port == NULL)
+      {
+        // The flash durations are really waited for (-r): they are part of
+        // the throughput
+        char *const sim_argv[] = {(char *)sim_exe(exe, sizeof(exe), ota_sim_exe, buffers), "-n", "1", "-r", "-L", (char *)link,
+                                  "-B", a_baud, "-W", a_width, "-E", a_errors, NULL};
+
+        sim = spawn(sim_argv, &sim_out);
+
+        if (sim < 0)
+        {
+          break;
+        }
+
+        pts[0] = '\0';
+
+        while (read_line(sim_out, line, sizeof(line), deadline) >= 0)
+        {
+          if (sscanf(line, "OTA port: %63s", pts) == 1)
+          {
+            break;
+          }
+        }
+
+        if (pts[0] == '\0')
+        {
+          printf("%s did not start\n", exe);
+          break;
+        }
+        port = pts;
+      }
+
+      char *const host_argv[] = {(char *)ota_update_exe, (char *)port, (char *)img->path,
+                                 "--chunk", a_chunk, "--pace", a_pace, "--baud", a_baud, "--no-compress",
+                                 "--fec", a_fec, NULL};
+
+      host = spawn(host_argv, &host_out);
+    }
+
+    if (host < 0)
+    {
+      break;
+    }
+
+    // Until ota_update exits (end of its output) or the deadline
+    while (read_line(host_out, line, sizeof(line), deadline) >= 0)
+    {
+      if (sscanf(line, "Result: bytes=%u time_ms=%u rate=%u chunk=%*u pace_us=%*u packets=%u nacks=%u "
+                 "retx=%u rtt_p50_us=%u rtt_p90_us=%u rtt_p99_us=%u rtt_max_us=%u",
+                 &res->bytes, &res->time_ms, &res->rate, &res->packets, &res->nacks, &res->retx,
+                 &res->rtt_p50, &res->rtt_p90, &res->rtt_p99, &res->rtt_max) == 10)
+      {
+        const char *window = strstr(line, " window=");
+
+        res->ok = true;
+        res->window = 1;
+
+        if (window != NULL)
+        {
+          sscanf(window, " window=%u", &res->window);
+        }
+      }
+    }
+
+    // The session hung
+    if (now_s() >= deadline)
+    {
+      kill(host, SIGKILL);
+      res->ok = false;
+    }
+    waitpid(host, &status, 0);
+    close(host_out);
+  } while (false);
+
+  if (sim > 0)
+  {
+    // ota_sim exits after its session, unless it is still waiting for data
+    kill(sim, SIGTERM);
+    waitpid(sim, &status, 0);
+    close(sim_out);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bench_image image[MAX_IMAGES];
+  bench_list sizes, bauds, chunks, paces, widths, buffers, errors, fecs;
+  char exe[64];
+  const char *files[MAX_FILES] = {"../ota_update/blinky.bin", "../ota_update/blinky3.bin"};
+  int nb_files = 2;
+  bool default_files = true;
+  int nb_images = 0;
+  const char *port = NULL;
+  const char *link = "uart";
+  const char *out_name = NULL;
+  char dir[] = "/tmp/ota_bench.XXXXXX";
+  FILE *out = stdout;
+  bool json;
+  int opt;
+  int ex = 0;
+
+  memset(image, 0, sizeof(image));
+  parse_list("64,128,256,384", &sizes);
+  parse_list("115200", &bauds);
+  parse_list("1024,4096,16384", &chunks);
+  parse_list("0", &paces);
+  parse_list("1", &widths);
+  snprintf(exe, sizeof(exe), "%u", ETX_OTA_RX_BUFFERS);
+  parse_list(exe, &buffers);
+  parse_list("0", &errors);
+  parse_fec("auto", &fecs);
+
+  while ((opt = getopt(argc, argv, "p:i:s:B:c:P:W:w:E:F:L:To:h")) != -1)
+  {
+    int err = 0;
+
+    switch (opt)
+    {
+      case 'p': port = optarg;    break;
+      case 'i':
+        if (default_files)
+        {
+          nb_files = 0;
+          default_files = false;
+        }
+        err = (nb_files == MAX_FILES);
+        if (!err)
+        {
+          files[nb_files++] = optarg;
+        }
+        break;
+      case 's': err = parse_list(optarg, &sizes);   break;
+      case 'B': err = parse_list(optarg, &bauds);   break;
+      case 'c': err = parse_list(optarg, &chunks);  break;
+      case 'P': err = parse_list(optarg, &paces);   break;
+      case 'W': err = parse_list(optarg, &widths);  break;
+      case 'w': err = parse_list(optarg, &buffers); break;
+      case 'E': err = parse_list(optarg, &errors);  break;
+      case 'F': err = parse_fec(optarg, &fecs);     break;
+      case 'L': link = optarg;    break;
+      case 'T': virtual_time = true;  break;
+      case 'o': out_name = optarg;  break;
+      default:  err = -1;         break;
+    }
+
+    if (err)
+    {
+      usage();
+      return -1;
+    }
+  }
+
+  json = (out_name != NULL) && (strlen(out_name) > 5) &&
+         (strcmp(out_name + strlen(out_name) - 5, ".json") == 0);
+
+  if ((port != NULL) && virtual_time)
+  {
+    usage();
+    return -1;
+  }
+
+  // On a board the bootloader decides the programming width and its
+  // receive buffers, and the link has the errors it has
+  if (port != NULL)
+  {
+    parse_list("0", &widths);
+    parse_list("0", &buffers);
+    parse_list("0", &errors);
+  }
+
+  for (int i = 0; (i < buffers.nb) && (port == NULL); i++)
+  {
+    sim_exe(exe, sizeof(exe), virtual_time ? ota_vsim_exe : ota_sim_exe, buffers.value[i]);
+
+    if (access(exe, X_OK) != 0)
+    {
+      printf("No simulator with %d receive buffers: make %s\n", buffers.value[i], exe + 2);
+      return -1;
+    }
+  }
+
+  do
+  {
+    if (mkdtemp(dir) == NULL)
+    {
+      printf("Can not create %s\n", dir);
+      ex = -1;
+      break;
+    }
+
+    for (int i = 0; (i < nb_files) && (ex == 0); i++)
+    {
+      ex = load_image(&image[nb_images++], dir, files[i]);
+    }
+
+    for (int i = 0; (i < sizes.nb) && (ex == 0); i++)
+    {
+      if (sizes.value[i] == 0)
+      {
+        continue;       // -s 0: no synthetic image
+      }
+
+      if ((sizes.value[i] < 0) || (sizes.value[i] * 1024 > ETX_SLOT_SIZE))
+      {
+        printf("Synthetic image of %dKB skipped (slot is %dKB)\n", sizes.value[i], ETX_SLOT_SIZE / 1024);
+        continue;
+      }
+      ex = synth_image(&image[nb_images++], dir, sizes.value[i]);
+    }
+
+    if (ex < 0)
+    {
+      break;
+    }
+
+    if ((out_name != NULL) && ((out = fopen(out_name, "w")) == NULL))
+    {
+      printf("Can not open %s\n", out_name);
+      out = stdout;
+      ex = -1;
+      break;
+    }
+
+    if (json)
+    {
+      fprintf(out, "[\n");
+    }
+    else
+    {
+      fprintf(out, "image,size,baud,payload,window,pace_us,width,rx_buffers,status,time_ms,bytes_per_s,"
+                   "rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,packets,nacks,retx,bit_errors_ppm,fec\n");
+    }
+
+    int nb_runs = 0;
+
+    for (int i = 0; i < nb_images; i++)
+    for (int b = 0; b < bauds.nb; b++)
+    for (int c = 0; c < chunks.nb; c++)
+    for (int p = 0; p < paces.nb; p++)
+    for (int w = 0; w < widths.nb; w++)
+    for (int r = 0; r < buffers.nb; r++)
+    for (int e = 0; e < errors.nb; e++)
+    for (int f = 0; f < fecs.nb; f++)
+    {
+      bench_result res;
+      const char *fec = fec_names[fecs.value[f] + 1];
+
+      fprintf(stderr, "%s baud=%d payload=%d pace=%dus width=%d buffers=%d errors=%dppm fec=%s... ",
+              image[i].name, bauds.value[b], chunks.value[c], paces.value[p], widths.value[w],
+              buffers.value[r], errors.value[e], fec);
+
+      run(port, link, &image[i], bauds.value[b], chunks.value[c], paces.value[p],
+          widths.value[w], buffers.value[r], errors.value[e], fecs.value[f], &res);
+
+      fprintf(stderr, "%s %u B/s\n", res.ok ? "OK" : "FAILED", res.rate);
+
+      // The window is the one of the session (Result line): the most data
+      // packets in flight, within the credits of the device
+      if (json)
+      {
+        fprintf(out, "%s  {\"image\": \"%s\", \"size\": %u, \"baud\": %d, \"payload\": %d, \"window\": %u, "
+                "\"pace_us\": %d, \"width\": %d, \"rx_buffers\": %d, \"status\": \"%s\", \"time_ms\": %u, "
+                "\"bytes_per_s\": %u, \"rtt_p50_us\": %u, \"rtt_p90_us\": %u, \"rtt_p99_us\": %u, \"rtt_max_us\": %u, "
+                "\"packets\": %u, \"nacks\": %u, \"retx\": %u, \"bit_errors_ppm\": %d, \"fec\": \"%s\"}",
+                nb_runs ? ",\n" : "", image[i].name, image[i].size, bauds.value[b], chunks.value[c], res.window,
+                paces.value[p], widths.value[w], buffers.value[r], res.ok ? "ok" : "failed", res.time_ms, res.rate,
+                res.rtt_p50, res.rtt_p90, res.rtt_p99, res.rtt_max, res.packets, res.nacks, res.retx,
+                errors.value[e], fec);
+      }
+      else
+      {
+        fprintf(out, "%s,%u,%d,%d,%u,%d,%d,%d,%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%d,%s\n",
+                image[i].name, image[i].size, bauds.value[b], chunks.value[c], res.window,
+                paces.value[p], widths.value[w], buffers.value[r], res.ok ? "ok" : "failed", res.time_ms, res.rate,
+                res.rtt_p50, res.rtt_p90, res.rtt_p99, res.rtt_max, res.packets, res.nacks, res.retx,
+                errors.value[e], fec);
+      }
+      fflush(out);
+      nb_runs++;
+    }
+
+    if (json)
+    {
+      fprintf(out, "\n]\n");
+    }
+  } while (false);
+
+  for (int i = 0; i < nb_images; i++)
+  {
+    if (image[i].path[0] != '\0')
+    {
+      unlink(image[i].path);
+    }
+  }
+  rmdir(dir);
+
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  return (ex);
+}
@@ -0,0 +1,160 @@
+/**************************************************
+
+file: ota_sim.c
+purpose: -
+  -runs the OTA engine of the bootloader (etx_ota_update.c, unchanged)
+   on Linux, against a HAL simulation layer (sim_hal.c).
+  -the OTA UART is a pseudo-terminal, the flash a 1MB array with the
+   STM32F412 sector map and timings (sim_flash.c).
+  -the serial link between ota_update and the bootloader is modelled:
+   baud, latency, RX overrun and faults (sim_uart.c).
+
+compile with the command:
+$ make
+
+use it:
+$ ./ota_sim -f flash.bin
+OTA port: /dev/pts/3
+and from another terminal:
+$ ../ota_update/ota_update /dev/pts/3 ../Blink_Quick/Debug/Blink_Quick.bin
+
+**************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "etx_ota_update.h"
+#include "etx_boot_ctrl.h"
+#include "etx_trace.h"
+#include "sim_hal.h"
+
+void usage(void)
+{
+  printf("Usage: ./ota_sim [-f flash.bin] [-n sessions] [-L link] [-S seed] [-B baud] [-V range] [-W width] [-M] [-r] [-v]\n");
+  printf("  -f  flash content, loaded at start and saved after every session\n");
+  printf("  -n  number of OTA sessions before exiting (default: no limit)\n");
+  printf("  -L  serial link profile (default: ideal)\n");
+  printf("  -S  seed of the link faults (default: 1)\n");
+  printf("  -B  baud rate of the link (default: the one of the profile)\n");
+  printf("  -E  bit errors, flipped bits per million bytes (default: the ones of the profile)\n");
+  printf("  -V  supply voltage range: 1 (1.7-2.1V), 2 (2.1-2.7V), 3 (2.7-3.6V, default)\n");
+  printf("  -W  flash programming width of the OTA engine: 1, 2 or 4 bytes (default: 1)\n");
+  printf("  -M  datasheet max flash timings (default: typical)\n");
+  printf("  -r  really wait for the modelled flash durations\n");
+  printf("  -v  print the bootloader debug output\n");
+  printf("\nLink profiles:\n");
+  sim_link_print_profiles();
+}
+
+int main(int argc, char *argv[])
+{
+  char pts_name[64];
+  const char *flash_file = NULL;
+  int sessions = -1;
+  const char *link = "ideal";
+  uint32_t seed = 1;
+  int baud = -1;
+  int flips = -1;
+  int opt;
+  int ex = 0;
+
+  while ((opt = getopt(argc, argv, "f:n:L:S:B:E:V:W:Mrvh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f': flash_file = optarg;        break;
+      case 'n': sessions = atoi(optarg);    break;
+      case 'L': link = optarg;              break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      case 'B': baud = atoi(optarg);        break;
+      case 'E': flips = atoi(optarg);       break;
+      case 'V': sim_flash_model.voltage_range = atoi(optarg) - 1; break;
+      case 'W': sim_program_width = atoi(optarg);   break;
+      case 'M': sim_flash_model.max_timings = true; break;
+      case 'r': sim_flash_model.realtime = true;    break;
+      case 'v': sim_verbose = true;         break;
+      default:  usage();                    return -1;
+    }
+  }
+
+  if ((sim_flash_model.voltage_range > FLASH_VOLTAGE_RANGE_3) || (sim_link_profile(link, seed) < 0) ||
+      ((sim_program_width != 1) && (sim_program_width != 2) && (sim_program_width != 4)))
+  {
+    usage();
+    return -1;
+  }
+
+  if (baud >= 0)
+  {
+    sim_link.baud = baud;
+  }
+
+  if (flips >= 0)
+  {
+    sim_link.flip_ppm = flips;
+  }
+
+  do
+  {
+    if (sim_hal_init() < 0)
+    {
+      ex = -1;
+      break;
+    }
+
+    if ((flash_file != NULL) && (sim_flash_load(flash_file) < 0))
+    {
+      printf("Can not load %s\n", flash_file);
+      ex = -1;
+      break;
+    }
+
+    if (sim_uart_open(pts_name, sizeof(pts_name)) < 0)
+    {
+      printf("Can not open a pseudo-terminal\n");
+      ex = -1;
+      break;
+    }
+
+    etx_trace_init();
+
+    printf("OTA port: %s\n", pts_name);
+    fflush(stdout);
+
+    for (int n = 0; (sessions < 0) || (n < sessions); n++)
+    {
+      ETX_BOOT_RECORD_ rec;
+
+      sim_uart_flush();
+      memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+
+      ETX_OTA_EX_ ret = etx_ota_download_and_flash();
+
+      sim_uart_drain();
+
+      etx_boot_ctrl_load(&rec);
+
+      printf("Session %d: %s (active slot %c, pending slot %c)\n", n + 1,
+             (ret == ETX_OTA_EX_OK) ? "OK" : "ERROR",
+             'A' + rec.active_slot,
+             (rec.pending_slot == ETX_SLOT_NONE) ? '-' : 'A' + rec.pending_slot);
+      sim_flash_print_stats();
+      sim_link_print_stats();
+      fflush(stdout);
+
+      if ((flash_file != NULL) && (sim_flash_save(flash_file) < 0))
+      {
+        printf("Can not save %s\n", flash_file);
+        ex = -1;
+        break;
+      }
+    }
+  } while (false);
+
+  return (ex);
+}
@@ -0,0 +1,261 @@
+/*
+ * ota_vhost.c
+ *
+ *  The host tool (ota_update/ota_update.c, unchanged) built into the
+ *  simulator for virtual time: its serial port is the link model, its
+ *  sleeps and its clock are the simulated clock (sim_vt.c).
+ *
+ *  The system headers are included first, then the calls of ota_update.c
+ *  are redirected by macros to the sim_vhost_*() functions below.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim_hal.h"
+
+#define SIM_VHOST_FD    100         // The only port ota_update can open
+
+int sim_vhost_open( const char *path, int flags, ... );
+ssize_t sim_vhost_read( int fd, void *buf, size_t len );
+ssize_t sim_vhost_write( int fd, const void *buf, size_t len );
+int sim_vhost_usleep( useconds_t us );
+int sim_vhost_clock_gettime( clockid_t clk, struct timespec *ts );
+int sim_vhost_tcgetattr( int fd, struct termios *tty );
+int sim_vhost_tcsetattr( int fd, int action, const struct termios *tty );
+int sim_vhost_tcflush( int fd, int queue );
+int sim_vhost_printf( const char *fmt, ... );
+FILE *sim_vhost_fopen( const char *path, const char *mode );
+int sim_vhost_fclose( FILE *file );
+
+#define main            ota_update_main
+#define open            sim_vhost_open
+#define read            sim_vhost_read
+#define write           sim_vhost_write
+#define usleep          sim_vhost_usleep
+#define clock_gettime   sim_vhost_clock_gettime
+#define tcgetattr       sim_vhost_tcgetattr
+#define tcsetattr       sim_vhost_tcsetattr
+#define tcflush         sim_vhost_tcflush
+#define printf          sim_vhost_printf
+#define fopen           sim_vhost_fopen
+#define fclose          sim_vhost_fclose
+
+#include "../ota_update/ota_update.c"
+
+#undef printf
+#undef fopen
+#undef fclose
+
+static int   vhost_argc;
+static char **vhost_argv;
+static int   vhost_exit;
+static int   vhost_timeout_ms = 1000;   // VTIME of the port
+static FILE *vhost_file;                // Image or log file, closed if the session is cut
+static char  vhost_result[512];
+
+/**
+  * @brief Set the command line of ota_update.
+  * @param argc number of arguments
+  * @param argv arguments, argv[0] included
+  * @retval None
+  */
+void sim_vhost_set_args( int argc, char **argv )
+{
+  vhost_argc = argc;
+  vhost_argv = argv;
+}
+
+/**
+  * @brief Clear what is left of the previous session.
+  * @param None
+  * @retval None
+  */
+void sim_vhost_reset( void )
+{
+  if( vhost_file != NULL )
+  {
+    fclose( vhost_file );
+    vhost_file = NULL;
+  }
+
+  nb_packets = 0;
+  nb_nacks   = 0;
+  nb_retx    = 0;
+  nb_timeouts = 0;
+  nb_resets  = 0;
+  nb_data    = 0;
+  nb_corrupted = 0;
+  nb_rtt     = 0;
+  nb_skipped = 0;
+  rx_pos     = 0;
+  rx_len     = 0;
+
+  //the defaults of a fresh ota_update, before its options and the device info
+  chunk_size   = 0;
+  compress     = -1;
+  skip_min     = SKIP_MIN;
+  get_info     = true;
+  dev_features = ETX_OTA_FEATURE_COMPRESSION | ETX_OTA_FEATURE_DELTA | ETX_OTA_FEATURE_SKIP |
+                 ETX_OTA_FEATURE_WINDOW;
+  pace_us      = PACE_US;
+  pace_set     = false;
+  retry_budget    = RETRY_BUDGET;
+  resp_timeout_ms = RESP_TIMEOUT_MS;
+  fec             = -1;
+  fec_on          = false;
+  credit_wait_us  = 0;
+  credit_last_ms  = 0;
+  memset( &adapt, 0, sizeof(adapt) );
+  adapt.on        = true;
+  adapt_log_name  = NULL;
+  memset( &dev_resp, 0, sizeof(dev_resp) );
+  dev_resp.state  = ETX_OTA_STATE_START;
+  dev_resp.credits = 1;
+  vhost_exit = -1;
+  vhost_result[0] = '\0';
+}
+
+/**
+  * @brief Host task of a virtual time session: one run of ota_update.
+  * @param None
+  * @retval None
+  */
+void sim_vhost_task( void )
+{
+  vhost_exit = ota_update_main( vhost_argc, vhost_argv );
+}
+
+/**
+  * @brief Exit code of the last run of ota_update (-1 if it was cut).
+  */
+int sim_vhost_exit_code( void )
+{
+  return vhost_exit;
+}
+
+/**
+  * @brief Result line of the last run of ota_update, empty if none.
+  */
+const char *sim_vhost_result( void )
+{
+  return vhost_result;
+}
+
+/*
+ * System calls of ota_update
+ */
+int sim_vhost_open( const char *path, int flags, ... )
+{
+  (void)path;
+  (void)flags;
+  return SIM_VHOST_FD;
+}
+
+ssize_t sim_vhost_read( int fd, void *buf, size_t len )
+{
+  (void)fd;
+  return sim_uart_host_read( buf, ( len > UINT16_MAX ) ? UINT16_MAX : len, vhost_timeout_ms );
+}
+
+ssize_t sim_vhost_write( int fd, const void *buf, size_t len )
+{
+  (void)fd;
+  return sim_uart_host_write( buf, ( len > UINT16_MAX ) ? UINT16_MAX : len );
+}
+
+int sim_vhost_usleep( useconds_t us )
+{
+  sim_vt_sleep( us );
+  return 0;
+}
+
+int sim_vhost_clock_gettime( clockid_t clk, struct timespec *ts )
+{
+  uint64_t us = sim_vt_now_us();
+
+  (void)clk;
+  ts->tv_sec  = us / 1000000u;
+  ts->tv_nsec = ( us % 1000000u ) * 1000u;
+  return 0;
+}
+
+int sim_vhost_tcgetattr( int fd, struct termios *tty )
+{
+  (void)fd;
+  memset( tty, 0, sizeof(*tty) );
+  return 0;
+}
+
+int sim_vhost_tcsetattr( int fd, int action, const struct termios *tty )
+{
+  (void)fd;
+  (void)action;
+
+  //VMIN = 0: a read returns after VTIME deciseconds without data
+  vhost_timeout_ms = tty->c_cc[VTIME] * 100;
+  return 0;
+}
+
+int sim_vhost_tcflush( int fd, int queue )
+{
+  (void)fd;
+
+  //the bytes written are on the line already
+  if( queue != TCOFLUSH )
+  {
+    sim_uart_host_flush();
+  }
+  return 0;
+}
+
+int sim_vhost_printf( const char *fmt, ... )
+{
+  char    line[512];
+  char   *result;
+  va_list ap;
+  int     len;
+
+  va_start( ap, fmt );
+  len = vsnprintf( line, sizeof(line), fmt, ap );
+  va_end( ap );
+
+  //the Result line is kept for the session report
+  result = strstr( line, "Result:" );
+  if( result != NULL )
+  {
+    snprintf( vhost_result, sizeof(vhost_result), "%s", result );
+    vhost_result[strcspn( vhost_result, "\n" )] = '\0';
+  }
+
+  if( sim_verbose )
+  {
+    fputs( line, stdout );
+  }
+
+  return len;
+}
+
+FILE *sim_vhost_fopen( const char *path, const char *mode )
+{
+  vhost_file = fopen( path, mode );
+  return vhost_file;
+}
+
+int sim_vhost_fclose( FILE *file )
+{
+  if( file == vhost_file )
+  {
+    vhost_file = NULL;
+  }
+  return fclose( file );
+}
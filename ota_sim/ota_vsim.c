@@ -0,0 +1,217 @@
+/**************************************************
+
+file: ota_vsim.c
+purpose: -
+  -runs full OTA sessions in virtual time: the host tool (ota_update.c),
+   the serial link model and the bootloader OTA engine (etx_ota_update.c)
+   share one simulated clock (sim_vt.c). Both protocol sides are built
+   unchanged.
+  -the clock jumps to the next event (byte arrival, flash operation,
+   HAL_Delay, host pacing), so hours of modelled time take seconds, and
+   a profile and a seed always give the same run.
+  -one report per session (modelled duration, ota_update Result line,
+   flash and link accounting), the totals at the end.
+
+compile with the command:
+$ make
+
+use it (the options after the image are the ones of ota_update):
+$ ./ota_vsim -n 100 -L noisy ../Blink_Quick/Debug/Blink_Quick.bin
+$ ./ota_vsim -L uart -W 4 ../Blink_Quick/Debug/Blink_Quick.bin --pace 0
+$ ./ota_vsim -f flash.bin -b v1.bin
+$ ./ota_vsim -f flash.bin v2.bin --base v1.bin --compress
+
+**************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "etx_ota_update.h"
+#include "etx_boot_ctrl.h"
+#include "etx_trace.h"
+#include "sim_hal.h"
+
+static ETX_OTA_EX_ device_ret;
+
+void usage(void)
+{
+  printf("Usage: ./ota_vsim [-f flash.bin] [-n sessions] [-L link] [-S seed] [-B baud] [-E flips] [-V range] [-W width]\n");
+  printf("                  [-M] [-b] [-t limit] [-v] image [ota_update options]\n");
+  printf("  -f  flash content, loaded at start and saved after every session\n");
+  printf("  -n  number of OTA sessions (default: 1)\n");
+  printf("  -L  serial link profile (default: ideal)\n");
+  printf("  -S  seed of the link faults, session n uses seed+n (default: 1)\n");
+  printf("  -B  baud rate of the link (default: the one of the profile)\n");
+  printf("  -E  bit errors, flipped bits per million bytes (default: the ones of the profile)\n");
+  printf("  -V  supply voltage range: 1 (1.7-2.1V), 2 (2.1-2.7V), 3 (2.7-3.6V, default)\n");
+  printf("  -W  flash programming width of the OTA engine: 1, 2 or 4 bytes (default: 1)\n");
+  printf("  -M  datasheet max flash timings (default: typical)\n");
+  printf("  -b  boot the new image after each update: it confirms itself and becomes the active one\n");
+  printf("  -t  session limit, modelled seconds: a session still running is hung (default: 600)\n");
+  printf("  -v  print the bootloader debug output and the ota_update output\n");
+  printf("\nLink profiles:\n");
+  sim_link_print_profiles();
+}
+
+/* device task of a session */
+void device_task(void)
+{
+  device_ret = ETX_OTA_EX_ERR;
+  device_ret = etx_ota_download_and_flash();
+}
+
+/* wall clock, seconds */
+double wall_s(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *flash_file = NULL;
+  int sessions = 1;
+  const char *link = "ideal";
+  uint32_t seed = 1;
+  int baud = -1;
+  int flips = -1;
+  uint32_t limit_s = 600;
+  bool boot = false;
+  int nb_ok = 0, nb_error = 0, nb_hung = 0;
+  uint64_t modelled_us = 0;
+  double wall_start = wall_s();
+  int opt;
+  int ex = 0;
+
+  // '+': the options after the image are left to ota_update
+  while ((opt = getopt(argc, argv, "+f:n:L:S:B:E:V:W:Mbt:vh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f': flash_file = optarg;        break;
+      case 'n': sessions = atoi(optarg);    break;
+      case 'L': link = optarg;              break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      case 'B': baud = atoi(optarg);        break;
+      case 'E': flips = atoi(optarg);       break;
+      case 'V': sim_flash_model.voltage_range = atoi(optarg) - 1; break;
+      case 'W': sim_program_width = atoi(optarg);   break;
+      case 'M': sim_flash_model.max_timings = true; break;
+      case 'b': boot = true;                break;
+      case 't': limit_s = atoi(optarg);     break;
+      case 'v': sim_verbose = true;         break;
+      default:  usage();                    return -1;
+    }
+  }
+
+  if ((optind >= argc) || (sim_flash_model.voltage_range > FLASH_VOLTAGE_RANGE_3) ||
+      (sim_link_profile(link, seed) < 0) ||
+      ((sim_program_width != 1) && (sim_program_width != 2) && (sim_program_width != 4)))
+  {
+    usage();
+    return -1;
+  }
+
+  // ota_update <port> <image> [options]
+  int    host_argc = argc - optind + 2;
+  char **host_argv = calloc(host_argc + 1, sizeof(char *));
+
+  host_argv[0] = "ota_update";
+  host_argv[1] = "/dev/ota_vsim";
+  memcpy(&host_argv[2], &argv[optind], (argc - optind) * sizeof(char *));
+  sim_vhost_set_args(host_argc, host_argv);
+
+  do
+  {
+    if (sim_hal_init() < 0)
+    {
+      ex = -1;
+      break;
+    }
+
+    if ((flash_file != NULL) && (sim_flash_load(flash_file) < 0))
+    {
+      printf("Can not load %s\n", flash_file);
+      ex = -1;
+      break;
+    }
+
+    sim_vt = true;
+    etx_trace_init();
+
+    for (int n = 0; n < sessions; n++)
+    {
+      ETX_BOOT_RECORD_ rec;
+      uint64_t start = sim_clock_us();
+
+      sim_link_profile(link, seed + n);
+      if (baud >= 0)
+      {
+        sim_link.baud = baud;
+      }
+      if (flips >= 0)
+      {
+        sim_link.flip_ppm = flips;
+      }
+
+      sim_uart_flush();
+      sim_vhost_reset();
+      memset(&sim_flash_stats, 0, sizeof(sim_flash_stats));
+
+      SIM_VT_END_ end = sim_vt_run(device_task, sim_vhost_task, (uint64_t)limit_s * 1000000u);
+      bool ok = (end != SIM_VT_END_LIMIT) && (sim_vhost_exit_code() == 0) && (device_ret == ETX_OTA_EX_OK);
+
+      modelled_us += sim_clock_us() - start;
+      nb_ok    += ok;
+      nb_hung  += (end == SIM_VT_END_LIMIT);
+      nb_error += !ok && (end != SIM_VT_END_LIMIT);
+
+      if (ok && boot)
+      {
+        // The new image is booted and confirms itself. There is no
+        // application here to call etx_boot_ctrl_confirm(): a first rollback
+        // drops the pending state, a second one makes its slot the active one.
+        etx_boot_ctrl_rollback();
+        etx_boot_ctrl_rollback();
+      }
+
+      etx_boot_ctrl_load(&rec);
+
+      printf("Session %d: %s in %.3fs (active slot %c, pending slot %c)\n", n + 1,
+             ok ? "OK" : (end == SIM_VT_END_LIMIT) ? "HUNG" : "ERROR",
+             (sim_clock_us() - start) / 1e6, 'A' + rec.active_slot,
+             (rec.pending_slot == ETX_SLOT_NONE) ? '-' : 'A' + rec.pending_slot);
+
+      if (sim_vhost_result()[0] != '\0')
+      {
+        printf("%s\n", sim_vhost_result());
+      }
+      sim_flash_print_stats();
+      sim_link_print_stats();
+      fflush(stdout);
+
+      if ((flash_file != NULL) && (sim_flash_save(flash_file) < 0))
+      {
+        printf("Can not save %s\n", flash_file);
+        ex = -1;
+        break;
+      }
+    }
+
+    printf("Total: sessions=%d ok=%d error=%d hung=%d modelled_s=%.1f wall_s=%.2f\n",
+           sessions, nb_ok, nb_error, nb_hung, modelled_us / 1e6, wall_s() - wall_start);
+  } while (false);
+
+  free(host_argv);
+
+  return (ex);
+}
@@ -0,0 +1,236 @@
+/*
+ * sim_flash.c
+ *
+ *  Flash of the simulator: the 1MB array mapped at FLASH_BASE, behind the
+ *  HAL_FLASH_* API, with a timing model and operation accounting.
+ *
+ *  Timings are the STM32F412 datasheet ones. The erase time depends on the
+ *  sector size and on the parallelism (PSIZE), set by the voltage range of
+ *  the erase. Programming is 16us (typ) per operation whatever its width,
+ *  but the width is limited by the supply voltage.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "sim_hal.h"
+
+#define SIM_RANGES              3u          // F412: no x64 parallelism (no VPP)
+#define SIM_PROGRAM_MAX_US      100u        // Program time (max), any width
+#define SIM_ERASE_MAX_FACTOR    2u          // Erase time (max) / erase time (typ)
+
+/* STM32F412ZG sector map */
+const SIM_SECTOR_ sim_sector[SIM_FLASH_SECTORS] =
+{
+  { 0x08000000,  16 * 1024 }, { 0x08004000,  16 * 1024 },
+  { 0x08008000,  16 * 1024 }, { 0x0800C000,  16 * 1024 },
+  { 0x08010000,  64 * 1024 }, { 0x08020000, 128 * 1024 },
+  { 0x08040000, 128 * 1024 }, { 0x08060000, 128 * 1024 },
+  { 0x08080000, 128 * 1024 }, { 0x080A0000, 128 * 1024 },
+  { 0x080C0000, 128 * 1024 }, { 0x080E0000, 128 * 1024 },
+};
+
+/* Sector erase time in ms (typ), per voltage range (x8, x16, x32) and sector size */
+static const uint32_t erase_ms[SIM_RANGES][3] =
+{
+  /*  16KB   64KB  128KB */
+  {    400,  1200,  2000 },     // x8
+  {    300,   700,  1300 },     // x16
+  {    250,   550,  1000 },     // x32
+};
+
+/* Mass erase time in ms (typ), per voltage range */
+static const uint32_t mass_erase_ms[SIM_RANGES] = { 16000, 11000, 8000 };
+
+/* Program time in us (typ), per voltage range and width (byte, halfword, word,
+   double word). 0: width not allowed at this voltage */
+static const uint32_t program_us[SIM_RANGES][4] =
+{
+  {  16,   0,   0,   0 },     // 1.7V to 2.1V
+  {  16,  16,   0,   0 },     // 2.1V to 2.7V
+  {  16,  16,  16,   0 },     // 2.7V to 3.6V
+};
+
+SIM_FLASH_MODEL_ sim_flash_model =
+{
+  .voltage_range = FLASH_VOLTAGE_RANGE_3,   // 3.3V board
+  .max_timings   = false,
+  .realtime      = false,
+};
+
+SIM_FLASH_STATS_ sim_flash_stats;
+
+static bool flash_locked = true;
+
+/**
+  * @brief Load the flash content from a file (if it exists).
+  * @param file flash image, SIM_FLASH_SIZE bytes
+  * @retval 0 on success or if the file doesn't exist, -1 on error
+  */
+int sim_flash_load( const char *file )
+{
+  FILE *f = fopen( file, "rb" );
+  int   ret = 0;
+
+  if( f == NULL )
+  {
+    return 0;
+  }
+
+  if( fread( (void *)FLASH_BASE, 1, SIM_FLASH_SIZE, f ) != SIM_FLASH_SIZE )
+  {
+    ret = -1;
+  }
+
+  fclose( f );
+
+  return ret;
+}
+
+/**
+  * @brief Save the flash content to a file.
+  * @param file flash image
+  * @retval 0 on success, -1 on error
+  */
+int sim_flash_save( const char *file )
+{
+  FILE *f = fopen( file, "wb" );
+  int   ret = 0;
+
+  if( f == NULL )
+  {
+    return -1;
+  }
+
+  if( fwrite( (void *)FLASH_BASE, 1, SIM_FLASH_SIZE, f ) != SIM_FLASH_SIZE )
+  {
+    ret = -1;
+  }
+
+  fclose( f );
+
+  return ret;
+}
+
+/**
+  * @brief Print the flash operation accounting (one line, key=value).
+  * @param None
+  * @retval None
+  */
+void sim_flash_print_stats( void )
+{
+  printf( "Flash: erases=%u erased_kb=%u programs=%u bytes=%u overwrites=%u errors=%u "
+          "erase_ms=%.1f program_ms=%.1f total_ms=%.1f\n",
+          sim_flash_stats.erases, sim_flash_stats.erased_kb, sim_flash_stats.programs,
+          sim_flash_stats.bytes, sim_flash_stats.overwrites, sim_flash_stats.errors,
+          sim_flash_stats.erase_us / 1000.0, sim_flash_stats.program_us / 1000.0,
+          ( sim_flash_stats.erase_us + sim_flash_stats.program_us ) / 1000.0 );
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock( void )
+{
+  flash_locked = false;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock( void )
+{
+  flash_locked = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program( uint32_t TypeProgram, uint32_t Address, uint64_t Data )
+{
+  static const uint32_t width[] = { 1u, 2u, 4u, 8u };
+  uint8_t  *dst = (uint8_t *)(uintptr_t)Address;
+  uint8_t  *src = (uint8_t *)&Data;
+  uint64_t  us;
+
+  if( flash_locked || ( TypeProgram > FLASH_TYPEPROGRAM_DOUBLEWORD ) ||
+      ( Address < FLASH_BASE ) || ( Address + width[TypeProgram] > FLASH_BASE + SIM_FLASH_SIZE ) ||
+      ( program_us[sim_flash_model.voltage_range][TypeProgram] == 0u ) )
+  {
+    sim_flash_stats.errors++;
+    return HAL_ERROR;
+  }
+
+  for( uint32_t i = 0u; i < width[TypeProgram]; i++ )
+  {
+    if( dst[i] != 0xFF )
+    {
+      sim_flash_stats.overwrites++;
+    }
+    dst[i] &= src[i];                       //programming can only clear bits
+  }
+
+  us = sim_flash_model.max_timings ? SIM_PROGRAM_MAX_US :
+                                     program_us[sim_flash_model.voltage_range][TypeProgram];
+
+  sim_flash_stats.programs++;
+  sim_flash_stats.bytes      += width[TypeProgram];
+  sim_flash_stats.program_us += us;
+
+  sim_delay_us( us, sim_flash_model.realtime );
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase( FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError )
+{
+  uint32_t range = pEraseInit->VoltageRange;
+  uint64_t us    = 0u;
+
+  *SectorError = 0xFFFFFFFFU;
+
+  //the parallelism can't be above what the supply allows
+  if( flash_locked || ( range >= SIM_RANGES ) || ( range > sim_flash_model.voltage_range ) )
+  {
+    sim_flash_stats.errors++;
+    return HAL_ERROR;
+  }
+
+  if( pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE )
+  {
+    memset( (void *)FLASH_BASE, 0xFF, SIM_FLASH_SIZE );
+
+    us = mass_erase_ms[range] * 1000u;
+
+    sim_flash_stats.erases    += SIM_FLASH_SECTORS;
+    sim_flash_stats.erased_kb += SIM_FLASH_SIZE / 1024u;
+  }
+  else
+  {
+    for( uint32_t s = pEraseInit->Sector; s < pEraseInit->Sector + pEraseInit->NbSectors; s++ )
+    {
+      if( s >= SIM_FLASH_SECTORS )
+      {
+        *SectorError = s;
+        sim_flash_stats.errors++;
+        break;
+      }
+
+      uint32_t size = sim_sector[s].size;
+
+      memset( (void *)(uintptr_t)sim_sector[s].addr, 0xFF, size );
+
+      us += erase_ms[range][ ( size == 16 * 1024 ) ? 0 : ( size == 64 * 1024 ) ? 1 : 2 ] * 1000u;
+
+      sim_flash_stats.erases++;
+      sim_flash_stats.erased_kb += size / 1024u;
+    }
+  }
+
+  if( sim_flash_model.max_timings )
+  {
+    us *= SIM_ERASE_MAX_FACTOR;
+  }
+
+  sim_flash_stats.erase_us += us;
+
+  //the CPU can't read the flash meanwhile: no interrupt until the end
+  sim_tick();
+  sim_uart_stall( sim_clock_us() + us );
+
+  sim_delay_us( us, sim_flash_model.realtime );
+  return ( *SectorError == 0xFFFFFFFFU ) ? HAL_OK : HAL_ERROR;
+}
@@ -0,0 +1,416 @@
+/*
+ * sim_hal.c
+ *
+ *  HAL simulation layer: memory map, clock, DMA (to the CRC unit), GPIO,
+ *  the UART interrupt. The UART is in sim_uart.c, the flash in sim_flash.c.
+ *
+ *  The receive interrupt (HAL_UART_Receive_IT) runs for the bytes arrived
+ *  whenever the bootloader calls the HAL (sim_tick()): the bootloader only
+ *  sees its effects there, and the interrupt itself doesn't look at what
+ *  the main loop does between two HAL calls. Like the rest of the CPU work,
+ *  it takes no simulated time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "sim_hal.h"
+
+#define SIM_SLEEP_MIN_NS    1000000u    // Shortest real wait: a sleep costs more
+                                        // than a flash program operation
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* Definitions normally provided by main.c and system_stm32f4xx.c */
+UART_HandleTypeDef huart2;
+UART_HandleTypeDef huart6;
+uint32_t SystemCoreClock = 16000000;        // HSI, as configured by the bootloader
+
+bool sim_verbose = false;
+uint32_t sim_program_width = 1u;        // ETX_OTA_PROGRAM_WIDTH of the OTA engine
+bool sim_dma_fail = false;              // The DMA transfers fail (test_verify)
+
+/* Interrupt reception (HAL_UART_Receive_IT), one byte at a time */
+static UART_HandleTypeDef *rx_it_huart;
+static uint8_t            *rx_it_data;
+static bool                rx_it_running;
+
+static uint64_t start_ns;
+static uint64_t model_ns;       // Modelled time not spent on the host
+static uint64_t wait_until_ns;  // End of the real waits not done yet
+
+static void *sim_map( uint32_t addr, uint32_t size );
+static void sim_uart_irq( void );
+static uint64_t sim_now_ns( void );
+
+/**
+  * @brief Map the STM32 memory regions at their real addresses.
+  * @param None
+  * @retval 0 on success, -1 on error
+  */
+int sim_hal_init( void )
+{
+  if( ( sim_map( FLASH_BASE, SIM_FLASH_SIZE ) == NULL ) ||
+      ( sim_map( PERIPH_BASE, SIM_PERIPH_SIZE ) == NULL ) ||
+      ( sim_map( SIM_SCS_BASE, SIM_SCS_SIZE ) == NULL ) )
+  {
+    return -1;
+  }
+
+  //erased flash
+  memset( (void *)FLASH_BASE, 0xFF, SIM_FLASH_SIZE );
+
+  //as configured by the bootloader (main.c)
+  huart2.Init.BaudRate = 115200;
+  huart6.Init.BaudRate = 115200;
+
+  start_ns = sim_now_ns();
+
+  return 0;
+}
+
+/**
+  * @brief Debug output of the bootloader (USART2). The bootloader sends it
+  *        with the blocking HAL_UART_Transmit: the OTA waits for each byte
+  *        at the baud rate of USART2, shown or not.
+  */
+void printd( char *pMsg )
+{
+  if( sim_verbose )
+  {
+    fputs( pMsg, stdout );
+  }
+  sim_delay_us( strlen( pMsg ) * 10000000ull / huart2.Init.BaudRate, true );
+}
+
+void printdln( char *pMsg )
+{
+  if( sim_verbose )
+  {
+    puts( pMsg );
+  }
+  sim_delay_us( ( strlen( pMsg ) + 2u ) * 10000000ull / huart2.Init.BaudRate, true );   // and "\r\n"
+}
+
+/*
+ * UART
+ */
+HAL_StatusTypeDef HAL_UART_Receive( UART_HandleTypeDef *huart, uint8_t *pData,
+                                    uint16_t Size, uint32_t Timeout )
+{
+  int ret = sim_uart_read( pData, Size, ( Timeout == HAL_MAX_DELAY ) ? -1 : (int)Timeout );
+
+  (void)huart;
+
+  sim_tick();
+  return ( ret < 0 ) ? HAL_TIMEOUT : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit( UART_HandleTypeDef *huart, const uint8_t *pData,
+                                     uint16_t Size, uint32_t Timeout )
+{
+  int ret = sim_uart_write( pData, Size );
+
+  (void)huart;
+  (void)Timeout;
+
+  sim_tick();
+  return ( ret < 0 ) ? HAL_ERROR : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT( UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size )
+{
+  if( ( Size != 1u ) || ( rx_it_data != NULL ) )
+  {
+    //one byte at a time, as the bootloader does
+    return ( rx_it_data != NULL ) ? HAL_BUSY : HAL_ERROR;
+  }
+
+  rx_it_huart = huart;
+  rx_it_data  = pData;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive( UART_HandleTypeDef *huart )
+{
+  (void)huart;
+
+  rx_it_huart = NULL;
+  rx_it_data  = NULL;
+  return HAL_OK;
+}
+
+/*
+ * DMA: memory-to-memory only. A transfer to the CRC data register feeds
+ * the CRC unit.
+ */
+HAL_StatusTypeDef HAL_DMA_Init( DMA_HandleTypeDef *hdma )
+{
+  hdma->State = HAL_DMA_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit( DMA_HandleTypeDef *hdma )
+{
+  hdma->State = HAL_DMA_STATE_RESET;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Start( DMA_HandleTypeDef *hdma, uint32_t SrcAddress,
+                                 uint32_t DstAddress, uint32_t DataLength )
+{
+  const uint32_t *src = (const uint32_t *)(uintptr_t)SrcAddress;
+
+  (void)hdma;
+
+  if( sim_dma_fail )
+  {
+    //a transfer error: the HAL reports it, nothing is moved
+    return HAL_ERROR;
+  }
+
+  if( DstAddress != (uint32_t)(uintptr_t)&CRC->DR )
+  {
+    memcpy( (void *)(uintptr_t)DstAddress, src, DataLength * sizeof(uint32_t) );
+    return HAL_OK;
+  }
+
+  if( ( CRC->CR & CRC_CR_RESET ) != 0u )
+  {
+    CRC->CR &= ~CRC_CR_RESET;
+    CRC->DR  = 0xFFFFFFFFU;
+  }
+
+  for( uint32_t i = 0u; i < DataLength; i++ )
+  {
+    uint32_t crc = CRC->DR ^ src[i];
+
+    for( int bit = 0; bit < 32; bit++ )
+    {
+      crc = ( crc & 0x80000000U ) ? ( ( crc << 1 ) ^ 0x04C11DB7U ) : ( crc << 1 );
+    }
+    CRC->DR = crc;
+  }
+
+  sim_tick();
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_PollForTransfer( DMA_HandleTypeDef *hdma,
+                                           HAL_DMA_LevelCompleteTypeDef CompleteLevel,
+                                           uint32_t Timeout )
+{
+  (void)hdma;
+  (void)CompleteLevel;
+  (void)Timeout;
+  return HAL_OK;
+}
+
+/*
+ * PWR, GPIO, unique ID and tick
+ */
+void HAL_PWR_EnableBkUpAccess( void )
+{
+}
+
+void HAL_PWR_DisableBkUpAccess( void )
+{
+}
+
+void HAL_PWR_EnterSLEEPMode( uint32_t Regulator, uint8_t SLEEPEntry )
+{
+  (void)Regulator;
+  (void)SLEEPEntry;
+
+  //up to the next interrupt: a byte, or the tick
+  sim_uart_sleep( rx_it_data != NULL );
+  sim_tick();
+}
+
+void HAL_GPIO_WritePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState )
+{
+  (void)GPIOx;
+  (void)GPIO_Pin;
+  (void)PinState;
+}
+
+void HAL_GPIO_TogglePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin )
+{
+  (void)GPIOx;
+  (void)GPIO_Pin;
+}
+
+uint32_t HAL_GetUIDw0( void )
+{
+  return 0x00390041u;                   // A made-up STM32F412 unique ID
+}
+
+uint32_t HAL_GetUIDw1( void )
+{
+  return 0x4D4D5010u;
+}
+
+uint32_t HAL_GetUIDw2( void )
+{
+  return 0x20313753u;
+}
+
+uint32_t HAL_GetTick( void )
+{
+  return (uint32_t)( sim_clock_us() / 1000u );
+}
+
+void HAL_Delay( uint32_t Delay )
+{
+  sim_delay_us( Delay * 1000u, true );
+}
+
+/**
+  * @brief Simulated time: host time plus the modelled time not spent
+  *        (see sim_delay_us()), or the virtual time (sim_vt.c).
+  * @param None
+  * @retval microseconds since sim_hal_init()
+  */
+uint64_t sim_clock_us( void )
+{
+  if( sim_vt )
+  {
+    return sim_vt_now_us();
+  }
+
+  return ( sim_now_ns() - start_ns + model_ns ) / 1000u;
+}
+
+/**
+  * @brief Account for the duration of a modelled operation.
+  * @param us duration
+  * @param realtime true to really wait, false to only move the simulated
+  *        time on (in virtual time, the clock moves on to the end of the wait)
+  * @retval None
+  */
+void sim_delay_us( uint64_t us, bool realtime )
+{
+  if( sim_vt )
+  {
+    sim_vt_sleep( us );
+  }
+  else if( realtime )
+  {
+    //The durations are summed up and waited for at once
+    uint64_t now = sim_now_ns();
+
+    if( wait_until_ns < now )
+    {
+      wait_until_ns = now;
+    }
+    wait_until_ns += us * 1000u;
+
+    if( wait_until_ns - now >= SIM_SLEEP_MIN_NS )
+    {
+      struct timespec ts = { .tv_sec  = ( wait_until_ns - now ) / 1000000000u,
+                             .tv_nsec = ( wait_until_ns - now ) % 1000000000u };
+      nanosleep( &ts, NULL );
+    }
+  }
+  else
+  {
+    model_ns += us * 1000u;
+  }
+  sim_tick();
+}
+
+/**
+  * @brief Move the DWT cycle counter on, at SystemCoreClock, so the stage
+  *        timing of the bootloader measures the simulated time.
+  * @param None
+  * @retval None
+  */
+void sim_tick( void )
+{
+  sim_uart_irq();
+  DWT->CYCCNT = (uint32_t)( sim_clock_us() * ( SystemCoreClock / 1000000u ) );
+}
+
+/**
+  * @brief Run the receive interrupt for each byte arrived, at its arrival
+  *        time (DWT cycle counter).
+  * @param None
+  * @retval None
+  */
+static void sim_uart_irq( void )
+{
+  uint8_t  byte;
+  uint64_t time_us;
+  int      ret;
+
+  if( rx_it_running )
+  {
+    return;
+  }
+  rx_it_running = true;
+
+  while( ( rx_it_data != NULL ) && ( ( ret = sim_uart_rx_take( &byte, &time_us ) ) != 0 ) )
+  {
+    UART_HandleTypeDef *huart = rx_it_huart;
+    uint8_t            *data  = rx_it_data;
+
+    //the HAL ends the reception, the callback starts the next one
+    rx_it_huart = NULL;
+    rx_it_data  = NULL;
+    DWT->CYCCNT = (uint32_t)( time_us * ( SystemCoreClock / 1000000u ) );
+
+    if( ret > 0 )
+    {
+      *data = byte;
+      HAL_UART_RxCpltCallback( huart );
+    }
+    else
+    {
+      huart->ErrorCode = HAL_UART_ERROR_ORE;
+      HAL_UART_ErrorCallback( huart );
+    }
+  }
+
+  rx_it_running = false;
+}
+
+/**
+  * @brief Map a region at a fixed address.
+  * @param addr region address
+  * @param size region size
+  * @retval region, NULL on error
+  */
+static void *sim_map( uint32_t addr, uint32_t size )
+{
+  void *p = mmap( (void *)(uintptr_t)addr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0 );
+
+  if( p != (void *)(uintptr_t)addr )
+  {
+    fprintf( stderr, "Can not map 0x%08X (%u bytes)\n", addr, size );
+    return NULL;
+  }
+
+  return p;
+}
+
+/**
+  * @brief Monotonic time.
+  * @param None
+  * @retval nanoseconds
+  */
+static uint64_t sim_now_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
@@ -0,0 +1,147 @@
+/*
+ * sim_hal.h
+ *
+ *  HAL simulation layer: lets the bootloader OTA engine run on Linux.
+ *
+ *  The STM32 memory regions the engine touches are mapped at their real
+ *  addresses (flash, peripherals, Cortex-M system registers), so the
+ *  bootloader sources and the CMSIS/HAL headers are used unchanged. Only the
+ *  HAL functions are replaced: UART by a pseudo-terminal, flash by the mapped
+ *  1MB array with the STM32F412 sector geometry and timings.
+ */
+
+#ifndef SIM_HAL_H_
+#define SIM_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_FLASH_SIZE      ( 1024 * 1024 )     // STM32F412ZG
+#define SIM_FLASH_SECTORS   12u
+#define SIM_PERIPH_SIZE     0x00080000          // APB1, APB2 and AHB1
+#define SIM_SCS_BASE        0xE0000000          // Cortex-M private peripherals
+#define SIM_SCS_SIZE        0x00100000
+
+#define SIM_VT_DEVICE       0               // Virtual time tasks (sim_vt.c)
+#define SIM_VT_HOST         1
+#define SIM_VT_TASKS        2
+
+/*
+ * Flash sector
+ */
+typedef struct
+{
+  uint32_t  addr;
+  uint32_t  size;
+}SIM_SECTOR_;
+
+/*
+ * Flash timing model (STM32F412 datasheet, program/erase characteristics)
+ */
+typedef struct
+{
+  uint32_t  voltage_range;  // Supply: FLASH_VOLTAGE_RANGE_1 (1.7V) to _3 (2.7-3.6V)
+  bool      max_timings;    // Datasheet max values instead of typical ones
+  bool      realtime;       // Really wait for the modelled duration
+}SIM_FLASH_MODEL_;
+
+/*
+ * Flash operation accounting
+ */
+typedef struct
+{
+  uint32_t  erases;         // Sectors erased
+  uint32_t  erased_kb;
+  uint32_t  programs;       // Program operations
+  uint32_t  bytes;          // Bytes programmed
+  uint32_t  overwrites;     // Programs of a location not erased (only clears bits)
+  uint32_t  errors;         // Operations refused (locked, bad width or range)
+  uint64_t  erase_us;       // Modelled durations
+  uint64_t  program_us;
+}SIM_FLASH_STATS_;
+
+/*
+ * Serial link profile (between the host tool and the OTA UART)
+ */
+typedef struct
+{
+  const char *name;
+  uint32_t    baud;         // 0: no serialization time
+  uint32_t    latency_us;   // Device to host delivery delay (USB-serial latency timer)
+  uint32_t    rx_fifo;      // Device RX depth: bytes kept while the CPU isn't reading
+                            // (0: no limit, no overrun)
+  uint32_t    drop_ppm;     // Faults, per million bytes
+  uint32_t    flip_ppm;
+  uint32_t    dup_ppm;
+  uint32_t    stall_ppm;
+  uint32_t    stall_ms;     // Duration of a stall
+}SIM_LINK_;
+
+/*
+ * Serial link accounting
+ */
+typedef struct
+{
+  uint32_t  rx_bytes;       // Host to device
+  uint32_t  tx_bytes;       // Device to host
+  uint32_t  dropped;
+  uint32_t  flipped;
+  uint32_t  duplicated;
+  uint32_t  stalls;
+  uint32_t  overruns;       // Bytes lost in the device RX
+  uint64_t  first_rx_us;    // Simulated time of the first byte received
+  uint64_t  last_us;        // Simulated time of the last byte (either way)
+}SIM_LINK_STATS_;
+
+/*
+ * End of a virtual time session
+ */
+typedef enum
+{
+  SIM_VT_END_DONE   = 0,    // Both tasks returned
+  SIM_VT_END_IDLE   = 1,    // A task was left waiting for nothing (e.g. the device
+                            // after the host gave up)
+  SIM_VT_END_LIMIT  = 2,    // Session limit reached: hung
+}SIM_VT_END_;
+
+extern const SIM_SECTOR_ sim_sector[SIM_FLASH_SECTORS];
+extern SIM_LINK_ sim_link;
+extern SIM_LINK_STATS_ sim_link_stats;
+extern SIM_FLASH_MODEL_ sim_flash_model;
+extern SIM_FLASH_STATS_ sim_flash_stats;
+extern bool sim_verbose;
+extern uint32_t sim_program_width;
+extern bool sim_dma_fail;
+extern bool sim_vt;
+
+int sim_hal_init( void );
+uint64_t sim_clock_us( void );
+void sim_delay_us( uint64_t us, bool realtime );
+void sim_tick( void );
+int sim_link_profile( const char *name, uint32_t seed );
+void sim_link_print_profiles( void );
+void sim_link_print_stats( void );
+int sim_uart_open( char *name, int name_len );
+void sim_uart_flush( void );
+void sim_uart_drain( void );
+int sim_uart_rx_take( uint8_t *byte, uint64_t *time_us );
+void sim_uart_stall( uint64_t end_us );
+void sim_uart_sleep( bool rx_it );
+int sim_uart_read( uint8_t *buf, uint16_t len, int timeout_ms );
+int sim_uart_write( const uint8_t *buf, uint16_t len );
+int sim_uart_host_read( uint8_t *buf, uint16_t len, int timeout_ms );
+int sim_uart_host_write( const uint8_t *buf, uint16_t len );
+void sim_uart_host_flush( void );
+SIM_VT_END_ sim_vt_run( void (*device)( void ), void (*host)( void ), uint64_t limit_us );
+void sim_vt_wait( uint64_t until_us, uint64_t (*next)( void ) );
+void sim_vt_sleep( uint64_t us );
+uint64_t sim_vt_now_us( void );
+void sim_vhost_set_args( int argc, char **argv );
+void sim_vhost_reset( void );
+void sim_vhost_task( void );
+int sim_vhost_exit_code( void );
+const char *sim_vhost_result( void );
+int sim_flash_load( const char *file );
+int sim_flash_save( const char *file );
+void sim_flash_print_stats( void );
+#endif /* SIM_HAL_H_ */
@@ -0,0 +1,761 @@
+/*
+ * sim_uart.c
+ *
+ *  OTA UART of the simulator: the master side of a pseudo-terminal, behind
+ *  a serial link model.
+ *  Kept apart from sim_hal.c: termios.h and the CMSIS device header
+ *  define the same names.
+ *
+ *  Host to device: a thread timestamps the bytes written by the host with
+ *  their arrival time on the device (bit time at the chosen baud, stalls).
+ *  While the device isn't in HAL_UART_Receive, arrived bytes are kept in the
+ *  RX FIFO (1 byte: the USART data register); the following ones are lost
+ *  (overrun). With the interrupt reception (HAL_UART_Receive_IT), each byte
+ *  is taken when it arrives (sim_uart_rx_take()), except while the CPU
+ *  stalls on a flash erase (sim_uart_stall()): then the RX FIFO again.
+ *  Device to host: the transmission takes the bit time, then the bytes are
+ *  delivered to the host after the USB-serial latency.
+ *  Faults (drops, bit flips, duplicated bytes, stalls) are drawn from a
+ *  seeded generator: a profile and a seed give the same link every time.
+ *
+ *  In virtual time (sim_vt.c) there is no pseudo-terminal and no thread:
+ *  the host tool, in the same process, writes and reads the link queues
+ *  directly (sim_uart_host_write(), sim_uart_host_read()).
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sim_hal.h"
+
+#define SIM_LINK_QUEUE      ( 256 * 1024 )      // Bytes in flight, each way: the host sends up to 8 packets of 17KB at once
+#define SIM_LINK_FIFO_MAX   64u
+
+/*
+ * Byte in flight
+ */
+typedef struct
+{
+  uint8_t   byte;
+  uint64_t  time_us;        // Arrival (or delivery) time
+}SIM_LINK_BYTE_;
+
+/*
+ * One direction of the link
+ */
+typedef struct
+{
+  SIM_LINK_BYTE_  q[SIM_LINK_QUEUE];
+  uint32_t        head;
+  uint32_t        tail;
+  uint64_t        free_us;  // The line is free from then on
+  uint32_t        rand;     // Fault generator
+}SIM_LINK_DIR_;
+
+/* Link profiles */
+static const SIM_LINK_ profiles[] =
+{
+  /* name         baud   latency fifo   drop  flip   dup stall  ms */
+  { "ideal",         0,       0,    0,     0,    0,    0,    0,  0 },
+  { "uart",     115200,       0,    1,     0,    0,    0,    0,  0 },
+  { "ftdi",     115200,    1000,    1,     0,    0,    0,    0,  0 },
+  { "noisy",    115200,    1000,    1,   100,  100,   50,   10, 50 },
+  { "bad",       57600,   16000,    1,  1000, 1000,  500,  100, 200 },
+};
+
+SIM_LINK_       sim_link = { "ideal", 0, 0, 0, 0, 0, 0, 0, 0 };
+SIM_LINK_STATS_ sim_link_stats;
+
+static int             uart_fd = -1;
+static SIM_LINK_DIR_   rx;          // Host to device
+static SIM_LINK_DIR_   tx;          // Device to host
+static uint8_t         fifo[SIM_LINK_FIFO_MAX];
+static uint32_t        fifo_len;
+static uint64_t        read_end_us;     // Arrival of the last byte read by the device
+static uint64_t        read_ret_us;     // Simulated time the last read returned
+static uint64_t        stall_end_us;    // End of the CPU stall, 0 if none
+static uint32_t        stall_overruns;  // Overruns of the stall not reported yet
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rx_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  tx_cond = PTHREAD_COND_INITIALIZER;
+
+static void *sim_link_rx_thread( void *arg );
+static void *sim_link_tx_thread( void *arg );
+static void sim_link_send( SIM_LINK_DIR_ *dir, uint8_t byte, uint64_t now, uint64_t delay_us );
+static void sim_link_arrived( uint64_t now, uint8_t *buf, uint16_t *count, uint16_t len );
+static uint64_t sim_link_rx_next( void );
+static uint64_t sim_link_tx_next( void );
+static bool sim_link_fault( SIM_LINK_DIR_ *dir, uint32_t ppm );
+
+/**
+  * @brief Select a link profile.
+  * @param name profile name
+  * @param seed seed of the fault generator
+  * @retval 0 on success, -1 if the profile doesn't exist
+  */
+int sim_link_profile( const char *name, uint32_t seed )
+{
+  rx.rand = seed | 1u;
+  tx.rand = ( seed ^ 0x5A5A5A5A ) | 1u;
+
+  for( uint32_t i = 0u; i < sizeof(profiles) / sizeof(profiles[0]); i++ )
+  {
+    if( strcmp( profiles[i].name, name ) == 0 )
+    {
+      sim_link = profiles[i];
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+  * @brief Print the link profiles.
+  * @param None
+  * @retval None
+  */
+void sim_link_print_profiles( void )
+{
+  for( uint32_t i = 0u; i < sizeof(profiles) / sizeof(profiles[0]); i++ )
+  {
+    const SIM_LINK_ *p = &profiles[i];
+
+    printf( "  %-6s baud=%u latency=%uus fifo=%u drop=%uppm flip=%uppm dup=%uppm stall=%uppm/%ums\n",
+            p->name, p->baud, p->latency_us, p->rx_fifo, p->drop_ppm, p->flip_ppm,
+            p->dup_ppm, p->stall_ppm, p->stall_ms );
+  }
+}
+
+/**
+  * @brief Print the link accounting (one line, key=value).
+  * @param None
+  * @retval None
+  */
+void sim_link_print_stats( void )
+{
+  uint64_t us = sim_link_stats.last_us - sim_link_stats.first_rx_us;
+
+  printf( "Link: profile=%s rx_bytes=%u tx_bytes=%u dropped=%u flipped=%u duplicated=%u "
+          "stalls=%u overruns=%u time_ms=%.1f rx_Bps=%.0f\n",
+          sim_link.name, sim_link_stats.rx_bytes, sim_link_stats.tx_bytes,
+          sim_link_stats.dropped, sim_link_stats.flipped, sim_link_stats.duplicated,
+          sim_link_stats.stalls, sim_link_stats.overruns, us / 1000.0,
+          ( us != 0u ) ? sim_link_stats.rx_bytes * 1e6 / us : 0.0 );
+}
+
+/**
+  * @brief Open the pseudo-terminal the host tool connects to.
+  * @param name receives the name of the slave side (/dev/pts/N)
+  * @param name_len size of name
+  * @retval 0 on success, -1 on error
+  */
+int sim_uart_open( char *name, int name_len )
+{
+  struct termios tty;
+  pthread_t      thread;
+
+  uart_fd = posix_openpt( O_RDWR | O_NOCTTY );
+
+  if( ( uart_fd < 0 ) || ( grantpt( uart_fd ) != 0 ) || ( unlockpt( uart_fd ) != 0 ) ||
+      ( ptsname_r( uart_fd, name, name_len ) != 0 ) )
+  {
+    return -1;
+  }
+
+  //raw link, whatever the host does with the slave side
+  if( tcgetattr( uart_fd, &tty ) == 0 )
+  {
+    cfmakeraw( &tty );
+    tcsetattr( uart_fd, TCSANOW, &tty );
+  }
+
+  if( ( pthread_create( &thread, NULL, sim_link_rx_thread, NULL ) != 0 ) ||
+      ( pthread_create( &thread, NULL, sim_link_tx_thread, NULL ) != 0 ) )
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+  * @brief Drop the bytes left in the link (between two OTA sessions) and
+  *        clear the accounting.
+  * @param None
+  * @retval None
+  */
+void sim_uart_flush( void )
+{
+  pthread_mutex_lock( &lock );
+
+  if( uart_fd >= 0 )
+  {
+    tcflush( uart_fd, TCIOFLUSH );
+  }
+  rx.head  = rx.tail;
+  tx.head  = tx.tail;
+  fifo_len = 0u;
+  stall_end_us   = 0u;
+  stall_overruns = 0u;
+  memset( &sim_link_stats, 0, sizeof(sim_link_stats) );
+
+  pthread_mutex_unlock( &lock );
+}
+
+/**
+  * @brief Wait until the host got everything the device sent.
+  * @param None
+  * @retval None
+  */
+void sim_uart_drain( void )
+{
+  pthread_mutex_lock( &lock );
+
+  while( tx.head != tx.tail )
+  {
+    pthread_mutex_unlock( &lock );
+    usleep( 1000 );
+    pthread_mutex_lock( &lock );
+  }
+
+  pthread_mutex_unlock( &lock );
+}
+
+/**
+  * @brief Receive bytes (the device is reading until it has them all).
+  * @param buf buffer
+  * @param len number of bytes to receive
+  * @param timeout_ms timeout, -1 for none
+  * @retval 0 on success, -1 on timeout
+  */
+int sim_uart_read( uint8_t *buf, uint16_t len, int timeout_ms )
+{
+  uint16_t count = 0u;
+  uint64_t start = sim_clock_us();
+  uint64_t end   = start + (uint64_t)timeout_ms * 1000u;
+
+  pthread_mutex_lock( &lock );
+
+  //what came in while the CPU was busy: from the end of the previous read
+  //(the host scheduling delays of this thread aren't CPU time)
+  if( sim_link.rx_fifo != 0u )
+  {
+    sim_link_arrived( read_end_us + ( start - read_ret_us ), NULL, NULL, 0u );
+  }
+
+  while( ( fifo_len > 0u ) && ( count < len ) )
+  {
+    buf[count++] = fifo[0];
+    memmove( &fifo[0], &fifo[1], --fifo_len );
+    read_end_us = start;
+  }
+
+  while( count < len )
+  {
+    uint64_t now = sim_clock_us();
+
+    sim_link_arrived( now, buf, &count, len );
+
+    if( count >= len )
+    {
+      break;
+    }
+
+    if( ( timeout_ms >= 0 ) && ( now >= end ) )
+    {
+      read_end_us = now;
+      read_ret_us = sim_clock_us();
+      pthread_mutex_unlock( &lock );
+      return -1;
+    }
+
+    if( sim_vt )
+    {
+      //the clock moves on to the next byte, or to the timeout
+      pthread_mutex_unlock( &lock );
+      sim_vt_wait( ( timeout_ms >= 0 ) ? end : UINT64_MAX, sim_link_rx_next );
+      pthread_mutex_lock( &lock );
+    }
+    else if( rx.head != rx.tail )
+    {
+      //next byte still on the line
+      uint64_t wait = rx.q[rx.head].time_us - now;
+
+      pthread_mutex_unlock( &lock );
+      usleep( ( wait < 1000u ) ? wait : 1000u );
+      pthread_mutex_lock( &lock );
+    }
+    else
+    {
+      struct timespec ts;
+
+      clock_gettime( CLOCK_REALTIME, &ts );
+      ts.tv_nsec += 1000000;
+      if( ts.tv_nsec >= 1000000000 )
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait( &rx_cond, &lock, &ts );
+    }
+  }
+
+  read_ret_us = sim_clock_us();
+  pthread_mutex_unlock( &lock );
+
+  return 0;
+}
+
+/**
+  * @brief Interrupt reception: take the next byte arrived on the device.
+  *        The bytes of a CPU stall come from the RX FIFO, then the overrun.
+  * @param byte byte
+  * @param time_us its arrival time (the end of the stall for the FIFO)
+  * @retval 1 for a byte, -1 for an overrun (reception error), 0 if none arrived
+  */
+int sim_uart_rx_take( uint8_t *byte, uint64_t *time_us )
+{
+  uint64_t now   = sim_clock_us();
+  uint16_t count = 0u;
+  int      ret   = 0;
+
+  pthread_mutex_lock( &lock );
+
+  *time_us = now;
+
+  if( ( stall_end_us != 0u ) && ( now >= stall_end_us ) )
+  {
+    //the interrupt runs at the end of the stall: what came meanwhile is
+    //in the RX FIFO, the rest is lost
+    uint32_t overruns = sim_link_stats.overruns;
+
+    if( sim_link.rx_fifo != 0u )
+    {
+      sim_link_arrived( stall_end_us, NULL, NULL, 0u );
+    }
+    stall_overruns += sim_link_stats.overruns - overruns;
+    stall_end_us    = 0u;
+  }
+
+  if( fifo_len > 0u )
+  {
+    *byte = fifo[0];
+    memmove( &fifo[0], &fifo[1], --fifo_len );
+    ret = 1;
+  }
+  else if( stall_overruns > 0u )
+  {
+    stall_overruns = 0u;
+    ret = -1;
+  }
+  else if( stall_end_us == 0u )
+  {
+    sim_link_arrived( now, byte, &count, 1u );
+    if( count > 0u )
+    {
+      *time_us = read_end_us;
+      ret = 1;
+    }
+  }
+
+  pthread_mutex_unlock( &lock );
+
+  return ret;
+}
+
+/**
+  * @brief The CPU stalls (flash erase): the interrupts don't run until then.
+  * @param end_us end of the stall, simulated time
+  * @retval None
+  */
+void sim_uart_stall( uint64_t end_us )
+{
+  pthread_mutex_lock( &lock );
+  stall_end_us = end_us;
+  pthread_mutex_unlock( &lock );
+}
+
+/**
+  * @brief The CPU sleeps (WFI) up to the next interrupt: a byte on the
+  *        line or the tick (1ms).
+  * @param rx_it the receive interrupt is enabled
+  * @retval None
+  */
+void sim_uart_sleep( bool rx_it )
+{
+  uint64_t now  = sim_clock_us();
+  uint64_t tick = now - now % 1000u + 1000u;
+  uint64_t next = tick;
+
+  if( sim_vt )
+  {
+    //the tick only wakes the loop up to sleep again: up to the next byte,
+    //so a device left waiting for a host that is gone ends the session
+    sim_vt_wait( rx_it ? UINT64_MAX : tick, rx_it ? sim_link_rx_next : NULL );
+    return;
+  }
+
+  pthread_mutex_lock( &lock );
+  if( rx_it && ( rx.head != rx.tail ) && ( rx.q[rx.head].time_us < tick ) )
+  {
+    next = rx.q[rx.head].time_us;
+  }
+  pthread_mutex_unlock( &lock );
+
+  if( next > now )
+  {
+    usleep( next - now );
+  }
+}
+
+/**
+  * @brief Transmit bytes. Returns when the last one is on the line.
+  * @param buf data
+  * @param len number of bytes
+  * @retval 0 on success, -1 on error
+  */
+int sim_uart_write( const uint8_t *buf, uint16_t len )
+{
+  uint32_t byte_us = ( sim_link.baud != 0u ) ? 10000000u / sim_link.baud : 0u;
+
+  pthread_mutex_lock( &lock );
+
+  for( uint16_t i = 0u; i < len; i++ )
+  {
+    sim_link_send( &tx, buf[i], sim_clock_us(), byte_us );
+    sim_link_stats.tx_bytes++;
+  }
+
+  uint64_t done = tx.free_us;
+
+  pthread_cond_signal( &tx_cond );
+  pthread_mutex_unlock( &lock );
+
+  //blocking transmit: the CPU waits for the line
+  uint64_t now = sim_clock_us();
+  if( done > now )
+  {
+    sim_delay_us( done - now, true );
+  }
+
+  return 0;
+}
+
+/**
+  * @brief Host side, in virtual time: write bytes on the link.
+  * @param buf data
+  * @param len number of bytes
+  * @retval number of bytes written
+  */
+int sim_uart_host_write( const uint8_t *buf, uint16_t len )
+{
+  uint32_t byte_us = ( sim_link.baud != 0u ) ? 10000000u / sim_link.baud : 0u;
+
+  pthread_mutex_lock( &lock );
+
+  for( uint16_t i = 0u; i < len; i++ )
+  {
+    sim_link_send( &rx, buf[i], sim_clock_us(), byte_us );
+    sim_link_stats.rx_bytes++;
+  }
+
+  pthread_mutex_unlock( &lock );
+
+  return len;
+}
+
+/**
+  * @brief Host side, in virtual time: read the bytes delivered so far
+  *        (a tty read with VMIN = 0 and a timeout).
+  * @param buf buffer
+  * @param len size of buf
+  * @param timeout_ms time to wait for the first byte
+  * @retval number of bytes read, 0 on timeout
+  */
+int sim_uart_host_read( uint8_t *buf, uint16_t len, int timeout_ms )
+{
+  uint64_t end   = sim_clock_us() + (uint64_t)timeout_ms * 1000u;
+  uint16_t count = 0u;
+
+  pthread_mutex_lock( &lock );
+
+  while( true )
+  {
+    uint64_t now = sim_clock_us();
+
+    while( ( tx.head != tx.tail ) && ( count < len ) &&
+           ( tx.q[tx.head].time_us + sim_link.latency_us <= now ) )
+    {
+      buf[count++] = tx.q[tx.head].byte;
+      tx.head = ( tx.head + 1u ) % SIM_LINK_QUEUE;
+      sim_link_stats.last_us = now;
+    }
+
+    if( ( count > 0u ) || ( now >= end ) )
+    {
+      break;
+    }
+
+    pthread_mutex_unlock( &lock );
+    sim_vt_wait( end, sim_link_tx_next );
+    pthread_mutex_lock( &lock );
+  }
+
+  pthread_mutex_unlock( &lock );
+
+  return count;
+}
+
+/**
+  * @brief Host side, in virtual time: drop the bytes delivered and not read
+  *        yet (tcflush of the input). The bytes still on the line arrive.
+  * @param None
+  * @retval None
+  */
+void sim_uart_host_flush( void )
+{
+  pthread_mutex_lock( &lock );
+
+  while( ( tx.head != tx.tail ) && ( tx.q[tx.head].time_us + sim_link.latency_us <= sim_clock_us() ) )
+  {
+    tx.head = ( tx.head + 1u ) % SIM_LINK_QUEUE;
+  }
+
+  pthread_mutex_unlock( &lock );
+}
+
+/**
+  * @brief Host to device: timestamp the bytes written by the host.
+  */
+static void *sim_link_rx_thread( void *arg )
+{
+  uint8_t data[256];
+  uint32_t byte_us;
+
+  (void)arg;
+
+  while( true )
+  {
+    ssize_t len = read( uart_fd, data, sizeof(data) );
+
+    if( len <= 0 )
+    {
+      //host not connected (yet): wait for it
+      usleep( 10000 );
+      continue;
+    }
+
+    pthread_mutex_lock( &lock );
+
+    byte_us = ( sim_link.baud != 0u ) ? 10000000u / sim_link.baud : 0u;
+
+    for( ssize_t i = 0; i < len; i++ )
+    {
+      sim_link_send( &rx, data[i], sim_clock_us(), byte_us );
+      sim_link_stats.rx_bytes++;
+    }
+
+    pthread_cond_signal( &rx_cond );
+    pthread_mutex_unlock( &lock );
+  }
+
+  return NULL;
+}
+
+/**
+  * @brief Device to host: deliver the bytes after the latency.
+  */
+static void *sim_link_tx_thread( void *arg )
+{
+  (void)arg;
+
+  pthread_mutex_lock( &lock );
+
+  while( true )
+  {
+    if( tx.head == tx.tail )
+    {
+      pthread_cond_wait( &tx_cond, &lock );
+      continue;
+    }
+
+    uint64_t now  = sim_clock_us();
+    uint64_t when = tx.q[tx.head].time_us + sim_link.latency_us;
+
+    if( when > now )
+    {
+      uint64_t wait = when - now;
+
+      pthread_mutex_unlock( &lock );
+      usleep( ( wait < 1000u ) ? wait : 1000u );
+      pthread_mutex_lock( &lock );
+      continue;
+    }
+
+    if( write( uart_fd, &tx.q[tx.head].byte, 1 ) != 1 )
+    {
+      //host not connected: the byte is lost
+      sim_link_stats.dropped++;
+    }
+
+    tx.head = ( tx.head + 1u ) % SIM_LINK_QUEUE;
+    sim_link_stats.last_us = now;
+  }
+
+  return NULL;
+}
+
+/**
+  * @brief Put a byte on the line, with the faults of the profile.
+  * @param dir direction
+  * @param byte byte
+  * @param now simulated time
+  * @param byte_us time of one byte on the line (10 bits)
+  * @retval None
+  */
+static void sim_link_send( SIM_LINK_DIR_ *dir, uint8_t byte, uint64_t now, uint64_t byte_us )
+{
+  uint32_t copies = 1u;
+
+  if( dir->free_us < now )
+  {
+    dir->free_us = now;
+  }
+
+  if( sim_link_fault( dir, sim_link.stall_ppm ) )
+  {
+    dir->free_us += sim_link.stall_ms * 1000u;
+    sim_link_stats.stalls++;
+  }
+
+  if( sim_link_fault( dir, sim_link.drop_ppm ) )
+  {
+    dir->free_us += byte_us;
+    sim_link_stats.dropped++;
+    return;
+  }
+
+  if( sim_link_fault( dir, sim_link.flip_ppm ) )
+  {
+    byte ^= (uint8_t)( 1u << ( dir->rand % 8u ) );
+    sim_link_stats.flipped++;
+  }
+
+  if( sim_link_fault( dir, sim_link.dup_ppm ) )
+  {
+    copies = 2u;
+    sim_link_stats.duplicated++;
+  }
+
+  while( copies-- > 0u )
+  {
+    uint32_t next = ( dir->tail + 1u ) % SIM_LINK_QUEUE;
+
+    dir->free_us += byte_us;
+
+    if( next == dir->head )
+    {
+      //queue full: lost
+      sim_link_stats.dropped++;
+      continue;
+    }
+
+    dir->q[dir->tail].byte    = byte;
+    dir->q[dir->tail].time_us = dir->free_us;
+    dir->tail = next;
+  }
+}
+
+/**
+  * @brief Take the bytes arrived on the device up to now.
+  *        While the device is reading (buf not NULL), they go to buf until
+  *        it is full: the following ones arrive after the read.
+  *        Otherwise they go to the RX FIFO. The ones that don't fit are
+  *        lost (overrun).
+  * @param now simulated time
+  * @param buf reader's buffer, NULL if the device isn't reading
+  * @param count bytes in buf
+  * @param len size of buf
+  * @retval None
+  */
+static void sim_link_arrived( uint64_t now, uint8_t *buf, uint16_t *count, uint16_t len )
+{
+  uint32_t depth = ( sim_link.rx_fifo < SIM_LINK_FIFO_MAX ) ? sim_link.rx_fifo : SIM_LINK_FIFO_MAX;
+
+  while( ( rx.head != rx.tail ) && ( rx.q[rx.head].time_us <= now ) &&
+         ( ( buf == NULL ) || ( *count < len ) ) )
+  {
+    uint8_t  byte    = rx.q[rx.head].byte;
+    uint64_t time_us = rx.q[rx.head].time_us;
+
+    if( sim_link_stats.first_rx_us == 0u )
+    {
+      sim_link_stats.first_rx_us = time_us;
+    }
+    sim_link_stats.last_us = time_us;
+
+    rx.head = ( rx.head + 1u ) % SIM_LINK_QUEUE;
+
+    if( buf != NULL )
+    {
+      buf[(*count)++] = byte;
+      read_end_us     = time_us;
+    }
+    else if( fifo_len < depth )
+    {
+      fifo[fifo_len++] = byte;
+    }
+    else
+    {
+      sim_link_stats.overruns++;
+    }
+  }
+}
+
+/**
+  * @brief Virtual time: arrival of the next byte on the device.
+  * @param None
+  * @retval simulated time, UINT64_MAX if no byte is on the line
+  */
+static uint64_t sim_link_rx_next( void )
+{
+  return ( rx.head != rx.tail ) ? rx.q[rx.head].time_us : UINT64_MAX;
+}
+
+/**
+  * @brief Virtual time: delivery of the next byte to the host.
+  * @param None
+  * @retval simulated time, UINT64_MAX if no byte is on the line
+  */
+static uint64_t sim_link_tx_next( void )
+{
+  return ( tx.head != tx.tail ) ? tx.q[tx.head].time_us + sim_link.latency_us : UINT64_MAX;
+}
+
+/**
+  * @brief Draw a fault.
+  * @param dir direction (its generator)
+  * @param ppm probability, per million
+  * @retval true if the fault happens
+  */
+static bool sim_link_fault( SIM_LINK_DIR_ *dir, uint32_t ppm )
+{
+  if( ppm == 0u )
+  {
+    return false;
+  }
+
+  //xorshift32
+  dir->rand ^= dir->rand << 13;
+  dir->rand ^= dir->rand >> 17;
+  dir->rand ^= dir->rand << 5;
+
+  return ( dir->rand % 1000000u ) < ppm;
+}
@@ -0,0 +1,260 @@
+/*
+ * sim_vt.c
+ *
+ *  Virtual time: the host tool and the bootloader engine run as two tasks
+ *  (threads) on one simulated clock, one task at a time.
+ *
+ *  A task runs in zero simulated time until it waits: for a duration (flash
+ *  operation, HAL_Delay, byte on the line, host pacing) or for bytes from the
+ *  link. The scheduler then moves the clock straight to the next event (the
+ *  earliest timeout or byte arrival) and hands over to the task it concerns.
+ *  Ties go to the lowest task number, so a session is deterministic: the same
+ *  link profile and seed give the same run, whatever the host machine.
+ *
+ *  A session ends when both tasks have returned. A task left waiting with
+ *  nothing to come (the device after the host gave up) or still running at
+ *  the session limit is terminated.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim_hal.h"
+
+#define SIM_VT_NEVER    UINT64_MAX
+
+/*
+ * Task
+ */
+typedef struct
+{
+  pthread_t       thread;
+  pthread_cond_t  cond;
+  void            (*entry)( void );
+  bool            alive;
+  bool            waiting;
+  uint64_t        until_us;             // Timeout of the wait
+  uint64_t        (*next)( void );      // Arrival of what it waits for, if any
+}SIM_VT_TASK_;
+
+bool sim_vt = false;
+
+static SIM_VT_TASK_    task[SIM_VT_TASKS];
+static pthread_mutex_t vt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int             vt_current = -1;         // Task holding the CPU
+static uint64_t        vt_now_us;
+static uint64_t        vt_limit_us;             // End of the session
+static SIM_VT_END_     vt_end;
+static bool            vt_abort;                // Session over, tasks left waiting
+static __thread int    vt_self = -1;
+
+static void *sim_vt_thread( void *arg );
+static void sim_vt_schedule( void );
+
+/**
+  * @brief Run one session: both tasks from the current simulated time.
+  * @param device bootloader task
+  * @param host host tool task
+  * @param limit_us longest session, in simulated time
+  * @retval how the session ended
+  */
+SIM_VT_END_ sim_vt_run( void (*device)( void ), void (*host)( void ), uint64_t limit_us )
+{
+  void (*entry[SIM_VT_TASKS])( void ) = { device, host };
+
+  pthread_mutex_lock( &vt_lock );
+
+  vt_limit_us = vt_now_us + limit_us;
+  vt_end      = SIM_VT_END_DONE;
+  vt_abort    = false;
+  vt_current  = -1;
+
+  for( int i = 0; i < SIM_VT_TASKS; i++ )
+  {
+    pthread_cond_init( &task[i].cond, NULL );
+    task[i].entry    = entry[i];
+    task[i].alive    = true;
+    task[i].waiting  = true;             //waiting to start, now
+    task[i].until_us = vt_now_us;
+    task[i].next     = NULL;
+    pthread_create( &task[i].thread, NULL, sim_vt_thread, (void *)(intptr_t)i );
+  }
+
+  sim_vt_schedule();
+  pthread_mutex_unlock( &vt_lock );
+
+  for( int i = 0; i < SIM_VT_TASKS; i++ )
+  {
+    pthread_join( task[i].thread, NULL );
+    pthread_cond_destroy( &task[i].cond );
+  }
+
+  return vt_end;
+}
+
+/**
+  * @brief Wait, the clock moves on to the next event.
+  *        Returns at the timeout, or when what the task waits for may have
+  *        arrived (the caller checks).
+  * @param until_us timeout, simulated time (SIM_VT_NEVER: none)
+  * @param next arrival time of what the task waits for (NULL: only the timeout)
+  * @retval None, terminates the task if the session is over
+  */
+void sim_vt_wait( uint64_t until_us, uint64_t (*next)( void ) )
+{
+  SIM_VT_TASK_ *self = &task[vt_self];
+
+  pthread_mutex_lock( &vt_lock );
+
+  self->until_us = until_us;
+  self->next     = next;
+  self->waiting  = true;
+
+  sim_vt_schedule();
+
+  while( ( vt_current != vt_self ) && !vt_abort )
+  {
+    pthread_cond_wait( &self->cond, &vt_lock );
+  }
+
+  if( vt_current != vt_self )
+  {
+    //session over: this task won't run again
+    self->alive = false;
+    pthread_mutex_unlock( &vt_lock );
+    pthread_exit( NULL );
+  }
+
+  pthread_mutex_unlock( &vt_lock );
+}
+
+/**
+  * @brief Let a duration pass.
+  * @param us duration
+  * @retval None
+  */
+void sim_vt_sleep( uint64_t us )
+{
+  sim_vt_wait( sim_vt_now_us() + us, NULL );
+}
+
+/**
+  * @brief Simulated time.
+  * @param None
+  * @retval microseconds since the start of the simulation
+  */
+uint64_t sim_vt_now_us( void )
+{
+  return vt_now_us;
+}
+
+/**
+  * @brief Task thread: wait for the CPU, run, hand the CPU over.
+  */
+static void *sim_vt_thread( void *arg )
+{
+  vt_self = (int)(intptr_t)arg;
+
+  pthread_mutex_lock( &vt_lock );
+  while( ( vt_current != vt_self ) && !vt_abort )
+  {
+    pthread_cond_wait( &task[vt_self].cond, &vt_lock );
+  }
+  if( vt_current != vt_self )
+  {
+    task[vt_self].alive = false;
+    pthread_mutex_unlock( &vt_lock );
+    return NULL;
+  }
+  pthread_mutex_unlock( &vt_lock );
+
+  task[vt_self].entry();
+
+  pthread_mutex_lock( &vt_lock );
+  task[vt_self].alive   = false;
+  task[vt_self].waiting = false;
+  sim_vt_schedule();
+  pthread_mutex_unlock( &vt_lock );
+
+  return NULL;
+}
+
+/**
+  * @brief Give the CPU to the task with the earliest event, moving the
+  *        clock on to it. Called with vt_lock held by the task giving up
+  *        the CPU.
+  * @param None
+  * @retval None
+  */
+static void sim_vt_schedule( void )
+{
+  int      best    = -1;
+  uint64_t best_us = SIM_VT_NEVER;
+  bool     pending = false;
+
+  for( int i = 0; i < SIM_VT_TASKS; i++ )
+  {
+    uint64_t t;
+
+    if( !task[i].alive || !task[i].waiting )
+    {
+      continue;
+    }
+    pending = true;
+
+    t = task[i].until_us;
+
+    if( task[i].next != NULL )
+    {
+      uint64_t n = task[i].next();
+
+      t = ( n < t ) ? n : t;
+    }
+
+    if( t < best_us )
+    {
+      best    = i;
+      best_us = t;
+    }
+  }
+
+  if( !pending )
+  {
+    //both tasks have returned
+    vt_current = -1;
+    return;
+  }
+
+  if( ( best < 0 ) || ( best_us > vt_limit_us ) )
+  {
+    //nothing will ever happen, or not in time: terminate the waiting tasks
+    if( best < 0 )
+    {
+      vt_end = SIM_VT_END_IDLE;
+    }
+    else
+    {
+      vt_end    = SIM_VT_END_LIMIT;
+      vt_now_us = vt_limit_us;
+    }
+
+    vt_abort   = true;
+    vt_current = -1;
+
+    for( int i = 0; i < SIM_VT_TASKS; i++ )
+    {
+      pthread_cond_signal( &task[i].cond );
+    }
+    return;
+  }
+
+  if( best_us > vt_now_us )
+  {
+    vt_now_us = best_us;
+  }
+
+  task[best].waiting = false;
+  vt_current         = best;
+  pthread_cond_signal( &task[best].cond );
+}
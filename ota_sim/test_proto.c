@@ -0,0 +1,450 @@
+/*
+ * test_proto.c
+ *
+ *  Checks of the protocol codec (etx_ota_proto.h), run on the host:
+ *  every frame type encoded and decoded, the boundary lengths, COBS
+ *  round trips and corrupted frames.
+ *
+ *  make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "etx_ota_proto.h"
+
+static int checks;
+static int failures;
+
+#define CHECK( cond )                                                   \
+  do                                                                    \
+  {                                                                     \
+    checks++;                                                           \
+    if( !( cond ) )                                                     \
+    {                                                                   \
+      failures++;                                                       \
+      printf( "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond );       \
+    }                                                                   \
+  } while( 0 )
+
+/* A frame of every size, COBS encoded, and its decoding */
+static uint8_t frame_buf[ETX_OTA_PACKET_MAX_SIZE];
+static uint8_t wire_buf[ETX_OTA_WIRE_MAX_SIZE];
+static uint8_t data_buf[ETX_OTA_PACKET_MAX_SIZE];
+
+/**
+  * @brief Build a frame the way the bootloader and ota_update do.
+  * @retval size of the frame
+  */
+static uint32_t build_frame( uint8_t *buf, uint8_t type, const uint8_t *data, uint32_t len )
+{
+  uint32_t crc;
+
+  etx_ota_frame_head( buf, type, len );
+  memcpy( &buf[ETX_OTA_DATA_OFFSET], data, len );
+  crc = etx_ota_crc_end( etx_ota_crc( ETX_OTA_CRC_INIT, buf, ETX_OTA_DATA_OFFSET + len ) );
+  etx_ota_frame_tail( &buf[ETX_OTA_DATA_OFFSET + len], crc );
+
+  return len + ETX_OTA_DATA_OVERHEAD;
+}
+
+/**
+  * @brief COBS encode a frame in the three pieces of a transmission.
+  * @retval size on the wire, delimiter included
+  */
+static uint32_t cobs_encode( uint8_t *out, const uint8_t *frame, uint32_t len )
+{
+  ETX_OTA_COBS_ cobs;
+  uint32_t      head = ( len < ETX_OTA_DATA_OFFSET ) ? len : ETX_OTA_DATA_OFFSET;
+  uint32_t      tail = ( len - head < ETX_OTA_DATA_TRAILER ) ? len - head : ETX_OTA_DATA_TRAILER;
+
+  etx_ota_cobs_begin( &cobs, out );
+  etx_ota_cobs_put( &cobs, frame, head );
+  etx_ota_cobs_put( &cobs, &frame[head], len - head - tail );
+  etx_ota_cobs_put( &cobs, &frame[len - tail], tail );
+
+  return etx_ota_cobs_end( &cobs );
+}
+
+static void test_fields( void )
+{
+  uint8_t b[4];
+
+  etx_ota_put16( b, 0x1234u );
+  CHECK( ( b[0] == 0x34u ) && ( b[1] == 0x12u ) );
+  CHECK( etx_ota_get16( b ) == 0x1234u );
+  etx_ota_put16( b, 0xFFFFu );
+  CHECK( etx_ota_get16( b ) == 0xFFFFu );
+
+  etx_ota_put32( b, 0x12345678u );
+  CHECK( ( b[0] == 0x78u ) && ( b[1] == 0x56u ) && ( b[2] == 0x34u ) && ( b[3] == 0x12u ) );
+  CHECK( etx_ota_get32( b ) == 0x12345678u );
+  etx_ota_put32( b, 0xFFFFFFFFu );
+  CHECK( etx_ota_get32( b ) == 0xFFFFFFFFu );
+  etx_ota_put32( b, 0x80000001u );
+  CHECK( etx_ota_get32( b ) == 0x80000001u );
+}
+
+static void test_crc( void )
+{
+  const uint8_t check[] = "123456789";
+  uint32_t      crc;
+
+  //the check value of CRC-32 (zlib)
+  CHECK( etx_ota_crc_end( etx_ota_crc( ETX_OTA_CRC_INIT, check, 9u ) ) == 0xCBF43926u );
+  CHECK( etx_ota_crc_end( etx_ota_crc( ETX_OTA_CRC_INIT, check, 0u ) ) == 0x00000000u );
+
+  //in pieces
+  crc = etx_ota_crc( ETX_OTA_CRC_INIT, check, 4u );
+  crc = etx_ota_crc( crc, &check[4], 5u );
+  CHECK( etx_ota_crc_end( crc ) == 0xCBF43926u );
+}
+
+/**
+  * @brief COBS round trip of len bytes: no delimiter inside, the size
+  *        bound holds, the bytes come back.
+  */
+static void cobs_round_trip( const uint8_t *data, uint32_t len )
+{
+  uint32_t wire_len = cobs_encode( wire_buf, data, len );
+  bool     no_delim = true;
+
+  CHECK( wire_len <= ETX_OTA_COBS_SIZE( len ) + 1u );
+  CHECK( wire_buf[wire_len - 1u] == ETX_OTA_DELIM );
+  for( uint32_t i = 0u; i + 1u < wire_len; i++ )
+  {
+    no_delim = no_delim && ( wire_buf[i] != ETX_OTA_DELIM );
+  }
+  CHECK( no_delim );
+
+  CHECK( etx_ota_cobs_decode( wire_buf, wire_len - 1u ) == len );
+  CHECK( memcmp( wire_buf, data, len ) == 0 );
+}
+
+static void test_cobs( void )
+{
+  static const uint32_t runs[] = { 1u, 2u, 253u, 254u, 255u, 508u, 509u, 1000u };
+  uint8_t               bad[4];
+
+  //no zero: the block boundaries at 254 bytes
+  for( uint32_t r = 0u; r < sizeof(runs) / sizeof(runs[0]); r++ )
+  {
+    memset( data_buf, 0x55, runs[r] );
+    cobs_round_trip( data_buf, runs[r] );
+  }
+
+  //zeros only, zeros at the ends, a zero after a full block
+  memset( data_buf, 0x00, 300u );
+  cobs_round_trip( data_buf, 1u );
+  cobs_round_trip( data_buf, 300u );
+
+  memset( data_buf, 0xFF, 256u );
+  data_buf[0]   = 0x00u;
+  data_buf[254] = 0x00u;
+  data_buf[255] = 0x00u;
+  cobs_round_trip( data_buf, 256u );
+
+  //the largest frame, random bytes
+  srand( 1u );
+  for( uint32_t i = 0u; i < ETX_OTA_PACKET_MAX_SIZE; i++ )
+  {
+    data_buf[i] = ( i % 7u == 0u ) ? 0x00u : (uint8_t)rand();
+  }
+  cobs_round_trip( data_buf, ETX_OTA_PACKET_MAX_SIZE );
+
+  //the largest encoding fits the receive buffer
+  memset( data_buf, 0xA5, ETX_OTA_PACKET_MAX_SIZE );
+  CHECK( cobs_encode( wire_buf, data_buf, ETX_OTA_PACKET_MAX_SIZE ) <= ETX_OTA_WIRE_MAX_SIZE );
+
+  //invalid encodings: a delimiter as a code, a block past the end
+  bad[0] = 0x00u; bad[1] = 0x11u; bad[2] = 0x22u;
+  CHECK( etx_ota_cobs_decode( bad, 3u ) == 0u );
+  bad[0] = 0x05u; bad[1] = 0x11u; bad[2] = 0x22u;
+  CHECK( etx_ota_cobs_decode( bad, 3u ) == 0u );
+}
+
+static void test_frame( void )
+{
+  static const uint32_t sizes[] = { 0u, 1u, 4u, 243u, 244u, 1024u, ETX_OTA_PACKET_MAX_SIZE - ETX_OTA_DATA_OVERHEAD };
+  ETX_OTA_FRAME_        frame;
+  uint32_t              len;
+
+  for( uint32_t s = 0u; s < sizeof(sizes) / sizeof(sizes[0]); s++ )
+  {
+    for( uint32_t i = 0u; i < sizes[s]; i++ )
+    {
+      data_buf[i] = (uint8_t)( i * 31u );
+    }
+    len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data_buf, sizes[s] );
+
+    //over the wire and back
+    len = cobs_encode( wire_buf, frame_buf, len );
+    len = etx_ota_cobs_decode( wire_buf, len - 1u );
+    CHECK( len == sizes[s] + ETX_OTA_DATA_OVERHEAD );
+
+    CHECK( etx_ota_frame_len( wire_buf ) == sizes[s] );
+    CHECK( etx_ota_frame_decode( wire_buf, len, &frame ) == len );
+    CHECK( frame.type == ETX_OTA_PACKET_TYPE_DATA );
+    CHECK( frame.len == sizes[s] );
+    CHECK( frame.data == &wire_buf[ETX_OTA_DATA_OFFSET] );
+    CHECK( memcmp( frame.data, data_buf, sizes[s] ) == 0 );
+    CHECK( etx_ota_frame_crc_ok( wire_buf, &frame ) );
+
+    //one byte short: not a complete frame
+    CHECK( etx_ota_frame_decode( wire_buf, len - 1u, &frame ) == 0u );
+  }
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data_buf, 16u );
+
+  //corrupted CRC, corrupted data: decoded, the CRC check fails
+  frame_buf[ETX_OTA_DATA_OFFSET + 16u] ^= 0x01u;
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == len );
+  CHECK( !etx_ota_frame_crc_ok( frame_buf, &frame ) );
+  frame_buf[ETX_OTA_DATA_OFFSET + 16u] ^= 0x01u;
+  frame_buf[ETX_OTA_DATA_OFFSET + 3u]  ^= 0x80u;
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == len );
+  CHECK( !etx_ota_frame_crc_ok( frame_buf, &frame ) );
+  frame_buf[ETX_OTA_DATA_OFFSET + 3u]  ^= 0x80u;
+  CHECK( etx_ota_frame_crc_ok( frame_buf, &frame ) );
+
+  //bad SOF, bad EOF, a length past the bytes received, too short
+  frame_buf[0] = 0x55u;
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == 0u );
+  frame_buf[0] = ETX_OTA_SOF;
+  frame_buf[len - 1u] = 0x55u;
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == 0u );
+  frame_buf[len - 1u] = ETX_OTA_EOF;
+  etx_ota_put32( &frame_buf[2], 0xFFFFFFFFu );
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == 0u );
+  etx_ota_put32( &frame_buf[2], 16u );
+  CHECK( etx_ota_frame_decode( frame_buf, ETX_OTA_DATA_OVERHEAD - 1u, &frame ) == 0u );
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == len );
+}
+
+static void test_cmd( void )
+{
+  ETX_OTA_FRAME_ frame;
+  uint8_t        cmd = ETX_OTA_CMD_SYNC;
+  uint8_t        got = 0xFFu;
+  uint32_t       len;
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_CMD, &cmd, 1u );
+  CHECK( etx_ota_frame_decode( frame_buf, len, &frame ) == len );
+  CHECK( etx_ota_cmd_decode( &frame, &got ) && ( got == ETX_OTA_CMD_SYNC ) );
+
+  //not one byte, not a command
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_CMD, data_buf, 2u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_cmd_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_CMD, data_buf, 0u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_cmd_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, &cmd, 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_cmd_decode( &frame, &got ) );
+}
+
+static void test_data( void )
+{
+  static const uint8_t types[] = { ETX_OTA_PACKET_TYPE_DATA, ETX_OTA_PACKET_TYPE_DATA_COMPRESSED,
+                                   ETX_OTA_PACKET_TYPE_DATA_SKIP };
+  ETX_OTA_FRAME_       frame;
+  ETX_OTA_DATA_        dat  = { 0u, data_buf, 0u };
+  uint32_t             len;
+
+  for( uint32_t t = 0u; t < sizeof(types); t++ )
+  {
+    //the stream offset alone, then with the largest payload
+    etx_ota_put32( data_buf, 0x00012345u );
+    len = build_frame( frame_buf, types[t], data_buf, ETX_OTA_OFFSET_SIZE );
+    etx_ota_frame_decode( frame_buf, len, &frame );
+    CHECK( etx_ota_data_decode( &frame, &dat ) );
+    CHECK( ( dat.offset == 0x00012345u ) && ( dat.len == 0u ) );
+
+    memset( &data_buf[ETX_OTA_OFFSET_SIZE], 0x3C, ETX_OTA_DATA_MAX_SIZE );
+    len = build_frame( frame_buf, types[t], data_buf, ETX_OTA_OFFSET_SIZE + ETX_OTA_DATA_MAX_SIZE );
+    etx_ota_frame_decode( frame_buf, len, &frame );
+    CHECK( etx_ota_data_decode( &frame, &dat ) );
+    CHECK( dat.len == ETX_OTA_DATA_MAX_SIZE );
+    CHECK( dat.data == &frame.data[ETX_OTA_OFFSET_SIZE] );
+    CHECK( ( dat.data[0] == 0x3Cu ) && ( dat.data[ETX_OTA_DATA_MAX_SIZE - 1u] == 0x3Cu ) );
+
+    //no room for the offset
+    len = build_frame( frame_buf, types[t], data_buf, ETX_OTA_OFFSET_SIZE - 1u );
+    etx_ota_frame_decode( frame_buf, len, &frame );
+    CHECK( !etx_ota_data_decode( &frame, &dat ) );
+  }
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_HEADER, data_buf, 8u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_data_decode( &frame, &dat ) );
+}
+
+static void test_resp( void )
+{
+  ETX_OTA_FRAME_ frame;
+  ETX_OTA_RESP_  resp = { ETX_OTA_NACK, ETX_OTA_NACK_SEQUENCE, ETX_OTA_STATE_DATA, 3u, 0xCAFE0042u };
+  ETX_OTA_RESP_  got;
+  uint8_t        data[ETX_OTA_RESP_SIZE + 1u];
+  uint32_t       len;
+
+  etx_ota_resp_encode( data, &resp );
+
+  //a response and a credit frame carry the same payload
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_RESPONSE, data, ETX_OTA_RESP_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  memset( &got, 0, sizeof(got) );
+  CHECK( etx_ota_resp_decode( &frame, &got ) );
+  CHECK( ( got.status == resp.status ) && ( got.reason == resp.reason ) && ( got.state == resp.state ) &&
+         ( got.credits == resp.credits ) && ( got.next_offset == resp.next_offset ) );
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_CREDIT, data, ETX_OTA_RESP_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  memset( &got, 0, sizeof(got) );
+  CHECK( etx_ota_resp_decode( &frame, &got ) && ( got.next_offset == resp.next_offset ) );
+
+  //one byte short, one byte more, another type
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_RESPONSE, data, ETX_OTA_RESP_SIZE - 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_resp_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_RESPONSE, data, ETX_OTA_RESP_SIZE + 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_resp_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_RESP_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_resp_decode( &frame, &got ) );
+
+  CHECK( etx_ota_nack_retry( ETX_OTA_NACK_CRC ) && etx_ota_nack_retry( ETX_OTA_NACK_SEQUENCE ) &&
+         etx_ota_nack_retry( ETX_OTA_NACK_BUSY ) );
+  CHECK( !etx_ota_nack_retry( ETX_OTA_NACK_FLASH ) && !etx_ota_nack_retry( ETX_OTA_NACK_STATE ) &&
+         !etx_ota_nack_retry( ETX_OTA_NACK_IMAGE ) );
+}
+
+static void test_meta( void )
+{
+  ETX_OTA_FRAME_ frame;
+  meta_info      meta = { 0x00020000u, 0x89ABCDEFu, 0x01234567u, 0xFFFFFFFFu };
+  meta_info      got;
+  uint8_t        data[ETX_OTA_META_SIZE];
+  uint32_t       len;
+
+  etx_ota_meta_encode( data, &meta );
+  CHECK( etx_ota_get32( &data[4] ) == 0x89ABCDEFu );
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_HEADER, data, ETX_OTA_META_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( etx_ota_meta_decode( &frame, &got ) );
+  CHECK( memcmp( &got, &meta, sizeof(meta) ) == 0 );
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_HEADER, data, ETX_OTA_META_SIZE - 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_meta_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_META_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_meta_decode( &frame, &got ) );
+}
+
+static void test_info( void )
+{
+  ETX_OTA_FRAME_ frame;
+  ETX_OTA_INFO_  info;
+  ETX_OTA_INFO_  got;
+  uint8_t        data[ETX_OTA_INFO_SIZE];
+  uint32_t       len;
+
+  memset( &info, 0, sizeof(info) );
+  info.protocol      = ETX_OTA_PROTOCOL_VERSION;
+  info.bl_major      = 1u;
+  info.bl_minor      = 2u;
+  info.nb_rx_buffers = 2u;
+  info.max_payload   = ETX_OTA_DATA_MAX_SIZE;
+  info.program_width = 4u;
+  info.active_slot   = 1u;
+  info.reserved      = 0xBEEFu;
+  info.features      = ETX_OTA_FEATURE_WINDOW | ETX_OTA_FEATURE_FEC;
+  info.baud          = 115200u;
+  info.slot_addr[0]  = 0x08010000u;
+  info.slot_addr[1]  = 0x08080000u;
+  info.slot_size     = 0x00070000u;
+  info.active_crc    = 0xDEADBEEFu;
+  info.uid[0]        = 0x00390041u;
+  info.uid[1]        = 0x11223344u;
+  info.uid[2]        = 0x55667788u;
+
+  etx_ota_info_encode( data, &info );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_INFO_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  memset( &got, 0, sizeof(got) );
+  CHECK( etx_ota_info_decode( &frame, &got ) );
+  CHECK( memcmp( &got, &info, sizeof(info) ) == 0 );
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_INFO_SIZE - 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_info_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_RESPONSE, data, ETX_OTA_INFO_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_info_decode( &frame, &got ) );
+}
+
+static void test_stats( void )
+{
+  static ETX_TRACE_TABLE_ table;
+  static ETX_TRACE_TABLE_ got;
+  static uint8_t          data[ETX_OTA_STATS_SIZE];
+  ETX_OTA_FRAME_          frame;
+  uint32_t                len;
+
+  memset( &table, 0, sizeof(table) );
+  table.magic              = ETX_TRACE_MAGIC;
+  table.core_clock         = 16000000u;
+  table.count              = 300u;
+  table.boot               = 7u;
+  table.rx_pool.blocks     = 2u;
+  table.rx_pool.high_water = 2u;
+  table.rx_pool.empty      = 0x01020304u;
+  for( uint32_t i = 0u; i < ETX_TRACE_MAX_ENTRIES; i++ )
+  {
+    table.entry[i].stage  = (uint8_t)( i % ETX_TRACE_STAGE_COUNT );
+    table.entry[i].boot   = (uint16_t)( 0x8000u + i );
+    table.entry[i].cycles = 0xF0000000u + i;
+  }
+
+  //the layout of the wire, whatever the host
+  etx_ota_stats_encode( data, &table );
+  CHECK( ( data[0] == 0x54u ) && ( data[3] == 0x45u ) );     //"TRCE", little-endian
+  CHECK( etx_ota_get16( &data[16] ) == 2u );
+  CHECK( etx_ota_get32( &data[24u + ETX_OTA_STATS_ENTRY_SIZE * 124u + 4u] ) == 0xF0000000u + 124u );
+
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_STATS_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  memset( &got, 0, sizeof(got) );
+  CHECK( etx_ota_stats_decode( &frame, &got ) );
+  CHECK( memcmp( &got, &table, sizeof(table) ) == 0 );
+
+  //the GET_INFO reply isn't a table
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_INFO_SIZE );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_stats_decode( &frame, &got ) );
+  len = build_frame( frame_buf, ETX_OTA_PACKET_TYPE_DATA, data, ETX_OTA_STATS_SIZE - 1u );
+  etx_ota_frame_decode( frame_buf, len, &frame );
+  CHECK( !etx_ota_stats_decode( &frame, &got ) );
+}
+
+int main( void )
+{
+  test_fields();
+  test_crc();
+  test_cobs();
+  test_frame();
+  test_cmd();
+  test_data();
+  test_resp();
+  test_meta();
+  test_info();
+  test_stats();
+
+  printf( "test_proto: %d checks, %d failed\n", checks, failures );
+
+  return ( failures == 0 ) ? 0 : 1;
+}
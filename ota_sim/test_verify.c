@@ -0,0 +1,221 @@
+/*
+ * test_verify.c
+ *
+ *  Checks of the image validation (etx_image_verify.c), run on the host
+ *  against the HAL simulation: the CRC of the DMA-fed CRC unit against the
+ *  one of the host tools, the validation cache, a corrupted image, and a
+ *  DMA error, which must not give a CRC. And the boot-control record rebuilt
+ *  from the slots when its sector is blank (etx_boot_ctrl.c).
+ *
+ *  make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "etx_boot_ctrl.h"
+#include "etx_image_verify.h"
+#include "etx_crc.h"
+
+#define TEST_IMAGE_SIZE   ( 40u * 1024u + 4u )    //Over two DMA chunks of the CRC feed
+
+static int checks;
+static int failures;
+
+#define CHECK( cond )                                                   \
+  do                                                                    \
+  {                                                                     \
+    checks++;                                                           \
+    if( !( cond ) )                                                     \
+    {                                                                   \
+      failures++;                                                       \
+      printf( "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond );       \
+    }                                                                   \
+  } while( 0 )
+
+/**
+  * @brief Write an image into a slot the way etx_image leaves it.
+  * @retval its CRC (host tools)
+  */
+static uint32_t write_image( uint8_t slot, uint32_t size )
+{
+  uint8_t        *img  = (uint8_t *)(uintptr_t)etx_slot_info( slot )->addr;
+  ETX_IMAGE_HDR_ *hdr  = (ETX_IMAGE_HDR_ *)&img[ETX_IMAGE_HDR_OFFSET];
+  uint32_t        body = ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_);
+  uint32_t        x    = 0x2545F491;
+  uint32_t        crc;
+
+  for( uint32_t i = 0u; i < size; i += 4u )
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    memcpy( &img[i], &x, sizeof(x) );
+  }
+
+  memset( hdr, 0, sizeof(*hdr) );
+  hdr->magic       = ETX_IMAGE_MAGIC;
+  hdr->hdr_version = ETX_IMAGE_HDR_VERSION;
+  hdr->hdr_size    = sizeof(ETX_IMAGE_HDR_);
+  hdr->image_size  = size;
+  hdr->load_addr   = ETX_APP_LINK_ADDR;
+
+  crc = crc32_stm32( 0xFFFFFFFF, img, ETX_IMAGE_HDR_OFFSET );
+  crc = crc32_stm32( crc, &img[body], size - body );
+  hdr->crc32 = crc;
+
+  return crc;
+}
+
+/**
+  * @brief Forget the cached validations (the backup registers).
+  */
+static void clear_cache( void )
+{
+  memset( (void *)&RTC->BKP0R, 0, ETX_SLOT_COUNT * ETX_VERIFY_CACHE_WORDS * sizeof(uint32_t) );
+}
+
+/**
+  * @brief Write a bootable image of a version into a slot: a stack pointer in
+  *        SRAM and a reset handler in the image.
+  */
+static void write_bootable( uint8_t slot, uint8_t major )
+{
+  uint32_t       *vectors = (uint32_t *)(uintptr_t)etx_slot_info( slot )->addr;
+  ETX_IMAGE_HDR_ *hdr     = (ETX_IMAGE_HDR_ *)( (uint8_t *)vectors + ETX_IMAGE_HDR_OFFSET );
+
+  write_image( slot, TEST_IMAGE_SIZE );
+  vectors[0] = SRAM1_BASE + 0x10000u;
+  vectors[1] = ETX_APP_LINK_ADDR + ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_) + 1u;
+  hdr->version_major = major;
+}
+
+static void test_crc( void )
+{
+  uint32_t addr = etx_slot_info( ETX_SLOT_A )->addr;
+  uint32_t host = write_image( ETX_SLOT_A, TEST_IMAGE_SIZE );
+  uint32_t crc  = 0u;
+
+  CHECK( etx_image_crc( addr, TEST_IMAGE_SIZE, &crc ) == HAL_OK );
+  CHECK( crc == host );
+
+  //the header is out of the CRC
+  ( (ETX_IMAGE_HDR_ *)( addr + ETX_IMAGE_HDR_OFFSET ) )->flags ^= 1u;
+  CHECK( etx_image_crc( addr, TEST_IMAGE_SIZE, &crc ) == HAL_OK );
+  CHECK( crc == host );
+
+  //a body byte is in
+  *(uint8_t *)( addr + TEST_IMAGE_SIZE - 1u ) ^= 0x01u;
+  CHECK( etx_image_crc( addr, TEST_IMAGE_SIZE, &crc ) == HAL_OK );
+  CHECK( crc != host );
+}
+
+static void test_verify( void )
+{
+  bool cached = true;
+
+  clear_cache();
+  write_image( ETX_SLOT_B, TEST_IMAGE_SIZE );
+
+  CHECK( etx_image_verify( ETX_SLOT_B, &cached ) );
+  CHECK( !cached );
+  CHECK( etx_image_verify( ETX_SLOT_B, &cached ) );
+  CHECK( cached );
+  CHECK( etx_image_verify( ETX_SLOT_B, NULL ) );
+
+  //corrupted: not valid once the cache is gone
+  *(uint8_t *)( etx_slot_info( ETX_SLOT_B )->addr ) ^= 0x80u;
+  clear_cache();
+  CHECK( !etx_image_verify( ETX_SLOT_B, &cached ) );
+  CHECK( !cached );
+  CHECK( !etx_image_verify( ETX_SLOT_B, &cached ) );
+
+  //no header
+  memset( (void *)( etx_slot_info( ETX_SLOT_B )->addr + ETX_IMAGE_HDR_OFFSET ), 0xFF, sizeof(ETX_IMAGE_HDR_) );
+  CHECK( !etx_image_verify( ETX_SLOT_B, &cached ) );
+  CHECK( !etx_image_verify( ETX_SLOT_COUNT, &cached ) );
+}
+
+static void test_dma_error( void )
+{
+  uint32_t        addr = etx_slot_info( ETX_SLOT_A )->addr;
+  ETX_IMAGE_HDR_ *hdr  = (ETX_IMAGE_HDR_ *)( addr + ETX_IMAGE_HDR_OFFSET );
+  uint32_t        crc  = 0x12345678u;
+  bool            cached;
+
+  clear_cache();
+  write_image( ETX_SLOT_A, TEST_IMAGE_SIZE );
+
+  sim_dma_fail = true;
+
+  CHECK( etx_image_crc( addr, TEST_IMAGE_SIZE, &crc ) != HAL_OK );
+  CHECK( crc == 0x12345678u );
+  CHECK( !etx_image_verify( ETX_SLOT_A, &cached ) );
+
+  //an image whose CRC is what a failed CRC used to return
+  hdr->crc32 = ~ETX_IMAGE_UNSET;
+  CHECK( !etx_image_verify( ETX_SLOT_A, &cached ) );
+
+  //a failed check isn't cached
+  sim_dma_fail = false;
+  write_image( ETX_SLOT_A, TEST_IMAGE_SIZE );
+  CHECK( etx_image_verify( ETX_SLOT_A, &cached ) );
+  CHECK( !cached );
+}
+
+static void test_recover( void )
+{
+  ETX_BOOT_RECORD_ rec;
+
+  //a reset between the erase of the full sector and the new record: the
+  //newer image is trial-booted, the older one stays to roll back to
+  memset( (void *)ETX_BOOT_CTRL_ADDR, 0xFF, ETX_BOOT_CTRL_SIZE );
+  write_bootable( ETX_SLOT_A, 1u );
+  write_bootable( ETX_SLOT_B, 2u );
+  etx_boot_ctrl_load( &rec );
+  CHECK( rec.active_slot == ETX_SLOT_A );
+  CHECK( rec.pending_slot == ETX_SLOT_B );
+  CHECK( rec.trials_left == ETX_BOOT_TRIAL_MAX );
+  CHECK( etx_boot_ctrl_select_slot() == ETX_SLOT_B );
+  etx_boot_ctrl_load( &rec );
+  CHECK( rec.trials_left == ETX_BOOT_TRIAL_MAX - 1u );
+
+  memset( (void *)ETX_BOOT_CTRL_ADDR, 0xFF, ETX_BOOT_CTRL_SIZE );
+  write_bootable( ETX_SLOT_A, 3u );
+  etx_boot_ctrl_load( &rec );
+  CHECK( rec.active_slot == ETX_SLOT_B );
+  CHECK( rec.pending_slot == ETX_SLOT_A );
+
+  //same version: slot A, nothing pending
+  write_bootable( ETX_SLOT_B, 3u );
+  etx_boot_ctrl_load( &rec );
+  CHECK( rec.active_slot == ETX_SLOT_A );
+  CHECK( rec.pending_slot == ETX_SLOT_NONE );
+
+  //a single bootable slot is the active one
+  memset( (void *)( etx_slot_info( ETX_SLOT_A )->addr + ETX_IMAGE_HDR_OFFSET ), 0xFF, sizeof(ETX_IMAGE_HDR_) );
+  etx_boot_ctrl_load( &rec );
+  CHECK( rec.active_slot == ETX_SLOT_B );
+  CHECK( rec.pending_slot == ETX_SLOT_NONE );
+  CHECK( etx_boot_ctrl_select_slot() == ETX_SLOT_B );
+}
+
+int main( void )
+{
+  if( sim_hal_init() < 0 )
+  {
+    printf( "test_verify: can not map the STM32 memory\n" );
+    return 1;
+  }
+
+  test_crc();
+  test_verify();
+  test_dma_error();
+  test_recover();
+
+  printf( "test_verify: %d checks, %d failed\n", checks, failures );
+
+  return ( failures == 0 ) ? 0 : 1;
+}
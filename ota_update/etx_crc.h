@@ -0,0 +1,33 @@
+/*
+ * etx_crc.h
+ *
+ *  Image CRC of the host tools (etx_image, ota_update): the one of the
+ *  bootloader (see Common/Inc/etx_image.h).
+ */
+
+#ifndef INC_ETX_CRC_H_
+#define INC_ETX_CRC_H_
+
+#include <stdint.h>
+
+/* CRC32 as computed by the STM32 CRC unit (poly 0x04C11DB7, init 0xFFFFFFFF,
+   no reflection, no final xor), fed with 32-bit little-endian words */
+static inline uint32_t crc32_stm32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+  for (uint32_t i = 0; i + 4 <= len; i += 4)
+  {
+    uint32_t word = (uint32_t)data[i] | ((uint32_t)data[i + 1] << 8) |
+                    ((uint32_t)data[i + 2] << 16) | ((uint32_t)data[i + 3] << 24);
+
+    crc ^= word;
+
+    for (int bit = 0; bit < 32; bit++)
+    {
+      crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+#endif /* INC_ETX_CRC_H_ */
@@ -0,0 +1,127 @@
+/**************************************************
+
+file: etx_image.c
+purpose: -
+  -post-link tool for the application images.
+  -fills the image size and the CRC32 of the image header
+   (see Common/Inc/etx_image.h).
+  -pads the image to a multiple of 4 bytes (0xFF, erased flash).
+
+compile with the command:
+$ make etx_image
+
+use it on the binary produced by objcopy:
+$ ./etx_image Blink_Quick.bin
+
+**************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ota_update.h"
+#include "etx_image.h"
+#include "etx_crc.h"
+
+uint8_t APP_BIN[ETX_OTA_MAX_FW_SIZE];
+
+int main(int argc, char *argv[])
+{
+  FILE *Fptr = NULL;
+  int ex = 0;
+
+  do
+  {
+    if (argc < 2)
+    {
+      printf("Please feed the Application Image....!!!\n");
+      printf("Example: ./etx_image Blink_Quick.bin\n");
+      ex = -1;
+      break;
+    }
+
+    Fptr = fopen(argv[1], "r+b");
+
+    if (Fptr == NULL)
+    {
+      printf("Can not open %s\n", argv[1]);
+      ex = -1;
+      break;
+    }
+
+    fseek(Fptr, 0L, SEEK_END);
+    uint32_t app_size = ftell(Fptr);
+    fseek(Fptr, 0L, SEEK_SET);
+
+    // Room for the padding
+    if (((app_size + 3) & ~3u) > ETX_OTA_MAX_FW_SIZE)
+    {
+      printf("Image too big (%u bytes, slot is %u bytes)\n", app_size, ETX_OTA_MAX_FW_SIZE);
+      ex = -1;
+      break;
+    }
+
+    if (app_size < ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_))
+    {
+      printf("Image too small to hold a header (%u bytes)\n", app_size);
+      ex = -1;
+      break;
+    }
+
+    if (fread(APP_BIN, 1, app_size, Fptr) != app_size)
+    {
+      printf("App/FW read Error\n");
+      ex = -1;
+      break;
+    }
+
+    ETX_IMAGE_HDR_ *hdr = (ETX_IMAGE_HDR_ *) &APP_BIN[ETX_IMAGE_HDR_OFFSET];
+
+    if ((hdr->magic != ETX_IMAGE_MAGIC) || (hdr->hdr_version != ETX_IMAGE_HDR_VERSION) ||
+        (hdr->hdr_size != sizeof(ETX_IMAGE_HDR_)))
+    {
+      printf("No image header at offset 0x%X\n", ETX_IMAGE_HDR_OFFSET);
+      ex = -1;
+      break;
+    }
+
+    // Pad with erased flash value
+    while (app_size % 4)
+    {
+      APP_BIN[app_size++] = 0xFF;
+    }
+
+    hdr->image_size = app_size;
+
+    // The CRC covers everything but the header
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t body = ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_);
+
+    crc = crc32_stm32(crc, APP_BIN, ETX_IMAGE_HDR_OFFSET);
+    crc = crc32_stm32(crc, &APP_BIN[body], app_size - body);
+    hdr->crc32 = crc;
+
+    fseek(Fptr, 0L, SEEK_SET);
+
+    if (fwrite(APP_BIN, 1, app_size, Fptr) != app_size)
+    {
+      printf("App/FW write Error\n");
+      ex = -1;
+      break;
+    }
+
+    printf("%s: v%d.%d.%d size=%u load=0x%08X crc=0x%08X flags=0x%X\n", argv[1],
+           hdr->version_major, hdr->version_minor, hdr->version_patch,
+           hdr->image_size, hdr->load_addr, hdr->crc32, hdr->flags);
+
+  } while (false);
+
+  if (Fptr)
+  {
+    fclose(Fptr);
+  }
+
+  return (ex);
+}
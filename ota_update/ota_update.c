@@ -26,6 +26,8 @@ $ make
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <elf.h>
 
 //#define DEBUG         /* If you want to debug the code  */
 #define VERSION   "1.3.4"
@@ -37,11 +39,127 @@ $ make
 #endif
 
 #include "ota_update.h"
+#include "etx_image.h"
+#include "etx_trace.h"
+#include "etx_lz.h"
+#include "etx_delta.h"
+#include "etx_fec.h"
+#include "etx_crc.h"
 
 #define RS232_PORTNR 38
 
-uint8_t DATA_BUF[ETX_OTA_PACKET_MAX_SIZE];
+#define MAX_RTT 4096        /* ACK round-trip times kept for the percentiles */
+#define CHUNK_MIN ((int)(ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_)))  /* first packet holds the header */
+#define LZ_HASH_SIZE 4096   /* match finder: heads of the hash chains */
+#define LZ_MAX_CHAIN 256    /* match finder: candidates tried per position */
+#define DELTA_HASH_SIZE 65536 /* delta: heads of the hash chains of the base */
+#define DELTA_MAX_CHAIN 64  /* delta: candidates tried per position */
+#define DELTA_MIN_COPY 16   /* delta: shortest COPY, shorter equal runs go into a DIFF */
+#define DELTA_SIMILAR 8     /* delta: a DIFF goes on while 8 of the next 16 bytes are equal */
+#define SKIP_MIN 1024       /* shortest run of 0xFF skipped by default */
+#define RETRY_BUDGET 64     /* packets sent again before the update fails (--retries) */
+#define RESP_TIMEOUT_MS 10000   /* wait for a response (--timeout), longer than the slot erase */
+#define RESET_AFTER 3       /* failed tries of a packet before the link is reset */
+#define BACKOFF_MIN_US 2000     /* wait before the first retry, doubled at each one */
+#define BACKOFF_MAX_US 500000   /* longest wait before a retry */
+#define QUIET_US 200000     /* link reset: the line is quiet, nothing more on the way */
+#define NACK_NO_RESPONSE 0xFF   /* dev_resp.reason: no valid response, the device may have the packet */
+#define PACE_US 10          /* gap between two bytes sent to a device without credits */
+#define CREDIT_MARGIN_MS 200    /* wait for a credit: twice the last flash write, and this */
+#define ADAPT_CLEAN 4       /* adaptive transfer: ACKs in a row before a step up */
+#define ADAPT_SLOWER 90     /* a payload under 90% of the best goodput is a step too far */
+#define ADAPT_PROBE 16      /* ACKs since the last loss before the window grows and a lossy payload is tried again */
+#define ADAPT_GAP_MIN_US 1000   /* gap between two data packets after the first loss, 0 before */
+#define ADAPT_GAP_MAX_US 100000 /* longest gap between two data packets */
+#define WINDOW_MAX 8        /* data packets in flight at most, within the device credits */
+
+uint8_t DATA_BUF[ETX_OTA_WIRE_MAX_SIZE];      /* received packet, COBS decoded in place */
+uint8_t WIRE_BUF[ETX_OTA_WIRE_MAX_SIZE];      /* packet to send, COBS encoded */
+uint8_t FEC_BUF[ETX_OTA_OFFSET_SIZE + ETX_OTA_DATA_MAX_SIZE];   /* data packet cut in FEC blocks */
+uint8_t RX_BUF[256];                          /* bytes read from the port, not used yet */
+uint32_t rx_pos = 0, rx_len = 0;
 uint8_t APP_BIN[ETX_OTA_MAX_FW_SIZE];
+uint8_t LZ_BIN[ETX_OTA_MAX_FW_SIZE + ETX_OTA_MAX_FW_SIZE / 8 + 1];   /* worst case: all literals */
+uint8_t APP_USED[ETX_OTA_MAX_FW_SIZE];     /* bytes of the image given by the file (HEX, ELF) */
+uint8_t BASE_BIN[ETX_OTA_MAX_FW_SIZE];
+uint8_t DELTA_BIN[2 * ETX_OTA_MAX_FW_SIZE];
+
+uint32_t pace_us = PACE_US;                 /* gap between two bytes sent (--pace) */
+bool pace_set = false;                      /* --pace given: kept, whatever the device */
+uint16_t chunk_size = 0;                    /* data packet payload (--chunk), 0: the largest the device takes */
+int compress = -1;                          /* send the image compressed: 1 (--compress), 0 (--no-compress),
+                                               -1 if the device can and it gets smaller */
+bool get_info = true;                       /* ask the device what it supports first (not with --no-info) */
+ETX_OTA_INFO_ dev_info;                     /* what the device supports */
+uint32_t dev_features = ETX_OTA_FEATURE_COMPRESSION | ETX_OTA_FEATURE_DELTA | ETX_OTA_FEATURE_SKIP |
+                        ETX_OTA_FEATURE_WINDOW;
+                                            /* features used, all of them with --no-info */
+uint32_t sent_size = 0;                     /* size of what is sent: the image, compressed or not */
+uint32_t skip_min = SKIP_MIN;               /* shortest run of 0xFF skipped (--skip), 0: none */
+uint32_t nb_skipped = 0;                    /* image bytes skipped */
+ETX_OTA_RESP_ dev_resp = {.state = ETX_OTA_STATE_START, .credits = 1};
+                                            /* last response of the device: reason, state, next offset */
+uint8_t dev_resp_type = ETX_OTA_PACKET_TYPE_RESPONSE;
+                                            /* its frame: a response, or a credit after a flash write */
+uint32_t retry_budget = RETRY_BUDGET;       /* packets sent again before the update fails (--retries) */
+uint32_t resp_timeout_ms = RESP_TIMEOUT_MS; /* wait for a response (--timeout) */
+int fec = -1;                               /* FEC parity on the data packets: 1 (--fec on), 0 (--fec off),
+                                               -1 once the link corrupts too many of them */
+bool fec_on = false;                        /* the data packets are sent with FEC */
+
+/* Adaptive transfer: the payload of the data packets, the gap between two of
+   them and the packets in flight follow the link (goodput from the ACK
+   round-trip times, corrupted packets) and the device backpressure (busy,
+   lost responses; the credits of a device that gives them), like the TCP
+   congestion control */
+typedef struct
+{
+  bool on;              /* the payload adapts (no --chunk); the gap always does */
+  uint32_t max;         /* largest payload, the device one */
+  uint32_t ceil;        /* a payload this big was slower, or lost a packet: no step up to it */
+  uint32_t best;        /* payload of the best goodput */
+  uint32_t best_rate;   /* that goodput, bytes/s */
+  uint32_t rate;        /* goodput of the payload in use, smoothed */
+  uint32_t gap_us;      /* wait after an ACKed data packet */
+  uint32_t window;      /* data packets in flight at most */
+  uint32_t credits;     /* most credits the device gave: the largest window */
+  uint32_t clean;       /* ACKs in a row */
+  uint32_t since_loss;  /* ACKs since the last loss */
+  uint32_t acks;        /* data packets ACKed */
+  uint64_t start_us;
+  FILE *log;            /* decisions, CSV (--log) */
+} adapt_ctl;
+
+adapt_ctl adapt = {.on = true};
+const char *adapt_log_name = NULL;
+
+/* Data packets in flight: sent without waiting for the response of the ones
+   before, up to the credits of the device. Their responses come in order,
+   an ACK or a credit frame acknowledges them up to the device offset */
+typedef struct
+{
+  uint32_t offset;      /* stream offset */
+  uint32_t len;         /* stream bytes: the payload, or the length of a skipped run */
+  bool skip;            /* a skipped run */
+} flight_pkt;
+
+flight_pkt flight[WINDOW_MAX];
+uint32_t nb_flight = 0;
+uint32_t flight_max = 0;     /* most data packets in flight at once (Result: window=) */
+bool flight_hold = false;    /* after a failure: one packet at a time until one is ACKed in sequence */
+
+/* Transfer measures (the Result line, parsed by ota_sim/ota_bench) */
+uint32_t nb_packets = 0;
+uint32_t nb_nacks = 0;
+uint32_t nb_retx = 0;    /* packets sent again (corrupted, out of sequence, response lost) */
+uint32_t nb_timeouts = 0;    /* responses not received in time */
+uint32_t nb_resets = 0;  /* link resets */
+uint32_t nb_data = 0;    /* data packets sent */
+uint32_t nb_corrupted = 0;   /* data packets corrupted on the way (the device NACKed them, or no response) */
+uint64_t credit_wait_us = 0; /* time the device had no credit (writing a data packet) */
+uint32_t credit_last_ms = 0; /* last wait for a credit, 0 before the first one (the slot erase) */
+uint32_t nb_rtt = 0;
+uint32_t rtt_us[MAX_RTT];
 
 const char *comports[RS232_PORTNR] = {"/dev/ttyS0", "/dev/ttyS1", "/dev/ttyS2", "/dev/ttyS3", "/dev/ttyS4", "/dev/ttyS5",
                                       "/dev/ttyS6", "/dev/ttyS7", "/dev/ttyS8", "/dev/ttyS9", "/dev/ttyS10", "/dev/ttyS11",
@@ -71,91 +189,281 @@ void delay(uint32_t us)
 #endif
 }
 
-/* read the response */
-bool is_ack_resp_received(int comport)
+/* monotonic time in microseconds */
+uint64_t now_us(void)
 {
-#ifdef DEBUG
-  printf("***  debug 5.1");
-#endif
+  struct timespec ts;
 
-  bool is_ack = false;
-  uint8_t *pBuf=NULL;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  // Clear the memory
-  memset(DATA_BUF, 0, ETX_OTA_PACKET_MAX_SIZE);
+  return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
 
-  uint16_t len = 0;
-  uint16_t i = 0;
-  bool removeZero=true;
+/* send bytes, one by one with the pacing (in one write without it) */
+int write_bytes(int comport, const uint8_t *buf, uint32_t len)
+{
+  if (pace_us == 0)
+  {
+    return (write(comport, buf, len) == (ssize_t)len) ? 0 : -1;
+  }
 
-#ifdef DEBUG
-  printf("***  debug 5.2");
-#endif
+  for (uint32_t i = 0; i < len; i++)
+  {
+    delay(pace_us / 10);
 
-  /* Read the answer (ACK or NACK)  */
-  do
+    if (write(comport, &buf[i], 1) != 1)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* FEC on the data packets: with --fec on, or once the device takes it and
+   the link corrupted more packets than the parity costs (ETX_FEC_NPAR bytes
+   every ETX_FEC_DATA, 1 packet out of 31), 2 at least. It stays on. */
+bool fec_use(void)
+{
+  if ((fec < 0) && !fec_on && (dev_features & ETX_OTA_FEATURE_FEC) && (nb_corrupted >= 2) &&
+      (nb_corrupted * ETX_FEC_DATA > nb_data * ETX_FEC_NPAR))
   {
-    do
+    fec_on = true;
+    printf("FEC on: %u of %u data packets corrupted\n", nb_corrupted, nb_data);
+  }
+
+  return (fec == 1) || fec_on;
+}
+
+/* send a packet: the frame head, the stream offset of a data packet (offset
+   not NULL), the data where it is and the frame tail, COBS encoded. The
+   image data gets the FEC parity (fec_use) */
+int write_frame(int comport, uint8_t type, const uint32_t *offset, const uint8_t *data, uint32_t len)
+{
+  uint8_t head[ETX_OTA_DATA_OFFSET];
+  uint8_t pos[ETX_OTA_OFFSET_SIZE];
+  uint8_t tail[ETX_OTA_DATA_TRAILER];
+  uint8_t parity[ETX_FEC_NPAR];
+  ETX_OTA_COBS_ cobs;
+  uint32_t crc;
+
+  nb_packets++;
+
+  if (offset != NULL)
+  {
+    nb_data++;
+
+    if ((type != ETX_OTA_PACKET_TYPE_DATA_SKIP) && fec_use())
     {
-      len = read(comport, DATA_BUF + i, sizeof(ETX_OTA_RESP_));
-    } while (!len);
+      type |= ETX_OTA_PACKET_FEC;
+    }
+  }
 
-    i += len;
-  } 
-  while (DATA_BUF[i - 1] != 0xBB);
+  if (type & ETX_OTA_PACKET_FEC)
+  {
+    // the offset and the data, cut in blocks each followed by its parity
+    uint32_t fec_len = ETX_OTA_OFFSET_SIZE + len;
 
-#ifdef DEBUG
-  printf("***  debug 5.3");
-#endif
+    etx_ota_put32(FEC_BUF, *offset);
+    memcpy(&FEC_BUF[ETX_OTA_OFFSET_SIZE], data, len);
+
+    etx_ota_frame_head(head, type, ETX_FEC_SIZE(fec_len));
+    crc = etx_ota_crc(ETX_OTA_CRC_INIT, head, sizeof(head));
 
-  /* Remove zero in front of the received bytes */
-  pBuf=DATA_BUF;
+    etx_ota_cobs_begin(&cobs, WIRE_BUF);
+    etx_ota_cobs_put(&cobs, head, sizeof(head));
 
-  while (removeZero)
+    for (uint32_t i = 0, n; i < fec_len; i += n)
+    {
+      n = (fec_len - i < ETX_FEC_DATA) ? fec_len - i : ETX_FEC_DATA;
+
+      etx_fec_encode(&FEC_BUF[i], n, parity);
+      etx_ota_cobs_put(&cobs, &FEC_BUF[i], n);
+      etx_ota_cobs_put(&cobs, parity, sizeof(parity));
+      crc = etx_ota_crc(crc, &FEC_BUF[i], n);
+      crc = etx_ota_crc(crc, parity, sizeof(parity));
+    }
+  }
+  else
   {
-    if (pBuf[0]==0x00)
+    etx_ota_frame_head(head, type, (offset != NULL) ? len + ETX_OTA_OFFSET_SIZE : len);
+    crc = etx_ota_crc(ETX_OTA_CRC_INIT, head, sizeof(head));
+
+    etx_ota_cobs_begin(&cobs, WIRE_BUF);
+    etx_ota_cobs_put(&cobs, head, sizeof(head));
+    if (offset != NULL)
     {
-      pBuf++;
-      i--;
-    } 
-    else
+      etx_ota_put32(pos, *offset);
+      etx_ota_cobs_put(&cobs, pos, sizeof(pos));
+      crc = etx_ota_crc(crc, pos, sizeof(pos));
+    }
+    etx_ota_cobs_put(&cobs, data, len);
+    crc = etx_ota_crc(crc, data, len);
+  }
+
+  etx_ota_frame_tail(tail, etx_ota_crc_end(crc));
+  etx_ota_cobs_put(&cobs, tail, sizeof(tail));
+
+  return write_bytes(comport, WIRE_BUF, etx_ota_cobs_end(&cobs));
+}
+
+/* send a command packet (the reply is read by the caller) */
+int send_ota_cmd(int comport, uint8_t cmd)
+{
+  return write_frame(comport, ETX_OTA_PACKET_TYPE_CMD, NULL, &cmd, 1);
+}
+
+/* read one byte, from what the last read gave if any: the bytes after a
+   delimiter are the next packet. -2: nothing came before the deadline */
+int read_byte(int comport, uint8_t *byte, uint64_t deadline_us)
+{
+  while (rx_pos == rx_len)
+  {
+    int len = read(comport, RX_BUF, sizeof(RX_BUF));
+
+    if (len < 0)
+    {
+      printf("Read Error (%s)\n", strerror(errno));
+      return -1;
+    }
+
+    if ((len == 0) && (now_us() >= deadline_us))
+    {
+      return -2;
+    }
+
+    rx_pos = 0;
+    rx_len = len;
+  }
+
+  *byte = RX_BUF[rx_pos++];
+  return 0;
+}
+
+/* read one full packet: the bytes up to the next delimiter, COBS decoded in
+   place. A corrupted packet is an error, the next one starts in step. -2: no
+   packet in time (lost, or its delimiter was) */
+int receive_ota_packet(int comport, uint8_t *buf, uint32_t max_len)
+{
+  ETX_OTA_FRAME_ frame;
+  uint64_t deadline = now_us() + (uint64_t)resp_timeout_ms * 1000u;
+  uint32_t i = 0;
+  uint32_t len;
+  bool overflow = false;
+
+  while (true)
+  {
+    int ex = read_byte(comport, &buf[i], deadline);
+
+    if (ex == -2)
+    {
+      nb_timeouts++;
+      printf("No response in %u ms\n", resp_timeout_ms);
+      return -2;
+    }
+
+    if (ex < 0)
+    {
+      return -1;
+    }
+
+    if (buf[i] != ETX_OTA_DELIM)
+    {
+      if (i < max_len - 1)
+      {
+        i++;
+      }
+      else
+      {
+        overflow = true;
+      }
+    }
+    else if ((i > 0) || overflow)
     {
-      removeZero=false;
+      break;
     }
+    // else: zeros between the packets are empty frames
+  }
+
+  len = overflow ? 0 : etx_ota_cobs_decode(buf, i);
+
+  if ((len == 0) || (etx_ota_frame_decode(buf, len, &frame) != len) || !etx_ota_frame_crc_ok(buf, &frame))
+  {
+    printf("Corrupted packet (%u bytes)\n", i);
+    return -1;
   }
 
+  return len;
+}
+
+/* read the response */
+bool is_ack_resp_received(int comport)
+{
+#ifdef DEBUG
+  printf("***  debug 5.1");
+#endif
+
+  const char *reasons[] = {"", "corrupted", "out of sequence", "flash error", "busy", "bad state", "image refused"};
+  bool is_ack = false;
+  ETX_OTA_FRAME_ frame;
+  int len;
+  uint64_t start = now_us();     /* the packet has just been sent */
+
 #ifdef DEBUG
-  printf("***  debug 5.4");
+  printf("***  debug 5.2");
 #endif
 
+  /* Read the answer (ACK or NACK), the zeros in front of it are skipped */
+  len = receive_ota_packet(comport, DATA_BUF, sizeof(DATA_BUF));
+
 #ifdef DEBUG
   printf("\n");
 
-  for (int j=0; j<i; j++)
+  for (int j=0; j<len; j++)
   {
-    printf("%02X.", pBuf[j]);
+    printf("%02X.", DATA_BUF[j]);
   }
   printf("\n");
 #endif
   
   /* Check the answer, ACK or NACK  */
-  if (len > 0)
+  dev_resp.status = ETX_OTA_NACK;
+  dev_resp.reason = NACK_NO_RESPONSE;
+  dev_resp_type   = ETX_OTA_PACKET_TYPE_RESPONSE;
+
+  if ((len > 0) && (etx_ota_frame_decode(DATA_BUF, len, &frame) > 0) &&
+      etx_ota_resp_decode(&frame, &dev_resp))
   {
-    ETX_OTA_RESP_ *resp = (ETX_OTA_RESP_ *) pBuf;
-    if (resp->packet_type == ETX_OTA_PACKET_TYPE_RESPONSE)
+    is_ack = (dev_resp.status == ETX_OTA_ACK);
+    dev_resp_type = frame.type;
+    adapt.credits = (dev_resp.credits > adapt.credits) ? dev_resp.credits : adapt.credits;
+
+    if (frame.type == ETX_OTA_PACKET_TYPE_CREDIT)
     {
-      // TODO: Add CRC check
-      if (resp->status == ETX_OTA_ACK)
-      {
-        // ACK received
-        is_ack = true;
-        printf("<<< ACK received...\n");
-      }
-      else
-      {
-        // NACK received
-        printf("<<< NACK received...\n");
-      }
+      // the last data packet is written (or not): its buffer is free again.
+      // It came while this packet was sent: the wait for a credit, once a
+      // response is lost, is not much longer (wait_credit)
+      printf("<<< %u credit(s), %s...\n", dev_resp.credits, is_ack ? "written" : "write failed");
+      credit_last_ms = (uint32_t)((now_us() - start) / 1000u);
+    }
+    else if (is_ack)
+    {
+      // ACK received
+      printf("<<< ACK received...\n");
+    }
+    else
+    {
+      // NACK received
+      printf("<<< NACK received (%s, device at %u)...\n",
+             (dev_resp.reason < sizeof(reasons) / sizeof(reasons[0])) ? reasons[dev_resp.reason] : "?",
+             dev_resp.next_offset);
+    }
+
+    nb_nacks += !is_ack;
+
+    if ((frame.type == ETX_OTA_PACKET_TYPE_RESPONSE) && (nb_rtt < MAX_RTT))
+    {
+      rtt_us[nb_rtt++] = now_us() - start;
     }
   }
 
@@ -166,258 +474,1606 @@ bool is_ack_resp_received(int comport)
   return is_ack;
 }
 
-/* Build the OTA START command */
-int send_ota_start(int comport)
+/* a decision of the adaptive transfer: on the output, and in the --log file */
+void adapt_log(const char *event, uint32_t offset)
 {
-  int ex = 0;
-  ////printf("[send_ota_start(): send 1\n");
+  printf("Adapt: %s at %u, payload %u, gap %u us, window %u (goodput %u B/s)\n", event, offset,
+         chunk_size, adapt.gap_us, adapt.window, adapt.rate);
+
+  if ((adapt.log == NULL) && (adapt_log_name != NULL))
+  {
+    adapt.log = fopen(adapt_log_name, "w");
+    adapt_log_name = NULL;
+
+    if (adapt.log == NULL)
+    {
+      printf("Can not open the log file\n");
+      return;
+    }
+    fprintf(adapt.log, "time_ms,offset,event,payload,gap_us,window,rate\n");
+  }
 
-  uint16_t len;
-  ETX_OTA_COMMAND_ *ota_start = (ETX_OTA_COMMAND_ *) DATA_BUF;
+  if (adapt.log != NULL)
+  {
+    fprintf(adapt.log, "%u,%u,%s,%u,%u,%u,%u\n", (uint32_t)((now_us() - adapt.start_us) / 1000u), offset,
+            event, chunk_size, adapt.gap_us, adapt.window, adapt.rate);
+  }
+}
 
+/* adaptive transfer of the data packets, from the negotiated payload and,
+   with a device that gives credits, as many packets in flight as it takes */
+void adapt_start(uint64_t start_us)
+{
+  adapt.max = chunk_size;
+  adapt.ceil = chunk_size + 4;
+  adapt.best = chunk_size;
+  adapt.best_rate = 0;
+  adapt.rate = 0;
+  adapt.gap_us = 0;
+  adapt.window = (dev_features & ETX_OTA_FEATURE_WINDOW) ? WINDOW_MAX : 1;
+  adapt.credits = 1;
+  adapt.clean = 0;
+  adapt.since_loss = 0;
+  adapt.acks = 0;
+  adapt.start_us = start_us;
+
+  adapt_log(adapt.on ? "start" : "fixed", 0);
+}
 
-  ////printf("[send_ota_start(): send 2\n");
+/* a data packet (at offset) ACKed: its goodput, over the time since the previous ACK
+   (the gap, the retries included). After ADAPT_CLEAN of them the gap is
+   halved and the payload goes one step up, half of it, if the goodput still
+   grows; back to the best one if it dropped. After ADAPT_PROBE ACKs since
+   the last loss the window takes one more packet, up to the device credits,
+   and a payload that lost a packet can be tried again */
+void adapt_ack(uint32_t offset, uint32_t len, uint64_t cycle_us)
+{
+  uint32_t sample = (cycle_us > 0) ? (uint32_t)((uint64_t)len * 1000000u / cycle_us) : 0;
+  uint32_t next;
 
-  memset(DATA_BUF, 0, ETX_OTA_PACKET_MAX_SIZE);
+  adapt.window = (adapt.window < adapt.credits) ? adapt.window : adapt.credits;
 
-  ota_start->sof = ETX_OTA_SOF;
-  ota_start->packet_type = ETX_OTA_PACKET_TYPE_CMD;
-  ota_start->data_len = 1;
-  ota_start->cmd = ETX_OTA_CMD_START;
-  ota_start->crc = 0x11223344; // TODO: Add CRC
-  ota_start->eof = ETX_OTA_EOF;
+  if (++adapt.since_loss % ADAPT_PROBE == 0)
+  {
+    if ((adapt.window < adapt.credits) && (adapt.window < WINDOW_MAX))
+    {
+      adapt.window++;
+      adapt_log("window up", offset);
+    }
+    adapt.ceil = (adapt.ceil > adapt.max) ? adapt.ceil : adapt.max + 4;
+  }
 
-  len = sizeof(ETX_OTA_COMMAND_);
+  // the slot erase is in the first two cycles (in the ACK of the first
+  // packet, or in the credit after it); the last packet, one cut by a
+  // skipped run or sent before a step is not of the payload in use
+  if ((++adapt.acks <= 2) || (len != chunk_size))
+  {
+    return;
+  }
 
+  adapt.rate = (adapt.clean == 0) ? sample : (adapt.rate * 3 + sample) / 4;
 
-  // send OTA START
- 
-  for (int i = 0; i < len; i++)
+  if (++adapt.clean < ADAPT_CLEAN)
+  {
+    return;
+  }
+  adapt.clean = 0;
+
+  if (adapt.gap_us > 0)
+  {
+    adapt.gap_us = (adapt.gap_us / 2 >= ADAPT_GAP_MIN_US) ? adapt.gap_us / 2 : 0;
+    adapt_log("gap down", offset);
+  }
+
+  if (!adapt.on)
+  {
+    return;
+  }
+
+  if (chunk_size == adapt.best)
+  {
+    adapt.best_rate = adapt.rate;
+  }
+  else if ((uint64_t)adapt.rate * 100 < (uint64_t)adapt.best_rate * ADAPT_SLOWER)
+  {
+    adapt.ceil = chunk_size;
+    chunk_size = adapt.best;
+    adapt_log("slower", offset);
+    return;
+  }
+  else if (adapt.rate > adapt.best_rate)
+  {
+    adapt.best = chunk_size;
+    adapt.best_rate = adapt.rate;
+  }
+
+  next = (chunk_size + chunk_size / 2) & ~3u;
+  next = (next < adapt.max) ? next : adapt.max;
+
+  if ((next > chunk_size) && (next < adapt.ceil))
   {
-    delay(1);
+    chunk_size = next;
+    adapt_log("up", offset);
+  }
+}
+
+/* a data packet not taken: corrupted (CRC), lost (no response: the device
+   may also have missed its start) or refused for now (busy). The payload
+   is halved on a corrupted or lost packet and stays under the one that lost
+   it (ADAPT_PROBE), the window too: the packets in flight after it are sent
+   again. The gap doubles on a lost or busy one */
+void adapt_loss(uint32_t offset, uint8_t reason)
+{
+  uint32_t chunk_min = (CHUNK_MIN + 3) & ~3u;
+
+  adapt.clean = 0;
+  adapt.since_loss = 0;
+
+  // a device with credits says when it takes the next packet: no gap
+  if (((reason == NACK_NO_RESPONSE) || (reason == ETX_OTA_NACK_BUSY)) && !(dev_features & ETX_OTA_FEATURE_WINDOW))
+  {
+    adapt.gap_us = (adapt.gap_us == 0) ? ADAPT_GAP_MIN_US : adapt.gap_us * 2;
+    adapt.gap_us = (adapt.gap_us < ADAPT_GAP_MAX_US) ? adapt.gap_us : ADAPT_GAP_MAX_US;
+  }
+
+  if (reason != ETX_OTA_NACK_BUSY)
+  {
+    uint32_t window = (adapt.window < adapt.credits) ? adapt.window : adapt.credits;
+
+    adapt.window = (window > 1) ? window / 2 : 1;
+  }
+
+  if (adapt.on && (reason != ETX_OTA_NACK_BUSY) && (chunk_size > chunk_min))
+  {
+    // the link changed: the goodput is measured again, under this payload
+    adapt.ceil = chunk_size;
+    chunk_size = ((chunk_size / 2) & ~3u) > chunk_min ? (chunk_size / 2) & ~3u : chunk_min;
+    adapt.best = chunk_size;
+    adapt.best_rate = 0;
+  }
+
+  adapt_log((reason == ETX_OTA_NACK_BUSY) ? "busy" : (reason == NACK_NO_RESPONSE) ? "lost" : "corrupted", offset);
+}
+
+/* one more retry, if the budget allows it: counted, after a wait doubled at
+   each failure of the packet (the device may be busy, the line noisy) */
+bool retry(uint32_t fails)
+{
+  uint32_t backoff_us = BACKOFF_MIN_US;
+
+  if (nb_retx >= retry_budget)
+  {
+    printf("Retry budget spent (%u)\n", retry_budget);
+    return false;
+  }
+
+  while ((--fails > 0) && (backoff_us < BACKOFF_MAX_US))
+  {
+    backoff_us *= 2;
+  }
+  backoff_us = (backoff_us < BACKOFF_MAX_US) ? backoff_us : BACKOFF_MAX_US;
+
+  nb_retx++;
+  delay(backoff_us / 10);
+  return true;
+}
+
+/* reset the link after repeated failures: drop what is on the way, end the
+   frame the device may be in the middle of (a lost delimiter) and ask it
+   where it is (dev_resp: state, next offset). -1: it doesn't answer */
+int link_reset(int comport)
+{
+  uint8_t delim = ETX_OTA_DELIM;
+
+  nb_resets++;
+  printf(">>> resetting the link...\n");
 
-    if (write(comport, &DATA_BUF[i], 1)==0)
+  for (uint32_t fails = 1; ; fails++)
+  {
+    // the device answers garbage ended by the delimiter: the answer is dropped
+    if (write_bytes(comport, &delim, 1) < 0)
     {
-      // some data missed.
-      printf("OTA START : Send Err\n");
-      ex = -1;
-      break;
+      return -1;
     }
 
-    //xxx int res=write(comport, &DATA_BUF[i], 1);
-    //xx printf("%02X (%d).", DATA_BUF[i], res);
+    for (uint64_t quiet = now_us(); now_us() - quiet < QUIET_US; )
+    {
+      if (read(comport, RX_BUF, sizeof(RX_BUF)) > 0)
+      {
+        quiet = now_us();
+      }
+    }
+    tcflush(comport, TCIOFLUSH);
+    rx_pos = 0;
+    rx_len = 0;
 
-    /* //xx//
-    if (RS232_SendByte(comport, DATA_BUF[i]))
+    if (send_ota_cmd(comport, ETX_OTA_CMD_SYNC) < 0)
     {
-      // some data missed.
-      printf("OTA START : Send Err\n");
-      ex = -1;
-      break;
+      return -1;
+    }
+
+    if (is_ack_resp_received(comport))
+    {
+      printf("Device state %u, at %u\n", dev_resp.state, dev_resp.next_offset);
+      return 0;
+    }
+
+    if ((fails == RESET_AFTER) || !retry(fails))
+    {
+      return -1;
     }
-    */
   }
+}
 
-  //printf("\n");
+/* wait for a credit of the device before a packet: with none left (its
+   buffers hold the packets it took), it takes nothing until one is written
+   (credit frame). Bytes sent meanwhile would be lost. 0: a credit, 1: the write failed (dev_resp),
+   -1: the device doesn't answer */
+int wait_credit(int comport)
+{
+  uint64_t start = now_us();
+  uint32_t timeout_ms = resp_timeout_ms;
+  uint32_t fails;
+  int ex = 0;
 
-  if (ex >= 0)
+  // the credit comes after a flash write: not much longer than the last one.
+  // If not, the frame is lost, or the device missed the packet of a lost response
+  if ((credit_last_ms > 0) && (2 * credit_last_ms + CREDIT_MARGIN_MS < resp_timeout_ms))
   {
-    if (!is_ack_resp_received(comport))
+    timeout_ms = 2 * credit_last_ms + CREDIT_MARGIN_MS;
+  }
+
+  for (fails = 1; (dev_features & ETX_OTA_FEATURE_WINDOW) && (dev_resp.credits == 0); fails++)
+  {
+    uint32_t resp_ms = resp_timeout_ms;
+    bool ack;
+
+    resp_timeout_ms = timeout_ms;
+    ack = is_ack_resp_received(comport);
+    resp_timeout_ms = resp_ms;
+
+    if (ack)
+    {
+      continue;
+    }
+
+    if (dev_resp.reason != NACK_NO_RESPONSE)
+    {
+      // a NACK of the device to something else gives its credits too
+      ex = etx_ota_nack_retry(dev_resp.reason) ? 0 : 1;
+
+      if (ex != 0)
+      {
+        break;
+      }
+      continue;
+    }
+
+    // the credit frame is lost: the device says where it is
+    if (!retry(fails) || (link_reset(comport) < 0))
     {
-      // Received NACK
-      printf("OTA START : NACK\n");
       ex = -1;
+      break;
     }
   }
 
-  //printf("OTA START [ex = %d]\n", ex);
+  if ((fails == 2) && (ex == 0))
+  {
+    credit_last_ms = (uint32_t)((now_us() - start) / 1000u);
+  }
+  credit_wait_us += now_us() - start;
   return ex;
 }
 
-/* Build and Send the OTA END command */
-uint16_t send_ota_end(int comport)
+/* send a packet and read the response. A packet the device got corrupted or
+   couldn't take is sent again, after a backoff; a data packet also when the
+   response is lost (the device doesn't write it twice). After RESET_AFTER
+   failures, or a lost response of a command, the link is reset and the device
+   says if it took the packet: its offset moved, or its state. Nothing is
+   sent without a credit of the device (wait_credit).
+   -1: send error, 1: NACK (dev_resp), 2: the payload went down (adapt_loss),
+   the data packet is to be cut again */
+int send_packet(int comport, uint8_t type, const uint32_t *offset, const uint8_t *data, uint32_t len)
 {
-  uint16_t len;
-  ETX_OTA_COMMAND_ *ota_end = (ETX_OTA_COMMAND_ *) DATA_BUF;
-  int ex = 0;
+  uint8_t state;                      /* of the device, before the packet */
+  int ex = wait_credit(comport);
+
+  if (ex != 0)
+  {
+    return ex;
+  }
+  state = dev_resp.state;
+
+  for (uint32_t fails = 1; ; fails++)
+  {
+    bool ack;
+
+    if ((fails > 1) && ((ex = wait_credit(comport)) != 0))
+    {
+      return ex;
+    }
+
+    if ((fails > 1) && (offset != NULL) && (type != ETX_OTA_PACKET_TYPE_DATA_SKIP))
+    {
+      // taken: its ACK was lost, the credit frame came once it was written
+      if (dev_resp.next_offset > *offset)
+      {
+        return 0;
+      }
+
+      if (len > chunk_size)
+      {
+        return 2;
+      }
+    }
+
+    if (write_frame(comport, type, offset, data, len) < 0)
+    {
+      return -1;
+    }
+
+    // the credit of an earlier data packet, written while this one came, or
+    // a late ACK of one: the response of this one follows
+    do
+    {
+      ack = is_ack_resp_received(comport);
+    } while ((dev_resp_type == ETX_OTA_PACKET_TYPE_CREDIT) ||
+             (ack && (offset != NULL) && (dev_resp.next_offset <= *offset)));
+
+    if (ack)
+    {
+      return 0;
+    }
+
+    // the device may have the data packet and be writing it: a credit frame
+    // says so, sent again before it would be lost
+    if ((offset != NULL) && (dev_resp.reason == NACK_NO_RESPONSE))
+    {
+      dev_resp.credits = 0;
+    }
+
+    // a packet out of sequence is the caller's: it sends from the device offset
+    bool again = (dev_resp.reason == ETX_OTA_NACK_CRC) || (dev_resp.reason == ETX_OTA_NACK_BUSY) ||
+                 (dev_resp.reason == NACK_NO_RESPONSE);
+
+    if ((offset != NULL) && ((dev_resp.reason == ETX_OTA_NACK_CRC) || (dev_resp.reason == NACK_NO_RESPONSE)))
+    {
+      nb_corrupted++;
+    }
+
+    if ((offset != NULL) && again && (type != ETX_OTA_PACKET_TYPE_DATA_SKIP))
+    {
+      adapt_loss(*offset, dev_resp.reason);
+    }
+
+    if (!again || !retry(fails))
+    {
+      return 1;
+    }
+
+    // a command is not sent blindly again: the device may have taken it
+    if ((fails % RESET_AFTER == 0) || ((dev_resp.reason == NACK_NO_RESPONSE) && (offset == NULL)))
+    {
+      if (link_reset(comport) < 0)
+      {
+        dev_resp.reason = NACK_NO_RESPONSE;
+        return 1;
+      }
+
+      if ((offset == NULL) ? (dev_resp.state != state) : (dev_resp.next_offset != *offset))
+      {
+        // taken, or the caller sends from the device offset
+        return 0;
+      }
+    }
+
+    printf(">>> sending again...\n");
+  }
+}
+
+/* a data packet can go in flight: the device gives credits, the window and
+   its credits left (after the packets it hasn't answered yet) allow it */
+bool flight_open(void)
+{
+  return (dev_features & ETX_OTA_FEATURE_WINDOW) && !flight_hold && (nb_flight < adapt.window) &&
+         (dev_resp.credits > nb_flight);
+}
+
+/* send a data packet in flight: its response is read later (flight_collect).
+   stream_len: the bytes of the stream it carries. -1: send error */
+int flight_send(int comport, uint8_t type, uint32_t offset, const uint8_t *data, uint32_t len, uint32_t stream_len)
+{
+  if (write_frame(comport, type, &offset, data, len) < 0)
+  {
+    return -1;
+  }
+
+  flight[nb_flight].offset = offset;
+  flight[nb_flight].len = stream_len;
+  flight[nb_flight].skip = (type == ETX_OTA_PACKET_TYPE_DATA_SKIP);
+  nb_flight++;
+  flight_max = (nb_flight > flight_max) ? nb_flight : flight_max;
+
+  return 0;
+}
+
+/* read the next response to the data packets in flight. An ACK or a credit
+   frame acknowledges them up to the device offset: they leave the flight
+   (adapt_ack for the first one, its goodput since the previous ACK).
+   A packet corrupted, lost or refused for now: the responses of the ones
+   after it are read (out of sequence), or the link is reset if one doesn't
+   come, and the flight is dropped. 0: read, 1: the data is sent again from
+   the device offset (dev_resp), -1: the device can't go on (dev_resp) */
+int flight_collect(int comport, uint64_t *ack_us)
+{
+  bool ack = is_ack_resp_received(comport);
+  uint32_t left;
+  uint8_t reason;
+
+  if (ack)
+  {
+    uint64_t t = now_us();
+
+    for (bool first = true; (nb_flight > 0) && (flight[0].offset + flight[0].len <= dev_resp.next_offset);
+         first = false)
+    {
+      if (flight[0].skip)
+      {
+        nb_skipped += flight[0].len;
+      }
+      else if (first)
+      {
+        adapt_ack(flight[0].offset, flight[0].len, t - *ack_us);
+      }
+      *ack_us = t;
+
+      nb_flight--;
+      memmove(&flight[0], &flight[1], nb_flight * sizeof(flight[0]));
+    }
+    return 0;
+  }
+
+  reason = dev_resp.reason;
+
+  if ((reason != NACK_NO_RESPONSE) && !etx_ota_nack_retry(reason))
+  {
+    nb_flight = 0;
+    return -1;
+  }
+
+  // a packet out of sequence: the one before it never came in
+  if (reason != ETX_OTA_NACK_BUSY)
+  {
+    nb_corrupted++;
+  }
+  if (!flight[0].skip)
+  {
+    adapt_loss(flight[0].offset, (reason == ETX_OTA_NACK_SEQUENCE) ? NACK_NO_RESPONSE : reason);
+  }
+
+  left = (reason == NACK_NO_RESPONSE) ? 0 : nb_flight - 1;
+  nb_flight = 0;
+
+  while (left > 0)
+  {
+    if (!is_ack_resp_received(comport) && (dev_resp.reason == NACK_NO_RESPONSE))
+    {
+      break;
+    }
+    left -= (dev_resp_type == ETX_OTA_PACKET_TYPE_RESPONSE);
+  }
+
+  if ((reason == NACK_NO_RESPONSE) || (left > 0))
+  {
+    if (link_reset(comport) < 0)
+    {
+      dev_resp.reason = NACK_NO_RESPONSE;
+      return -1;
+    }
+  }
+
+  flight_hold = true;
+  return 1;
+}
+
+/* Build the OTA START command */
+int send_ota_start(int comport)
+{
+  uint8_t cmd = ETX_OTA_CMD_START;
+  int ex = 0;
+  ////printf("[send_ota_start(): send 1\n");
+
+  // send OTA START
+  ex = send_packet(comport, ETX_OTA_PACKET_TYPE_CMD, NULL, &cmd, 1);
+
+  if (ex < 0)
+  {
+    // some data missed.
+    printf("OTA START : Send Err\n");
+  }
+  else if (ex > 0)
+  {
+    // Received NACK
+    printf("OTA START : NACK\n");
+    ex = -1;
+  }
+
+  //printf("OTA START [ex = %d]\n", ex);
+  return ex;
+}
+
+/* Build and Send the OTA END command */
+int send_ota_end(int comport)
+{
+  uint8_t cmd = ETX_OTA_CMD_END;
+  int ex = 0;
+
+  // send OTA END
+  ex = send_packet(comport, ETX_OTA_PACKET_TYPE_CMD, NULL, &cmd, 1);
+
+  if (ex < 0)
+  {
+    // some data missed.
+    printf("OTA END : Send Err\n");
+  }
+  else if (ex > 0)
+  {
+    // Received NACK
+    printf("OTA END : NACK\n");
+    ex = -1;
+  }
+
+  printf("OTA END [ex = %d]\n", ex);
+  return ex;
+}
+
+/* Build and Send the OTA ROLLBACK command */
+int send_ota_rollback(int comport)
+{
+  uint8_t cmd = ETX_OTA_CMD_ROLLBACK;
+  int ex = 0;
+
+  // send OTA ROLLBACK
+  ex = send_packet(comport, ETX_OTA_PACKET_TYPE_CMD, NULL, &cmd, 1);
+
+  if (ex < 0)
+  {
+    // some data missed.
+    printf("OTA ROLLBACK : Send Err\n");
+  }
+  else if (ex > 0)
+  {
+    // Received NACK
+    printf("OTA ROLLBACK : NACK\n");
+    ex = -1;
+  }
+
+  printf("OTA ROLLBACK [ex = %d]\n", ex);
+  return ex;
+}
+
+/* print the stage timing table as one histogram per stage */
+void print_stats(const ETX_TRACE_TABLE_ *table)
+{
+  const char *stage_name[ETX_TRACE_STAGE_COUNT] = {"HAL_Init", "Clock config", "Button window",
+                                                   "Packet receive", "Image CRC", "Erase", "Program",
+                                                   "ACK send", "Reset to jump"};
+  uint32_t nb = (table->count < ETX_TRACE_MAX_ENTRIES) ? table->count : ETX_TRACE_MAX_ENTRIES;
+  double us_per_cycle = 1e6 / (double)table->core_clock;
+
+  printf("\n%u measures (%u recorded, boot #%u), core clock %u Hz\n", nb, table->count,
+         table->boot, table->core_clock);
+  printf("Receive buffers: %u, at most %u in use, %u packets dropped with none free\n", table->rx_pool.blocks,
+         table->rx_pool.high_water, table->rx_pool.empty);
+
+  for (int stage = 0; stage < ETX_TRACE_STAGE_COUNT; stage++)
+  {
+    uint32_t bucket[32] = {0};
+    uint32_t n = 0;
+    double min = 0, max = 0, sum = 0;
+
+    for (uint32_t i = 0; i < nb; i++)
+    {
+      const ETX_TRACE_ENTRY_ *entry = &table->entry[i];
+      double us = entry->cycles * us_per_cycle;
+      int b = 0;
+
+      if (entry->stage != stage)
+      {
+        continue;
+      }
+
+      // Power of 2 buckets, in microseconds
+      while ((b < 31) && (us >= (double)(2u << b)))
+      {
+        b++;
+      }
+      bucket[b]++;
+
+      min = (n == 0 || us < min) ? us : min;
+      max = (n == 0 || us > max) ? us : max;
+      sum += us;
+      n++;
+    }
+
+    if (n == 0)
+    {
+      continue;
+    }
+
+    printf("\n%-15s n=%-4u min=%.1fus avg=%.1fus max=%.1fus\n", stage_name[stage], n, min, sum / n, max);
+
+    for (int b = 0; b < 32; b++)
+    {
+      if (bucket[b] == 0)
+      {
+        continue;
+      }
+
+      printf("  < %10uus %5u ", 2u << b, bucket[b]);
+
+      for (uint32_t j = 0; j < (bucket[b] * 40 + n - 1) / n; j++)
+      {
+        printf("#");
+      }
+      printf("\n");
+    }
+  }
+}
+
+/* Build and Send the OTA GET STATS command, print the received table */
+int send_ota_get_stats(int comport)
+{
+  int ex = 0;
+
+  // send OTA GET STATS
+  if (send_ota_cmd(comport, ETX_OTA_CMD_GET_STATS) < 0)
+  {
+    // some data missed.
+    printf("OTA GET STATS : Send Err\n");
+    ex = -1;
+  }
+
+  if (ex >= 0)
+  {
+    // The table comes first, in a data packet
+    ETX_TRACE_TABLE_ table;
+    ETX_OTA_FRAME_ frame;
+    int len = receive_ota_packet(comport, DATA_BUF, sizeof(DATA_BUF));
+
+    if ((len < 0) || (etx_ota_frame_decode(DATA_BUF, len, &frame) == 0) ||
+        !etx_ota_stats_decode(&frame, &table))
+    {
+      printf("OTA GET STATS : bad table\n");
+      ex = -1;
+    }
+    else
+    {
+      if (table.magic == ETX_TRACE_MAGIC)
+      {
+        print_stats(&table);
+      }
+      else
+      {
+        printf("OTA GET STATS : no table\n");
+      }
+    }
+  }
+
+  if (ex >= 0)
+  {
+    if (!is_ack_resp_received(comport))
+    {
+      // Received NACK
+      printf("OTA GET STATS : NACK\n");
+      ex = -1;
+    }
+  }
+  printf("OTA GET STATS [ex = %d]\n", ex);
+  return ex;
+}
+
+/* print the device info */
+void print_info(const ETX_OTA_INFO_ *info)
+{
+  const struct { uint32_t bit; const char *name; } feature[] = {
+    {ETX_OTA_FEATURE_COMPRESSION, "compression"}, {ETX_OTA_FEATURE_DELTA, "delta"},
+    {ETX_OTA_FEATURE_SKIP, "skip"}, {ETX_OTA_FEATURE_ROLLBACK, "rollback"}, {ETX_OTA_FEATURE_STATS, "stats"},
+    {ETX_OTA_FEATURE_PACKET_CRC, "packet-crc"}, {ETX_OTA_FEATURE_WINDOW, "window"},
+    {ETX_OTA_FEATURE_FEC, "fec"}};
+
+  printf("Device %08X-%08X-%08X: protocol v%u, bootloader v%u.%u\n", info->uid[0], info->uid[1],
+         info->uid[2], info->protocol, info->bl_major, info->bl_minor);
+  printf("  payload %u bytes, %u RX buffer(s), %u baud, %u-byte flash programming\n", info->max_payload,
+         info->nb_rx_buffers, info->baud, info->program_width);
+  printf("  slots 0x%08X and 0x%08X of %u KB, running slot %c (crc=0x%08X)\n", info->slot_addr[0],
+         info->slot_addr[1], info->slot_size / 1024, 'A' + info->active_slot, info->active_crc);
+  printf("  features:");
+
+  for (uint32_t i = 0; i < sizeof(feature) / sizeof(feature[0]); i++)
+  {
+    if (info->features & feature[i].bit)
+    {
+      printf(" %s", feature[i].name);
+    }
+  }
+  printf("\n");
+}
+
+/* Build and Send the OTA GET INFO command, read the device info. It changes
+   nothing on the device: asked again while the replies get lost */
+int send_ota_get_info(int comport, ETX_OTA_INFO_ *info)
+{
+  int ex = 0;
+
+  for (uint32_t fails = 1; ; fails++)
+  {
+    ex = 0;
+    dev_resp.reason = NACK_NO_RESPONSE;
+
+    // send OTA GET INFO
+    if (send_ota_cmd(comport, ETX_OTA_CMD_GET_INFO) < 0)
+    {
+      // some data missed.
+      printf("OTA GET INFO : Send Err\n");
+      return -1;
+    }
+
+    // The info comes first, in a data packet
+    ETX_OTA_FRAME_ frame;
+    int len = receive_ota_packet(comport, DATA_BUF, sizeof(DATA_BUF));
+
+    if ((len < 0) || (etx_ota_frame_decode(DATA_BUF, len, &frame) == 0) || !etx_ota_info_decode(&frame, info))
+    {
+      printf("OTA GET INFO : bad info (bootloader without GET INFO? use --no-info)\n");
+      ex = -1;
+    }
+    else if (!is_ack_resp_received(comport))
+    {
+      // Received NACK
+      printf("OTA GET INFO : NACK\n");
+      ex = -1;
+    }
+
+    if ((ex == 0) || (dev_resp.reason != NACK_NO_RESPONSE) || !retry(fails) || (link_reset(comport) < 0))
+    {
+      break;
+    }
+    printf(">>> sending again...\n");
+  }
+  return ex;
+}
+
+/* Pick the transfer settings from the device info: the largest payload
+   both sides take, the features the device has */
+int negotiate(const ETX_OTA_INFO_ *info)
+{
+  uint32_t max_payload = (info->max_payload < ETX_OTA_DATA_MAX_SIZE) ? info->max_payload : ETX_OTA_DATA_MAX_SIZE;
+
+  if (info->protocol != ETX_OTA_PROTOCOL_VERSION)
+  {
+    printf("Device protocol v%u, not v%u\n", info->protocol, ETX_OTA_PROTOCOL_VERSION);
+    return -1;
+  }
+
+  if (chunk_size == 0)
+  {
+    chunk_size = max_payload & ~3u;
+  }
+  else if (chunk_size > info->max_payload)
+  {
+    printf("Chunk size %d bigger than the device payload (%u bytes)\n", chunk_size, info->max_payload);
+    return -1;
+  }
+
+  if ((compress == 1) && !(info->features & ETX_OTA_FEATURE_COMPRESSION))
+  {
+    printf("The device doesn't take compressed images\n");
+    return -1;
+  }
+
+  if ((fec == 1) && !(info->features & ETX_OTA_FEATURE_FEC))
+  {
+    printf("The device doesn't take FEC\n");
+    return -1;
+  }
+
+  dev_features = info->features;
+
+  // a device with credits takes a packet only when it can: sent at once
+  if (!pace_set && (dev_features & ETX_OTA_FEATURE_WINDOW))
+  {
+    pace_us = 0;
+  }
+
+  if (!(dev_features & ETX_OTA_FEATURE_SKIP))
+  {
+    skip_min = 0;
+  }
+
+  return 0;
+}
+
+/* Build and send the OTA Header */
+int send_ota_header(int comport, const meta_info *ota_info)
+{
+  uint8_t meta[ETX_OTA_META_SIZE];
+  int ex = 0;
+
+  etx_ota_meta_encode(meta, ota_info);
+
+  // send OTA Header
+  ex = send_packet(comport, ETX_OTA_PACKET_TYPE_HEADER, NULL, meta, sizeof(meta));
+
+  if (ex < 0)
+  {
+    // some data missed.
+    printf("OTA HEADER : Send Err\n");
+  }
+  else if (ex > 0)
+  {
+    // Received NACK
+    printf("OTA HEADER : NACK\n");
+    ex = -1;
+  }
+  // printf("OTA HEADER [ex = %d]\n", ex);
+  return ex;
+}
+
+/* Build and send the OTA Data: 0 ACK, -1 NACK (dev_resp), -2 send error,
+   1 to be sent again in smaller packets */
+int send_ota_data(int comport, uint8_t type, uint32_t offset, const uint8_t *data, uint16_t data_len)
+{
+  // send OTA Data, from where it is
+  int ex = send_packet(comport, type, &offset, data, data_len);
+
+  if (ex == 2)
+  {
+    ex = 1;
+  }
+  else if (ex < 0)
+  {
+    // some data missed.
+    printf("OTA DATA : Send Err\n");
+    ex = -2;
+  }
+  else if (ex > 0)
+  {
+    // Received NACK
+    printf("OTA DATA : NACK\n");
+    ex = -1;
+  }
+
+  // printf("OTA DATA [ex = %d]\n", ex);
+  return ex;
+}
+
+/* insert a position into the hash chains of the match finder */
+void lz_insert(const uint8_t *in, uint32_t in_len, uint32_t pos, int32_t *head, int32_t *prev)
+{
+  if (pos + ETX_LZ_MIN_MATCH <= in_len)
+  {
+    uint32_t h = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2]) % LZ_HASH_SIZE;
+
+    prev[pos % ETX_LZ_WINDOW_SIZE] = head[h];
+    head[h] = pos;
+  }
+}
+
+/* compress an image into the stream the bootloader decodes (etx_lz.h), returns its size */
+uint32_t lz_compress(const uint8_t *in, uint32_t in_len, uint8_t *out)
+{
+  static int32_t head[LZ_HASH_SIZE];
+  static int32_t prev[ETX_LZ_WINDOW_SIZE];
+  uint32_t o = 0;
+  uint32_t flags_pos = 0;
+  uint32_t nb_items = 8;
+  uint32_t i = 0;
+
+  for (int h = 0; h < LZ_HASH_SIZE; h++)
+  {
+    head[h] = -1;
+  }
+
+  while (i < in_len)
+  {
+    uint32_t best_len = 0;
+    uint32_t best_dist = 0;
+
+    if (nb_items == 8)
+    {
+      // new group: its flag byte comes first
+      flags_pos = o;
+      out[o++] = 0;
+      nb_items = 0;
+    }
+
+    // longest match in the window (greedy, hash chains of 3-byte prefixes)
+    if (i + ETX_LZ_MIN_MATCH <= in_len)
+    {
+      uint32_t h = ((in[i] << 8) ^ (in[i + 1] << 4) ^ in[i + 2]) % LZ_HASH_SIZE;
+      uint32_t max = (in_len - i < ETX_LZ_MAX_MATCH) ? in_len - i : ETX_LZ_MAX_MATCH;
+      int32_t p = head[h];
+
+      for (int chain = 0; (p >= 0) && (i - p <= ETX_LZ_WINDOW_SIZE) && (chain < LZ_MAX_CHAIN); chain++)
+      {
+        uint32_t len = 0;
+
+        while ((len < max) && (in[p + len] == in[i + len]))
+        {
+          len++;
+        }
+
+        if (len > best_len)
+        {
+          best_len = len;
+          best_dist = i - p;
+
+          if (len == max)
+          {
+            break;
+          }
+        }
+
+        p = prev[p % ETX_LZ_WINDOW_SIZE];
+      }
+    }
+
+    if (best_len >= ETX_LZ_MIN_MATCH)
+    {
+      uint32_t code = (best_len - ETX_LZ_MIN_MATCH < ETX_LZ_LEN_EXT) ? best_len - ETX_LZ_MIN_MATCH : ETX_LZ_LEN_EXT;
+
+      out[flags_pos] |= 1 << nb_items;
+      out[o++] = (code << 4) | ((best_dist - 1) >> 8);
+      out[o++] = (best_dist - 1) & 0xFF;
+
+      if (code == ETX_LZ_LEN_EXT)
+      {
+        out[o++] = best_len - ETX_LZ_LEN_EXT - ETX_LZ_MIN_MATCH;
+      }
+
+      for (uint32_t n = 0; n < best_len; n++)
+      {
+        lz_insert(in, in_len, i++, head, prev);
+      }
+    }
+    else
+    {
+      out[o++] = in[i];
+      lz_insert(in, in_len, i++, head, prev);
+    }
+
+    nb_items++;
+  }
+
+  return o;
+}
+
+/* append delta records (split at 64KB), returns the new size of the delta */
+uint32_t delta_record(uint8_t *out, uint32_t o, uint8_t op, uint32_t len, uint32_t src,
+                      const uint8_t *img, const uint8_t *base)
+{
+  while (len > 0)
+  {
+    uint16_t n = (len > UINT16_MAX) ? UINT16_MAX : len;
+
+    out[o] = op;
+    etx_ota_put16(&out[o + 1], n);
+    etx_ota_put32(&out[o + 3], src);
+    o += ETX_DELTA_HDR_SIZE;
+
+    for (uint32_t k = 0; (op != ETX_DELTA_OP_COPY) && (k < n); k++)
+    {
+      out[o++] = (op == ETX_DELTA_OP_DIFF) ? (uint8_t)(img[k] - base[src + k]) : img[k];
+    }
+
+    len -= n;
+    src += n;
+    img += n;
+  }
+
+  return o;
+}
+
+/* number of equal bytes from img[i] and base[q] */
+uint32_t delta_equal(const uint8_t *img, uint32_t len, uint32_t i, const uint8_t *base, uint32_t base_len, uint32_t q)
+{
+  uint32_t n = 0;
+
+  while ((i + n < len) && (q + n < base_len) && (img[i + n] == base[q + n]))
+  {
+    n++;
+  }
+
+  return n;
+}
+
+/* build the delta that rebuilds img from base (etx_delta.h), returns its size
+   (bsdiff-like: exact matches of the base, followed through the small
+   differences of moved code as DIFF records, the rest as DATA) */
+uint32_t delta_build(const uint8_t *base, uint32_t base_len, const uint8_t *img, uint32_t len, uint8_t *out)
+{
+  static int32_t head[DELTA_HASH_SIZE];
+  static int32_t next[ETX_OTA_MAX_FW_SIZE];
+  uint32_t o = 0;
+  uint32_t i = 0;
+  uint32_t lit = 0;     /* first byte of the pending DATA */
+
+  for (int h = 0; h < DELTA_HASH_SIZE; h++)
+  {
+    head[h] = -1;
+  }
+
+  for (uint32_t p = 0; p + 4 <= base_len; p++)
+  {
+    uint32_t h;
+
+    memcpy(&h, &base[p], sizeof(h));
+    h = (h * 2654435761u) >> 16;
+    next[p] = head[h];
+    head[h] = p;
+  }
+
+  while (i < len)
+  {
+    uint32_t best_len = 0;
+    uint32_t best_p = 0;
+
+    if (i + 4 <= len)
+    {
+      uint32_t h;
+
+      memcpy(&h, &img[i], sizeof(h));
+      h = (h * 2654435761u) >> 16;
+
+      int32_t p = head[h];
+
+      for (int chain = 0; (p >= 0) && (chain < DELTA_MAX_CHAIN); chain++)
+      {
+        uint32_t l = delta_equal(img, len, i, base, base_len, p);
+
+        if (l > best_len)
+        {
+          best_len = l;
+          best_p = p;
+        }
+        p = next[p];
+      }
+    }
+
+    if (best_len < DELTA_MIN_COPY)
+    {
+      i++;
+      continue;
+    }
+
+    if (i > lit)
+    {
+      o = delta_record(out, o, ETX_DELTA_OP_DATA, i - lit, 0, &img[lit], base);
+    }
+
+    // follow this alignment of the base
+    uint32_t j = i;
+    uint32_t q = best_p;
+
+    while ((j < len) && (q < base_len))
+    {
+      uint32_t e = delta_equal(img, len, j, base, base_len, q);
+
+      if (e >= DELTA_MIN_COPY)
+      {
+        o = delta_record(out, o, ETX_DELTA_OP_COPY, e, q, &img[j], base);
+        j += e;
+        q += e;
+        continue;
+      }
+
+      // differences: up to the next long equal run, while the alignment holds
+      uint32_t k = j;
+      uint32_t end = (len - j < base_len - q) ? len : j + base_len - q;
+
+      while (k < end)
+      {
+        uint32_t same = 0;
+
+        e = delta_equal(img, len, k, base, base_len, q + k - j);
+        if (e >= DELTA_MIN_COPY)
+        {
+          break;
+        }
+
+        for (uint32_t n = 0; (n < 16) && (k + n < end); n++)
+        {
+          same += (img[k + n] == base[q + k - j + n]);
+        }
+
+        if (same < DELTA_SIMILAR)
+        {
+          break;
+        }
+
+        k += e + 1;
+      }
+
+      if (k > end)
+      {
+        k = end;
+      }
+
+      if (k == j)
+      {
+        break;
+      }
+
+      o = delta_record(out, o, ETX_DELTA_OP_DIFF, k - j, q, &img[j], base);
+      q += k - j;
+      j = k;
+    }
+
+    i = j;
+    lit = j;
+  }
+
+  if (len > lit)
+  {
+    o = delta_record(out, o, ETX_DELTA_OP_DATA, len - lit, 0, &img[lit], base);
+  }
+
+  return o;
+}
+
+/* check the header of an image (filled by etx_image) */
+bool image_is_valid(const uint8_t *bin, uint32_t size)
+{
+  const ETX_IMAGE_HDR_ *hdr = (const ETX_IMAGE_HDR_ *) &bin[ETX_IMAGE_HDR_OFFSET];
+
+  return (size >= ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_)) &&
+         (hdr->magic == ETX_IMAGE_MAGIC) && (hdr->hdr_version == ETX_IMAGE_HDR_VERSION) &&
+         (hdr->image_size == size) && (hdr->crc32 != ETX_IMAGE_UNSET);
+}
+
+/* offset into the image of a range of addresses (the applications are
+   linked for slot A), -1 if the range is out of the slot */
+int32_t image_offset(uint32_t addr, uint32_t len)
+{
+  if ((addr < ETX_SLOT_A_ADDR) || (addr - ETX_SLOT_A_ADDR > ETX_OTA_MAX_FW_SIZE) ||
+      (len > ETX_OTA_MAX_FW_SIZE - (addr - ETX_SLOT_A_ADDR)))
+  {
+    printf("0x%08X-0x%08X is out of the slot\n", addr, addr + len);
+    return -1;
+  }
+
+  return addr - ETX_SLOT_A_ADDR;
+}
+
+/* raw binary: the whole file at the base of the slot */
+int read_bin(FILE *file, uint8_t *bin, uint8_t *used)
+{
+  long size;
+
+  fseek(file, 0L, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0L, SEEK_SET);
+
+  if ((size < 0) || (size > ETX_OTA_MAX_FW_SIZE))
+  {
+    printf("Image too big for a slot (%d bytes max)\n", ETX_OTA_MAX_FW_SIZE);
+    return -1;
+  }
+
+  if (fread(bin, 1, size, file) != (size_t)size)
+  {
+    printf("App/FW read Error\n");
+    return -1;
+  }
+
+  memset(used, 1, size);
+
+  return size;
+}
+
+/* Intel HEX: data records (00), extended segment (02) and linear (04) addresses */
+int read_hex(FILE *file, uint8_t *bin, uint8_t *used)
+{
+  char line[600];
+  uint8_t rec[256 + 5];
+  uint32_t upper = 0;
+  uint32_t size = 0;
+  int nb_line = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    uint32_t len = strcspn(line, "\r\n");
+    uint32_t nb = (len - 1) / 2;
+    uint8_t sum = 0;
+
+    nb_line++;
+
+    if (len == 0)
+    {
+      continue;
+    }
+
+    if ((line[0] != ':') || (len % 2 == 0) || (nb < 5) || (nb > sizeof(rec)))
+    {
+      printf("HEX line %d: bad record\n", nb_line);
+      return -1;
+    }
+
+    for (uint32_t k = 0; k < nb; k++)
+    {
+      if (sscanf(&line[1 + 2 * k], "%2hhx", &rec[k]) != 1)
+      {
+        printf("HEX line %d: bad record\n", nb_line);
+        return -1;
+      }
+      sum += rec[k];
+    }
+
+    if ((rec[0] + 5u != nb) || (sum != 0))
+    {
+      printf("HEX line %d: bad length or checksum\n", nb_line);
+      return -1;
+    }
+
+    uint32_t addr = upper + ((rec[1] << 8) | rec[2]);
+    int32_t off;
+
+    switch (rec[3])
+    {
+      case 0x00:    // data
+        off = image_offset(addr, rec[0]);
+        if (off < 0)
+        {
+          return -1;
+        }
+        memcpy(&bin[off], &rec[4], rec[0]);
+        memset(&used[off], 1, rec[0]);
+        size = ((uint32_t)off + rec[0] > size) ? (uint32_t)off + rec[0] : size;
+        break;
+
+      case 0x01:    // end of file
+        return size;
+
+      case 0x02:    // extended segment address
+        upper = ((rec[4] << 8) | rec[5]) << 4;
+        break;
+
+      case 0x04:    // extended linear address
+        upper = ((rec[4] << 8) | rec[5]) << 16;
+        break;
+
+      default:      // start addresses: the bootloader has its own
+        break;
+    }
+  }
+
+  printf("HEX file without end record\n");
+  return -1;
+}
+
+/* ELF: the PT_LOAD segments, at their load (physical) address */
+int read_elf(FILE *file, uint8_t *bin, uint8_t *used)
+{
+  Elf32_Ehdr eh;
+  uint32_t size = 0;
+
+  if ((fread(&eh, 1, sizeof(eh), file) != sizeof(eh)) || (eh.e_ident[EI_CLASS] != ELFCLASS32) ||
+      (eh.e_ident[EI_DATA] != ELFDATA2LSB) || (eh.e_machine != EM_ARM))
+  {
+    printf("Not a 32-bit little-endian ARM ELF\n");
+    return -1;
+  }
+
+  for (int k = 0; k < eh.e_phnum; k++)
+  {
+    Elf32_Phdr ph;
+    int32_t off;
+
+    fseek(file, eh.e_phoff + k * eh.e_phentsize, SEEK_SET);
+
+    if (fread(&ph, 1, sizeof(ph), file) != sizeof(ph))
+    {
+      printf("ELF read Error\n");
+      return -1;
+    }
+
+    // .bss and the like have nothing in the file
+    if ((ph.p_type != PT_LOAD) || (ph.p_filesz == 0))
+    {
+      continue;
+    }
+
+    off = image_offset(ph.p_paddr, ph.p_filesz);
+    if (off < 0)
+    {
+      return -1;
+    }
+
+    fseek(file, ph.p_offset, SEEK_SET);
+
+    if (fread(&bin[off], 1, ph.p_filesz, file) != ph.p_filesz)
+    {
+      printf("ELF read Error\n");
+      return -1;
+    }
+
+    memset(&used[off], 1, ph.p_filesz);
+    size = (off + ph.p_filesz > size) ? off + ph.p_filesz : size;
+  }
+
+  return size;
+}
+
+/* print the populated ranges of an image */
+void print_segments(const uint8_t *used, uint32_t size)
+{
+  for (uint32_t i = 0; i < size; )
+  {
+    uint32_t j = i;
+
+    while ((j < size) && (used[j] == used[i]))
+    {
+      j++;
+    }
+
+    if (used[i])
+    {
+      printf("  0x%08X-0x%08X %u bytes\n", ETX_SLOT_A_ADDR + i, ETX_SLOT_A_ADDR + j, j - i);
+    }
+    i = j;
+  }
+}
+
+/* read an image: raw binary, Intel HEX or ELF. Outside of the ranges given
+   by the file, the image is erased flash (0xFF). The header of a HEX or ELF
+   image, straight from the linker, is completed here (as etx_image does).
+   Returns the image size, or -1 */
+int load_image(const char *name, uint8_t *bin, uint8_t *used)
+{
+  FILE *file = fopen(name, "rb");
+  char magic[12] = {0};     /* ELF magic, or the shortest HEX record (11 characters) */
+  bool is_bin = false;
+  int size;
+
+  if (file == NULL)
+  {
+    printf("Can not open %s\n", name);
+    return -1;
+  }
+
+  memset(bin, 0xFF, ETX_OTA_MAX_FW_SIZE);
+  memset(used, 0, ETX_OTA_MAX_FW_SIZE);
+
+  if (fread(magic, 1, sizeof(magic) - 1, file) != sizeof(magic) - 1)
+  {
+    memset(magic, 0, sizeof(magic));
+  }
+  fseek(file, 0L, SEEK_SET);
+
+  if (memcmp(magic, ELFMAG, SELFMAG) == 0)
+  {
+    size = read_elf(file, bin, used);
+  }
+  else if ((magic[0] == ':') && (strspn(&magic[1], "0123456789ABCDEFabcdef") == sizeof(magic) - 2))
+  {
+    size = read_hex(file, bin, used);
+  }
+  else
+  {
+    is_bin = true;
+    size = read_bin(file, bin, used);
+  }
+
+  fclose(file);
+
+  if ((size < 0) || is_bin)
+  {
+    return size;
+  }
+
+  printf("%s: segments\n", name);
+  print_segments(used, size);
+
+  // Pad with erased flash value, fill the header
+  size = (size + 3) & ~3;
+
+  ETX_IMAGE_HDR_ *hdr = (ETX_IMAGE_HDR_ *) &bin[ETX_IMAGE_HDR_OFFSET];
+  uint32_t body = ETX_IMAGE_HDR_OFFSET + sizeof(ETX_IMAGE_HDR_);
+
+  if ((size >= (int)body) && (hdr->magic == ETX_IMAGE_MAGIC) && (hdr->crc32 == ETX_IMAGE_UNSET))
+  {
+    hdr->image_size = size;
+    hdr->crc32 = crc32_stm32(0xFFFFFFFF, bin, ETX_IMAGE_HDR_OFFSET);
+    hdr->crc32 = crc32_stm32(hdr->crc32, &bin[body], size - body);
+  }
+
+  return size;
+}
+
+/* length of the run of 0xFF at buf[pos], 8 bytes at a time */
+uint32_t ff_run(const uint8_t *buf, uint32_t pos, uint32_t end)
+{
+  uint32_t p = pos;
+  uint64_t word;
+
+  while (p + sizeof(word) <= end)
+  {
+    memcpy(&word, &buf[p], sizeof(word));
+
+    if (word != UINT64_MAX)
+    {
+      break;
+    }
+    p += sizeof(word);
+  }
+
+  while ((p < end) && (buf[p] == 0xFF))
+  {
+    p++;
+  }
+
+  return p - pos;
+}
+
+/* length of the gap at APP_BIN[pos] (4-byte aligned): bytes not given by the
+   image file (HEX, ELF), by words */
+uint32_t gap_run(uint32_t pos, uint32_t end)
+{
+  uint32_t p = pos;
+
+  // sent as erased flash to a device without skip packets
+  if (!(dev_features & ETX_OTA_FEATURE_SKIP))
+  {
+    return 0;
+  }
+
+  while ((p + 4 <= end) && !(APP_USED[p] | APP_USED[p + 1] | APP_USED[p + 2] | APP_USED[p + 3]))
+  {
+    p += 4;
+  }
 
-  memset(DATA_BUF, 0, ETX_OTA_PACKET_MAX_SIZE);
+  // up to the end of the image
+  while ((p < end) && (p + 4 > end) && !APP_USED[p])
+  {
+    p++;
+  }
 
-  ota_end->sof = ETX_OTA_SOF;
-  ota_end->packet_type = ETX_OTA_PACKET_TYPE_CMD;
-  ota_end->data_len = 1;
-  ota_end->cmd = ETX_OTA_CMD_END;
-  ota_end->crc = 0x66778899; // TODO: Add CRC
-  ota_end->eof = ETX_OTA_EOF;
+  return p - pos;
+}
 
-  len = sizeof(ETX_OTA_COMMAND_);
+/* first 4-byte aligned position of [from, to) of APP_BIN starting a gap, or
+   a run of 0xFF worth a skip packet, to if none */
+uint32_t next_skip(uint32_t from, uint32_t to, uint32_t end)
+{
+  uint32_t word;
+  uint32_t prev = 0;
 
-  // send OTA END
-  for (int i = 0; i < len; i++)
+  for (uint32_t p = from; (p < to) && (p + sizeof(word) <= end); p += sizeof(word))
   {
-    delay(1);
-    
-    if (write(comport, &DATA_BUF[i], 1)==0)
-    {
-      // some data missed.
-      printf("OTA END : Send Err\n");
-      ex = -1;
-      break;
-    }
+    memcpy(&word, &APP_BIN[p], sizeof(word));
 
-    /* //xx//
-    if (RS232_SendByte(comport, DATA_BUF[i]))
+    if (gap_run(p, end) > 0)
     {
-      // some data missed.
-      printf("OTA END : Send Err\n");
-      ex = -1;
-      break;
+      return p;
     }
-    */
-  }
 
-  if (ex >= 0)
-  {
-    if (!is_ack_resp_received(comport))
+    // only where a run starts
+    if ((skip_min > 0) && (word == UINT32_MAX) && ((p == from) || (prev != UINT32_MAX)) &&
+        (ff_run(APP_BIN, p, end) >= skip_min))
     {
-      // Received NACK
-      printf("OTA END : NACK\n");
-      ex = -1;
+      return p;
     }
+    prev = word;
   }
-  printf("OTA END [ex = %d]\n", ex);
-  return ex;
+
+  return to;
 }
 
-/* Build and send the OTA Header */
-int send_ota_header(int comport, meta_info *ota_info)
+/* next packet of the plain image at APP_BIN[i]: the length of a run to
+   skip (*run), or else the size of a data packet.
+   The first packet holds the image header, the packets stay aligned. */
+uint16_t next_packet(uint32_t i, uint32_t end, uint32_t *run)
 {
-  uint16_t len;
-  ETX_OTA_HEADER_ *ota_header = (ETX_OTA_HEADER_ *) DATA_BUF;
-  int ex = 0;
+  uint16_t size = ((end - i) >= chunk_size) ? chunk_size : end - i;
 
-  memset(DATA_BUF, 0, ETX_OTA_PACKET_MAX_SIZE);
+  *run = 0;
 
-  ota_header->sof = ETX_OTA_SOF;
-  ota_header->packet_type = ETX_OTA_PACKET_TYPE_HEADER;
-  ota_header->data_len = sizeof(meta_info);
-  ota_header->crc = 0x00; // TODO: Add CRC
-  ota_header->eof = ETX_OTA_EOF;
-
-  memcpy(&ota_header->meta_data, ota_info, sizeof(meta_info));
-
-  len = sizeof(ETX_OTA_HEADER_);
-  //printf("--- sending HEADER (len=%d)....\n", len);
-
-  // send OTA Header
-  for (int i = 0; i < len; i++)
+  if (i > 0)
   {
-    delay(1);
+    *run = (skip_min > 0) ? ff_run(APP_BIN, i, end) : 0;
 
-    if (write(comport, &DATA_BUF[i], 1)==0)
+    if (i + *run < end)
     {
-      // some data missed.
-      printf("OTA HEADER : Send Err\n");
-      ex = -1;
-      break;
+      *run &= ~3u;
     }
-  
-    //printf("%02X.", DATA_BUF[i]);
 
-    /* //xx//
-    if (RS232_SendByte(comport, DATA_BUF[i]))
+    if (*run < skip_min)
     {
-      // some data missed.
-      printf("OTA HEADER : Send Err\n");
-      ex = -1;
-      break;
+      *run = 0;
     }
-    */
-  }
 
-  //printf("\n");
-
-  if (ex >= 0)
-  {
-    if (!is_ack_resp_received(comport))
+    if (gap_run(i, end) > *run)
     {
-      // Received NACK
-      printf("OTA HEADER : NACK\n");
-      ex = -1;
+      *run = gap_run(i, end);
     }
   }
-  // printf("OTA HEADER [ex = %d]\n", ex);
-  return ex;
+
+  if (*run > 0)
+  {
+    return 0;
+  }
+
+  // the packet stops where a run starts
+  return next_skip(i + ((i > 0) ? 4 : CHUNK_MIN), i + size, end) - i;
 }
 
-/* Build and send the OTA Data */
-int send_ota_data(int comport, uint8_t *data, uint16_t data_len)
+/* bytes of the plain image really sent: without the runs skipped */
+uint32_t plain_size(uint32_t size)
 {
-  uint16_t len;
-  ETX_OTA_DATA_ *ota_data = (ETX_OTA_DATA_ *) DATA_BUF;
-  int ex = 0;
+  uint32_t sent = 0;
+  uint32_t run;
 
-  // Clean the buffer
-  memset(DATA_BUF, 0, ETX_OTA_PACKET_MAX_SIZE);
+  for (uint32_t i = 0; i < size; )
+  {
+    uint16_t len = next_packet(i, size, &run);
 
-  ota_data->sof = ETX_OTA_SOF;
-  ota_data->packet_type = ETX_OTA_PACKET_TYPE_DATA;
-  ota_data->data_len = data_len;
+    i += (run > 0) ? run : len;
+    sent += len;
+  }
 
-  len = 4;
+  return sent;
+}
 
-  // Copy the data
-  memcpy(&DATA_BUF[len], data, data_len);
-  len += data_len;
-  uint32_t crc = 0u; // TODO: Add CRC
+/* sort helper for the percentiles */
+int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
 
-  // Copy the crc
-  memcpy(&DATA_BUF[len], (uint8_t *)&crc, sizeof(crc));
-  len += sizeof(crc);
+  return (x > y) - (x < y);
+}
 
-  // Add the EOF
-  DATA_BUF[len] = ETX_OTA_EOF;
-  len++;
+/* nearest-rank percentile of the sorted ACK round-trip times */
+uint32_t rtt_percentile(uint32_t p)
+{
+  uint32_t rank = (p * nb_rtt + 99) / 100;
 
-  // send OTA Data
-  for (int i = 0; i < len; i++)
-  {
-    delay(1);
+  return (nb_rtt == 0) ? 0 : rtt_us[(rank > 0) ? rank - 1 : 0];
+}
 
-    if (write(comport, &DATA_BUF[i], 1)==0)
-    {
-      // some data missed.
-      printf("OTA DATA : Send Err\n");
-      ex = -1;
-      break;
-    }
-  }
+/* print the transfer measures on one line */
+void print_result(uint32_t app_size, uint64_t elapsed_us)
+{
+  qsort(rtt_us, nb_rtt, sizeof(rtt_us[0]), cmp_u32);
+
+  printf("\nResult: bytes=%u time_ms=%u rate=%u chunk=%u pace_us=%u packets=%u nacks=%u retx=%u "
+         "rtt_p50_us=%u rtt_p90_us=%u rtt_p99_us=%u rtt_max_us=%u sent=%u ratio=%.2f skipped=%u "
+         "timeouts=%u resets=%u fec=%d window=%u credit_wait_ms=%u\n",
+         app_size, (uint32_t)(elapsed_us / 1000u),
+         (uint32_t)((elapsed_us > 0) ? (uint64_t)app_size * 1000000u / elapsed_us : 0),
+         chunk_size, pace_us, nb_packets, nb_nacks, nb_retx,
+         rtt_percentile(50), rtt_percentile(90), rtt_percentile(99), rtt_percentile(100),
+         sent_size - nb_skipped, (sent_size > nb_skipped) ? (double)app_size / (sent_size - nb_skipped) : 0.0,
+         nb_skipped, nb_timeouts, nb_resets, (fec == 1) || fec_on, (flight_max > 1) ? flight_max : 1,
+         (uint32_t)(credit_wait_us / 1000u));
+}
 
-#ifdef DEBUG
-  printf("*** debug 5a [ex=%d]", ex);
-#endif
+/* termios speed of a baud rate, 0 if not supported */
+speed_t baud_speed(int baud)
+{
+  const int rate[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600};
+  const speed_t speed[] = {B9600, B19200, B38400, B57600, B115200, B230400, B460800, B921600};
 
-  if (ex >= 0)
+  for (unsigned i = 0; i < sizeof(rate) / sizeof(rate[0]); i++)
   {
-
-#ifdef DEBUG
-    printf("*** debug 5b");
-#endif
-
-    if (!is_ack_resp_received(comport))
+    if (rate[i] == baud)
     {
-      // Received NACK
-      printf("OTA DATA : NACK\n");
-      ex = -1;
+      return speed[i];
     }
   }
 
-#ifdef DEBUG
-  printf("***  debug 6");
-#endif
-
-  // printf("OTA DATA [ex = %d]\n", ex);
-  return ex;
+  return 0;
 }
 
 int main(int argc, char *argv[])
@@ -427,8 +2083,12 @@ int main(int argc, char *argv[])
   //int bdrate = 115200;              /* 115200 baud */
   //char mode[] = {'8', 'N', '1', 0}; /* *-bits, No parity, 1 stop bit */
   char bin_name[1024];
+  const char *port_name;
   int ex = 0;
-  FILE *Fptr = NULL;
+  int baud = 115200;
+  uint64_t start_us = 0;
+  const char *base_name = NULL;
+  int base_size = 0;
 
   printf("OTA update v%s\n\n", VERSION);
 
@@ -438,6 +2098,31 @@ int main(int argc, char *argv[])
     {
       printf("Please feed the COM PORT number and the Application Image....!!!\n");
       printf("Example: .\\etx_ota_app.exe 8 ..\\..\\debug\\blinky.bin\n");
+      printf("         .\\etx_ota_app.exe /dev/pts/3 blinky.bin   (device path, e.g. ota_sim)\n");
+      printf("         .\\etx_ota_app.exe 8 Blink_Quick.elf   (image: .bin, Intel HEX or ELF)\n");
+      printf("         .\\etx_ota_app.exe 8 --rollback   (go back to the previous image)\n");
+      printf("         .\\etx_ota_app.exe 8 --stats      (boot and OTA stage timing)\n");
+      printf("         .\\etx_ota_app.exe 8 --info       (what the device supports)\n");
+      printf("\nTransfer options, after the image:\n");
+      printf("  --chunk n    data packet payload, %d to %d bytes, multiple of 4 (default: adaptive, from the largest\n"
+             "               the device takes)\n",
+             CHUNK_MIN, ETX_OTA_DATA_MAX_SIZE);
+      printf("  --pace us    gap between two bytes sent, 0 to send each packet at once (default 0 to a device\n"
+             "               that gives credits, %d otherwise)\n", PACE_US);
+      printf("  --log file   decisions of the adaptive transfer (payload, gap between two packets), CSV\n");
+      printf("  --baud b     baud rate, 9600 to 921600 (default 115200)\n");
+      printf("  --compress   send the image compressed (LZSS, 4KB window), if it gets smaller\n");
+      printf("               (default: if the device takes it), --no-compress to send it as it is\n");
+      printf("  --base file  send a delta against this image, the one the device runs (best with --compress)\n");
+      printf("  --skip n     runs of 0xFF of n bytes or more are skipped, not sent, 0 sends them (default %d)\n",
+             SKIP_MIN);
+      printf("  --no-info    don't ask the device what it supports (bootloader older than GET INFO)\n");
+      printf("  --retries n  packets sent again (corrupted, lost, not taken) before the update fails (default %d)\n",
+             RETRY_BUDGET);
+      printf("  --timeout ms wait for a response, then the packet is sent again (default %d)\n", RESP_TIMEOUT_MS);
+      printf("  --fec mode   Reed-Solomon parity on the data packets, the device corrects a few wrong bytes:\n");
+      printf("               on, off, auto (default: once the link corrupts more than 1 packet out of %u)\n",
+             ETX_FEC_DATA / ETX_FEC_NPAR);
 
       printf("\nAvailable ports:\n");
 
@@ -452,11 +2137,124 @@ int main(int argc, char *argv[])
       break;
     }
 
-    // get the COM port Number
-    comport = atoi(argv[1]);
+    // get the COM port Number, or a device path (e.g. /dev/pts/3 of ota_sim)
+    if (argv[1][0] == '/')
+    {
+      port_name = argv[1];
+    }
+    else
+    {
+      comport = atoi(argv[1]);
+
+      if ((comport < 0) || (comport >= RS232_PORTNR))
+      {
+        printf("Bad COM port number %d\n", comport);
+        ex = -1;
+        break;
+      }
+      port_name = comports[comport];
+    }
     strcpy(bin_name, argv[2]);
 
-    printf("Opening COM%d [%s]...\n", comport, comports[comport]);
+    // Transfer options
+    for (int a = 3; a < argc; a++)
+    {
+      if ((strcmp(argv[a], "--chunk") == 0) && (a + 1 < argc))
+      {
+        chunk_size = atoi(argv[++a]);
+      }
+      else if ((strcmp(argv[a], "--log") == 0) && (a + 1 < argc))
+      {
+        adapt_log_name = argv[++a];
+      }
+      else if ((strcmp(argv[a], "--pace") == 0) && (a + 1 < argc))
+      {
+        pace_us = atoi(argv[++a]);
+        pace_set = true;
+      }
+      else if ((strcmp(argv[a], "--baud") == 0) && (a + 1 < argc))
+      {
+        baud = atoi(argv[++a]);
+      }
+      else if (strcmp(argv[a], "--compress") == 0)
+      {
+        compress = 1;
+      }
+      else if (strcmp(argv[a], "--no-compress") == 0)
+      {
+        compress = 0;
+      }
+      else if (strcmp(argv[a], "--no-info") == 0)
+      {
+        get_info = false;
+      }
+      else if ((strcmp(argv[a], "--base") == 0) && (a + 1 < argc))
+      {
+        base_name = argv[++a];
+      }
+      else if ((strcmp(argv[a], "--skip") == 0) && (a + 1 < argc))
+      {
+        skip_min = atoi(argv[++a]);
+      }
+      else if ((strcmp(argv[a], "--retries") == 0) && (a + 1 < argc))
+      {
+        retry_budget = atoi(argv[++a]);
+      }
+      else if ((strcmp(argv[a], "--timeout") == 0) && (a + 1 < argc))
+      {
+        resp_timeout_ms = atoi(argv[++a]);
+      }
+      else if ((strcmp(argv[a], "--fec") == 0) && (a + 1 < argc) &&
+               ((strcmp(argv[a + 1], "on") == 0) || (strcmp(argv[a + 1], "off") == 0) ||
+                (strcmp(argv[a + 1], "auto") == 0)))
+      {
+        a++;
+        fec = (strcmp(argv[a], "on") == 0) ? 1 : (strcmp(argv[a], "off") == 0) ? 0 : -1;
+      }
+      else
+      {
+        printf("Bad option %s\n", argv[a]);
+        ex = -1;
+        break;
+      }
+    }
+
+    if (ex < 0)
+    {
+      break;
+    }
+
+    // The first data packet must hold the image header, every packet but
+    // the last one must keep the flash programming aligned
+    if ((chunk_size != 0) && ((chunk_size < CHUNK_MIN) || (chunk_size > ETX_OTA_DATA_MAX_SIZE) || (chunk_size % 4)))
+    {
+      printf("Bad chunk size %d\n", chunk_size);
+      ex = -1;
+      break;
+    }
+
+    adapt.on = (chunk_size == 0);
+
+    if (baud_speed(baud) == 0)
+    {
+      printf("Baud rate %d not supported\n", baud);
+      ex = -1;
+      break;
+    }
+
+    if (base_name != NULL)
+    {
+      base_size = load_image(base_name, BASE_BIN, APP_USED);
+
+      if ((base_size < 0) || !image_is_valid(BASE_BIN, base_size))
+      {
+        printf("Base %s: not a valid image\n", base_name);
+        ex = -1;
+        break;
+      }
+    }
+
+    printf("Opening %s...\n", port_name);
 
     /*if (RS232_OpenComport(comport, bdrate, mode, 0))
     {
@@ -466,7 +2264,7 @@ int main(int argc, char *argv[])
     }*/
 
     // Open the serial port. Change device path as needed (currently set to an standard FTDI USB-UART cable type device)
-    serial_port = open(comports[comport], O_RDWR);
+    serial_port = open(port_name, O_RDWR);
     //printf("res=%d\n", serial_port);
 
     if (serial_port<0)
@@ -508,14 +2306,14 @@ int main(int argc, char *argv[])
       // tty.c_oflag &= ~OXTABS; // Prevent conversion of tabs to spaces (NOT PRESENT ON LINUX)
       // tty.c_oflag &= ~ONOEOT; // Prevent removal of C-d chars (0x004) in output (NOT PRESENT ON LINUX)
 
-      tty.c_cc[VTIME] = 10;    // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
+      tty.c_cc[VTIME] = 1;     // Wait for up to 100ms (1 decisecond), returning as soon as any data is received.
       tty.c_cc[VMIN] = 0;
 
       // Set in/out baud rate to be 9600
       //cfsetispeed(&tty, B9600);
       //cfsetospeed(&tty, B9600);
-      cfsetispeed(&tty, B115200);
-      cfsetospeed(&tty, B115200);
+      cfsetispeed(&tty, baud_speed(baud));
+      cfsetospeed(&tty, baud_speed(baud));
 
       // Save tty settings, also checking for error
       if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {
@@ -524,8 +2322,81 @@ int main(int argc, char *argv[])
       }
     ////////////////////////////////////////////////////////////////////////////////////
 
-    // flush the port
-    // RS232_flushRXTX(comport);
+    // flush the port: nothing left of an earlier run
+    tcflush(comport, TCIOFLUSH);
+
+    if (strcmp(bin_name, "--rollback") == 0)
+    {
+      // No transfer, the device only switches its active slot
+      printf("\n>>> sending OTA Rollback...\n");
+
+      ex = send_ota_rollback(comport);
+
+      if (ex < 0)
+      {
+        printf("send_ota_rollback Err\n");
+      }
+      break;
+    }
+
+    if (strcmp(bin_name, "--stats") == 0)
+    {
+      // No transfer, read the stage timing table
+      printf("\n>>> sending OTA Get Stats...\n");
+
+      ex = send_ota_get_stats(comport);
+
+      if (ex < 0)
+      {
+        printf("send_ota_get_stats Err\n");
+      }
+      break;
+    }
+
+    if (strcmp(bin_name, "--info") == 0)
+    {
+      // No transfer, the device waits for an update after it
+      printf("\n>>> sending OTA Get Info...\n");
+
+      ex = send_ota_get_info(comport, &dev_info);
+
+      if (ex < 0)
+      {
+        printf("send_ota_get_info Err\n");
+        break;
+      }
+      print_info(&dev_info);
+      break;
+    }
+
+    start_us = now_us();
+    etx_fec_init();
+
+    // What the device supports: the transfer settings follow
+    if (get_info)
+    {
+      printf("\n>>> sending OTA Get Info...\n");
+
+      ex = send_ota_get_info(comport, &dev_info);
+
+      if (ex < 0)
+      {
+        printf("send_ota_get_info Err\n");
+        break;
+      }
+      print_info(&dev_info);
+
+      ex = negotiate(&dev_info);
+
+      if (ex < 0)
+      {
+        break;
+      }
+    }
+    else if (chunk_size == 0)
+    {
+      chunk_size = ETX_OTA_DATA_MAX_SIZE;
+    }
 
     // send OTA Start command
 
@@ -541,25 +2412,97 @@ int main(int argc, char *argv[])
 
     printf("\nOpening Binary file : %s\n", bin_name);
 
-    Fptr = fopen(bin_name, "rb");
+    // read the full image (raw binary, Intel HEX or ELF)
+    int load_size = load_image(bin_name, APP_BIN, APP_USED);
 
-    if (Fptr == NULL)
+    if (load_size < 0)
     {
-      printf("Can not open %s\n", bin_name);
       ex = -1;
       break;
     }
 
-    fseek(Fptr, 0L, SEEK_END);
-    uint32_t app_size = ftell(Fptr);
-    fseek(Fptr, 0L, SEEK_SET);
+    uint32_t app_size = load_size;
+
+    printf("Image size = %d\n", app_size);
+
+    // Check the image header (filled by etx_image, or here for HEX and ELF)
+    ETX_IMAGE_HDR_ *hdr = (ETX_IMAGE_HDR_ *) &APP_BIN[ETX_IMAGE_HDR_OFFSET];
 
-    printf("File size = %d\n", app_size);
+    if (!image_is_valid(APP_BIN, app_size))
+    {
+      printf("Not a valid image (did you run etx_image on it?)\n");
+      ex = -1;
+      break;
+    }
+
+    printf("Image v%d.%d.%d crc=0x%08X\n", hdr->version_major, hdr->version_minor,
+           hdr->version_patch, hdr->crc32);
 
     // Send OTA Header
     meta_info ota_info;
+    memset(&ota_info, 0, sizeof(ota_info));
     ota_info.package_size = app_size;
-    ota_info.package_crc = 0; // TODO: Add CRC
+    ota_info.package_crc = hdr->crc32;
+
+    // What is sent: the image or its delta, compressed or not
+    uint8_t *send_bin = APP_BIN;
+    uint8_t send_type = ETX_OTA_PACKET_TYPE_DATA;
+
+    sent_size = app_size;
+
+    // The bytes of the plain image on the link, without the runs skipped
+    uint32_t plain = plain_size(app_size);
+
+    // Delta against the image of the device: it rebuilds the new one from it
+    const ETX_IMAGE_HDR_ *base_hdr = (const ETX_IMAGE_HDR_ *) &BASE_BIN[ETX_IMAGE_HDR_OFFSET];
+
+    if ((base_name != NULL) && !(dev_features & ETX_OTA_FEATURE_DELTA))
+    {
+      printf("The device doesn't take deltas, the image is sent as it is\n");
+    }
+    else if ((base_name != NULL) && get_info && (dev_info.active_crc != base_hdr->crc32))
+    {
+      printf("The device doesn't run the base image (crc=0x%08X, it runs crc=0x%08X), "
+             "the image is sent as it is\n", base_hdr->crc32, dev_info.active_crc);
+    }
+    else if (base_name != NULL)
+    {
+      uint32_t delta_size = delta_build(BASE_BIN, base_size, APP_BIN, app_size, DELTA_BIN);
+
+      printf("Delta: %u bytes against %s (crc=0x%08X)\n", delta_size, base_name, base_hdr->crc32);
+
+      if (delta_size < plain)
+      {
+        send_bin = DELTA_BIN;
+        sent_size = delta_size;
+        plain = delta_size;
+        ota_info.base_crc = base_hdr->crc32;
+      }
+      else
+      {
+        printf("No gain, the image is sent as it is\n");
+      }
+    }
+
+    // Compression: the bootloader inflates it as it comes
+    if ((compress == 1) || ((compress < 0) && (dev_features & ETX_OTA_FEATURE_COMPRESSION)))
+    {
+      uint32_t lz_size = lz_compress(send_bin, sent_size, LZ_BIN);
+
+      printf("Compressed: %u -> %u bytes (ratio %.2f)\n", sent_size, lz_size, (double)sent_size / lz_size);
+
+      // against what would be sent: the runs of 0xFF are skipped anyway
+      if (lz_size < plain)
+      {
+        send_bin = LZ_BIN;
+        send_type = ETX_OTA_PACKET_TYPE_DATA_COMPRESSED;
+        sent_size = lz_size;
+      }
+      else
+      {
+        printf("No gain, sent uncompressed\n");
+      }
+    }
 
     printf("\n>>> sending OTA Header...\n");
 
@@ -568,50 +2511,155 @@ int main(int argc, char *argv[])
     if (ex < 0)
     {
       printf("send_ota_header Err\n");
-      break;
-    }
 
-    // read the full image
-    if (fread(APP_BIN, 1, app_size, Fptr) != app_size)
-    {
-      printf("App/FW read Error\n");
-      ex = -1;
+      if (ota_info.base_crc != 0)
+      {
+        printf("The device doesn't run the base image (crc=0x%08X)\n", ota_info.base_crc);
+      }
       break;
     }
 
     // usleep(1000000);
     uint16_t size = 0;
     uint8_t pack=1;
+    uint64_t ack_us;                /* last data packet ACKed */
 
-    delay(100);
+    adapt_start(start_us);
+    ack_us = now_us();
 
-    for (uint32_t i = 0; i < app_size; )
+    for (uint32_t i = 0; (i < sent_size) || (nb_flight > 0); )
     {
-      if ((app_size - i) >= ETX_OTA_DATA_MAX_SIZE)
+      uint32_t run = 0;
+
+      // Packets in flight: the next one goes if the window and the credits
+      // allow it, if not (or at the end) the next response is read
+      if ((nb_flight > 0) && ((i >= sent_size) || !flight_open()))
       {
-        size = ETX_OTA_DATA_MAX_SIZE;
+        ex = flight_collect(comport, &ack_us);
+
+        if (ex < 0)
+        {
+          printf("send_ota_data Err [i=%d]\n", i);
+          break;
+        }
+
+        if (ex > 0)
+        {
+          if ((dev_resp.next_offset > sent_size) || !retry(1))
+          {
+            printf("send_ota_data Err [i=%d, device at %u]\n", i, dev_resp.next_offset);
+            ex = -1;
+            break;
+          }
+
+          i = dev_resp.next_offset;
+          printf(">>> sending again from %u\n", i);
+        }
+        continue;
+      }
+
+      if ((sent_size - i) >= chunk_size)
+      {
+        size = chunk_size;
       }
       else
       {
-        size = app_size - i;
+        size = sent_size - i;
       }
 
-      printf("\n>>> sending OTA Data (tot=%d size=%d i=%d)\n", app_size, size, i+size);
-      // printf("[%d/%d]\r\n", i/ETX_OTA_DATA_MAX_SIZE, app_size/ETX_OTA_DATA_MAX_SIZE);
-      //printf("\n>>> Sending Data #%d [%d bytes]\n", pack, size);
+      // The gaps between the segments and the runs of 0xFF of a plain image
+      // are skipped: the slot is erased.
+      if ((send_type == ETX_OTA_PACKET_TYPE_DATA) && (send_bin == APP_BIN))
+      {
+        size = next_packet(i, sent_size, &run);
+      }
 
-      ex = send_ota_data(comport, &APP_BIN[i], size);
+      if (run > 0)
+      {
+        uint8_t run_le[4];
+
+        printf("\n>>> sending OTA Skip (%d bytes at %d)\n", run, i);
+
+        etx_ota_put32(run_le, run);
+
+        if (flight_open())
+        {
+          if (flight_send(comport, ETX_OTA_PACKET_TYPE_DATA_SKIP, i, run_le, sizeof(run_le), run) < 0)
+          {
+            printf("send_ota_data Err [i=%d]\n", i);
+            ex = -2;
+            break;
+          }
+          i += run;
+          continue;
+        }
+        ex = send_ota_data(comport, ETX_OTA_PACKET_TYPE_DATA_SKIP, i, run_le, sizeof(run_le));
+      }
+      else
+      {
+        printf("\n>>> sending OTA Data (tot=%d size=%d i=%d)\n", sent_size, size, i+size);
+        // printf("[%d/%d]\r\n", i/ETX_OTA_DATA_MAX_SIZE, app_size/ETX_OTA_DATA_MAX_SIZE);
+        //printf("\n>>> Sending Data #%d [%d bytes]\n", pack, size);
+
+        // the device takes it while it writes the ones before: in flight
+        if (flight_open())
+        {
+          if (flight_send(comport, send_type, i, &send_bin[i], size, size) < 0)
+          {
+            printf("send_ota_data Err [i=%d]\n", i);
+            ex = -2;
+            break;
+          }
+          i += size;
+          continue;
+        }
+        ex = send_ota_data(comport, send_type, i, &send_bin[i], size);
+      }
 
-      if (ex < 0)
+      // The device says where it is: a packet out of sequence, or an ACK of
+      // an older packet, and the data is sent from there
+      if ((ex == -2) || ((ex == -1) && (dev_resp.reason != ETX_OTA_NACK_SEQUENCE)))
       {
         printf("send_ota_data Err [i=%d]\n", i);
         break;
       }
 
-      i += size;
-      pack++;
+      // the payload went down (adaptive transfer): the data is cut again
+      if (ex == 1)
+      {
+        printf(">>> sending again in packets of %u bytes\n", chunk_size);
+        continue;
+      }
+
+      if ((ex == 0) && (dev_resp.next_offset == i + ((run > 0) ? run : size)))
+      {
+        uint64_t t = now_us();
+
+        if (run == 0)
+        {
+          pack++;
+          adapt_ack(i, size, t - ack_us);
+        }
+        i = dev_resp.next_offset;
+        nb_skipped += run;
+        ack_us = t;
+        flight_hold = false;
+
+        // the device takes the next packet right after its ACK, unless it
+        // showed it couldn't (adapt.gap_us)
+        delay(adapt.gap_us / 10);
+        continue;
+      }
+
+      if ((dev_resp.next_offset > sent_size) || !retry(1))
+      {
+        printf("send_ota_data Err [i=%d, device at %u]\n", i, dev_resp.next_offset);
+        ex = -1;
+        break;
+      }
 
-      delay(300);
+      i = dev_resp.next_offset;
+      printf(">>> sending again from %u\n", i);
     }
 
     if (ex < 0)
@@ -630,11 +2678,20 @@ int main(int argc, char *argv[])
       break;
     }
 
+    print_result(app_size, now_us() - start_us);
+
   } while (false);
 
-  if (Fptr)
+  // How flaky the link was, also when the update failed
+  if ((ex < 0) && (nb_retx + nb_timeouts > 0))
+  {
+    printf("Retries: retx=%u timeouts=%u resets=%u (budget %u)\n", nb_retx, nb_timeouts, nb_resets, retry_budget);
+  }
+
+  if (adapt.log != NULL)
   {
-    fclose(Fptr);
+    fclose(adapt.log);
+    adapt.log = NULL;
   }
 
 /*  if (ex < 0 && argc<2)